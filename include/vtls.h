@@ -58,7 +58,8 @@ typedef enum {
 typedef enum {
   ssl_connection_none,
   ssl_connection_negotiating,
-  ssl_connection_complete
+  ssl_connection_complete,
+  ssl_connection_closing
 } ssl_connection_state;
 
 /* enum for the different supported SSL backends */
@@ -239,9 +240,52 @@ enum {
 	VTLS_CFG_CONNECT_TIMEOUT,
 	VTLS_CFG_READ_TIMEOUT,
 	VTLS_CFG_WRITE_TIMEOUT,
+	VTLS_CFG_CA_PATH_HASHED,
+	VTLS_CFG_CA_STORE,
+	VTLS_CFG_TRUST_RELOAD,
+	VTLS_CFG_TRUST_PRELOAD,
+	VTLS_CFG_VERIFY_CACHE_TTL,
+	VTLS_CFG_SESSION_CACHE,
+	VTLS_CFG_SESSION_FILE,
+	VTLS_CFG_SESSION_SHM,
+	VTLS_CFG_TRACE_LEVEL,
+	VTLS_CFG_HANDSHAKE_THREADS,
+	VTLS_CFG_KTLS,
+	VTLS_CFG_IO_URING,
+	VTLS_CFG_READ_AHEAD,
 	VTLS_CFG_LAST
 };
 
+/* what vtls_want() reports a session is waiting for */
+enum {
+	VTLS_WANT_READ = 1,
+	VTLS_WANT_WRITE = 2
+};
+
+/* events reported by a vtls_reactor */
+enum {
+	VTLS_EVENT_CONNECTED = 1, /* handshake complete */
+	VTLS_EVENT_READABLE = 2, /* vtls_read() has data, EOF or an error to report */
+	VTLS_EVENT_WRITABLE = 4, /* only after vtls_reactor_want_write() */
+	VTLS_EVENT_CLOSED = 8, /* the peer hung up */
+	VTLS_EVENT_ERROR = 16, /* handshake failed, remove the session */
+	VTLS_EVENT_TIMEOUT = 32, /* connect, read or write timeout of the session's config passed */
+	VTLS_EVENT_SHUTDOWN = 64 /* vtls_reactor_shutdown() finished, remove the session */
+};
+
+/* how vtls_shutdown_nonblocking() closes the TLS layer */
+enum {
+	VTLS_SHUTDOWN_FAST = 0, /* send close_notify only */
+	VTLS_SHUTDOWN_FULL /* send close_notify and wait for the peer's */
+};
+
+/* trace levels, output goes to the debug message callback */
+enum {
+	VTLS_TRACE_NONE = 0,
+	VTLS_TRACE_SESSION, /* TLS session events */
+	VTLS_TRACE_IO /* every transport read and write */
+};
+
 enum {
 	VTLS_FILETYPE_PEM = 0,
 	VTLS_FILETYPE_DER = 0
@@ -250,6 +294,9 @@ enum {
 typedef struct ssl_config_data *ssl_config_data_t;
 typedef struct _vtls_config_st vtls_config_t;
 typedef struct _vtls_session_st vtls_session_t;
+typedef struct vtls_reactor_st vtls_reactor_t;
+typedef void (*vtls_reactor_callback_t)(vtls_session_t *sess, int events, void *ctx);
+typedef struct vtls_scheduler_st vtls_scheduler_t;
 
 void  __attribute__ ((format (printf, 2, 3))) error_printf(vtls_config_t *config, const char *fmt, ...);
 void  __attribute__ ((format (printf, 2, 3))) debug_printf(vtls_config_t *config, const char *fmt, ...);
@@ -269,12 +316,41 @@ size_t vtls_version(char *buffer, size_t size);
 
 ssize_t vtls_write(vtls_session_t *sess, const char *buf, size_t count, int *curlcode);
 ssize_t vtls_read(vtls_session_t *sess, char *buf, size_t count, int *curlcode);
+ssize_t vtls_sendfile(vtls_session_t *sess, int fd, off_t offset, size_t count, int *curlcode);
+int vtls_cork(vtls_session_t *sess);
+int vtls_flush(vtls_session_t *sess);
 int vtls_connect(vtls_session_t *sess, int sockfd, const char *hostname);
-int vtls_connect_nonblocking(vtls_session_t *sess, int sockfd, int *done);
+int vtls_connect_nonblocking(vtls_session_t *sess, int sockfd, const char *hostname, int *done);
+int vtls_want(vtls_session_t *sess);
+
+/* drive many sessions from one thread */
+int vtls_reactor_init(vtls_reactor_t **reactor);
+void vtls_reactor_deinit(vtls_reactor_t *reactor);
+int vtls_reactor_add(vtls_reactor_t *reactor, vtls_session_t *sess, int sockfd, const char *hostname,
+	vtls_reactor_callback_t callback, void *ctx);
+void vtls_reactor_remove(vtls_reactor_t *reactor, vtls_session_t *sess);
+int vtls_reactor_want_write(vtls_reactor_t *reactor, vtls_session_t *sess, int enable);
+int vtls_reactor_shutdown(vtls_reactor_t *reactor, vtls_session_t *sess, int how);
+int vtls_reactor_run(vtls_reactor_t *reactor, int timeout_ms);
+void vtls_reactor_wakeup(vtls_reactor_t *reactor);
+
+/* spread sessions over worker threads, each running a reactor */
+int vtls_scheduler_init(vtls_scheduler_t **sched, int nthreads);
+void vtls_scheduler_deinit(vtls_scheduler_t *sched);
+int vtls_scheduler_add(vtls_scheduler_t *sched, vtls_session_t *sess, int sockfd, const char *hostname,
+	vtls_reactor_callback_t callback, void *ctx);
+void vtls_scheduler_remove(vtls_scheduler_t *sched, vtls_session_t *sess);
+int vtls_scheduler_want_write(vtls_scheduler_t *sched, vtls_session_t *sess, int enable);
+int vtls_scheduler_shutdown(vtls_scheduler_t *sched, vtls_session_t *sess, int how);
+int vtls_scheduler_migrate(vtls_scheduler_t *sched, vtls_session_t *sess, int worker,
+	vtls_reactor_callback_t callback, void *ctx);
 /* tell the SSL stuff to close down all open information regarding
 	connections (and thus session ID caching etc) */
 void vtls_close(vtls_session_t *sess);
 int vtls_shutdown(vtls_session_t *sess);
+int vtls_shutdown_nonblocking(vtls_session_t *sess, int how, int *done);
+int vtls_session_resumed(vtls_session_t *sess);
+void vtls_session_cache_stats(unsigned long *hits, unsigned long *misses);
 
 /* get N random bytes into the buffer, return 0 if a find random is filled	in */
 int vtls_md5sum(unsigned char *tmp, /* input */
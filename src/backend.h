@@ -34,6 +34,7 @@ struct _vtls_config_st {
 	const char *CApath; /* certificate directory (doesn't work on windows) */
 	const char *CAfile; /* certificate to verify peer against */
 	const char *CRLfile; /* CRL to check certificate revocation */
+	const char *CAstore; /* compiled CA store, see vtls-trustc */
 	const char *CERTfile;
 	const char *KEYfile;
 	const char *issuercert; /* optional issuer certificate filename */
@@ -42,15 +43,27 @@ struct _vtls_config_st {
 	const char *cipher_list; /* list of ciphers to use */
 	const char *username; /* TLS username (for, e.g., SRP) */
 	const char *password; /* TLS password (for, e.g., SRP) */
+	const char *session_file; /* persistent TLS session store */
+	const char *session_shm; /* POSIX shm name of a TLS session store shared between processes */
 	int connect_timeout; /* connection timeout in ms */
 	int read_timeout; /* read timeout in ms */
 	int write_timeout; /* write timeout in ms */
+	int trust_preload; /* load the trust store in vtls_init(), using that many threads */
+	int verify_cache_ttl; /* seconds to remember verified peer chains, 0 = off */
+	int session_cache; /* max. number of TLS sessions cached for resumption, 0 = off */
+	int trace_level; /* VTLS_TRACE_*, only used from the config given to vtls_init() */
+	int handshake_threads; /* run reactor handshakes on that many threads, only used from the config given to vtls_init() */
+	int io_uring; /* receive buffers per reactor io_uring, 0 = epoll, only used from the config given to vtls_init() */
+	int read_ahead; /* bytes read from the socket at once, 0 = what GnuTLS asks for */
 	enum CURL_TLSAUTH authtype; /* TLS authentication type (default SRP) */
 	char version; /* what TLS version the client wants to use */
 	char verifypeer; /* if peer verification is requested */
 	char verifyhost; /* if hostname matching is requested */
 	char verifystatus; /* if certificate status check is requested */
 	char cert_type; /* filetype of CERTfile and KEYfile */
+	char capath_hashed; /* CApath is a c_rehash style directory, load CA certs on demand */
+	char trust_reload; /* reload CA certs and CRLs when their files change */
+	char ktls; /* move the record layer into the kernel after the handshake, if possible */
 };
 
 struct _vtls_session_st {
@@ -58,12 +71,12 @@ struct _vtls_session_st {
 	const char *hostname; /* SNI hostname */
 	void *backend_data;
 	struct timeval connect_start;
-	struct timeval read_start;
-	struct timeval write_start;
 	int sockfd;
 	int use;
 	int state;
 	int connecting_state;
+	void *reactor_data; /* set while a vtls_reactor drives the session */
+	void *uring_data; /* socket I/O through a reactor's io_uring, see uring.c */
 };
 
 /* API of backend TLS engines */
@@ -82,9 +95,14 @@ int backend_session_init(vtls_session_t *sess);
 void backend_session_deinit(vtls_session_t *sess);
 ssize_t backend_read(vtls_session_t *sess, char *buf, size_t count, int *curlcode);
 ssize_t backend_write(vtls_session_t *sess, const void *buf, size_t count, int *curlcode);
+ssize_t backend_sendfile(vtls_session_t *sess, int fd, off_t offset, size_t count, int *curlcode);
+int backend_cork(vtls_session_t *sess);
+int backend_flush(vtls_session_t *sess);
 int backend_connect(vtls_session_t *sess);
+int backend_connect_nonblocking(vtls_session_t *sess, int *done);
 void backend_close(vtls_session_t *sess);
 int backend_shutdown(vtls_session_t *sess);
+int backend_shutdown_nonblocking(vtls_session_t *sess, int how, int *done);
 void backend_session_free(void *ptr);
 size_t backend_version(char *buffer, size_t size);
 int backend_md5sum(unsigned char *tmp, /* input */
@@ -92,5 +110,9 @@ int backend_md5sum(unsigned char *tmp, /* input */
 						 unsigned char *md5sum, /* output */
 						 size_t md5len);
 int backend_cert_status_request(void);
+int backend_session_resumed(vtls_session_t *sess);
+size_t backend_pending(vtls_session_t *sess);
+int backend_ktls_active(vtls_session_t *sess);
+void backend_session_cache_stats(unsigned long *hits, unsigned long *misses);
 
 #endif /* _VTLS_BACKEND_H */
@@ -0,0 +1,584 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <gnutls/x509.h>
+
+#include "common.h"
+#include "capath.h"
+
+#define MISS_SLOTS 256 /* issuer DNs remembered as not found, direct mapped */
+
+struct capath_st {
+	pthread_rwlock_t lock; /* write-locked while anchors are added to tlist */
+	vtls_config_t *config;
+	gnutls_x509_trust_list_t tlist;
+	castore_t *store; /* compiled CA store, may be NULL */
+	char *dir; /* hashed CA directory, may be NULL */
+	gnutls_datum_t *issuers; /* raw issuer DNs found and loaded, sorted */
+	size_t nissuers;
+	size_t max_issuers;
+	gnutls_datum_t misses[MISS_SLOTS]; /* raw issuer DNs not found, see miss_slot() */
+};
+
+struct buffer {
+	unsigned char *data;
+	size_t size;
+	size_t alloc;
+};
+
+static int buffer_append(struct buffer *buf, const void *data, size_t size)
+{
+	if (buf->size + size > buf->alloc) {
+		size_t alloc = (buf->size + size) * 2;
+		unsigned char *p;
+
+		if (!(p = realloc(buf->data, alloc)))
+			return -1;
+
+		buf->data = p;
+		buf->alloc = alloc;
+	}
+
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+
+	return 0;
+}
+
+static int buffer_append_tl(struct buffer *buf, unsigned char tag, size_t len)
+{
+	unsigned char hdr[6];
+	int n = 0;
+
+	hdr[n++] = tag;
+	if (len < 0x80)
+		hdr[n++] = (unsigned char) len;
+	else if (len < 0x100) {
+		hdr[n++] = 0x81;
+		hdr[n++] = (unsigned char) len;
+	} else if (len < 0x10000) {
+		hdr[n++] = 0x82;
+		hdr[n++] = (unsigned char) (len >> 8);
+		hdr[n++] = (unsigned char) len;
+	} else {
+		hdr[n++] = 0x83;
+		hdr[n++] = (unsigned char) (len >> 16);
+		hdr[n++] = (unsigned char) (len >> 8);
+		hdr[n++] = (unsigned char) len;
+	}
+
+	return buffer_append(buf, hdr, n);
+}
+
+static int buffer_append_utf8(struct buffer *buf, unsigned long c)
+{
+	unsigned char s[4];
+	int n;
+
+	if (c < 0x80) {
+		s[0] = (unsigned char) c;
+		n = 1;
+	} else if (c < 0x800) {
+		s[0] = 0xC0 | (c >> 6);
+		s[1] = 0x80 | (c & 0x3F);
+		n = 2;
+	} else if (c < 0x10000) {
+		s[0] = 0xE0 | (c >> 12);
+		s[1] = 0x80 | ((c >> 6) & 0x3F);
+		s[2] = 0x80 | (c & 0x3F);
+		n = 3;
+	} else if (c < 0x110000) {
+		s[0] = 0xF0 | (c >> 18);
+		s[1] = 0x80 | ((c >> 12) & 0x3F);
+		s[2] = 0x80 | ((c >> 6) & 0x3F);
+		s[3] = 0x80 | (c & 0x3F);
+		n = 4;
+	} else
+		return -1;
+
+	return buffer_append(buf, s, n);
+}
+
+/* read a DER tag and length, advancing *p to the contents */
+static int der_get_tl(const unsigned char **p, const unsigned char *end, unsigned char *tag, size_t *len)
+{
+	const unsigned char *s = *p;
+	size_t n;
+
+	if (end - s < 2)
+		return -1;
+
+	*tag = *s++;
+	if (*s < 0x80)
+		n = *s++;
+	else {
+		int nbytes = *s++ & 0x7F;
+
+		if (nbytes < 1 || nbytes > 3 || end - s < nbytes)
+			return -1;
+
+		for (n = 0; nbytes; nbytes--)
+			n = (n << 8) | *s++;
+	}
+
+	if ((size_t)(end - s) < n)
+		return -1;
+
+	*p = s;
+	*len = n;
+
+	return 0;
+}
+
+static int is_space(unsigned char c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* convert a directory string to UTF-8, lowercase ASCII and fold whitespace,
+ * as OpenSSL does before hashing a name */
+static int canon_string(struct buffer *out, unsigned char tag, const unsigned char *s, size_t len)
+{
+	struct buffer utf8 = { NULL, 0, 0 };
+	size_t it, start, end;
+	int rc = 0;
+
+	switch (tag) {
+	case 0x0C: /* UTF8String */
+	case 0x13: /* PrintableString */
+	case 0x16: /* IA5String */
+	case 0x1A: /* VisibleString */
+		rc = buffer_append(&utf8, s, len);
+		break;
+	case 0x14: /* T61String, treated as Latin-1 */
+		for (it = 0; it < len && !rc; it++)
+			rc = buffer_append_utf8(&utf8, s[it]);
+		break;
+	case 0x1E: /* BMPString */
+		if (len & 1)
+			return -1;
+		for (it = 0; it < len && !rc; it += 2)
+			rc = buffer_append_utf8(&utf8, (s[it] << 8) | s[it + 1]);
+		break;
+	case 0x1C: /* UniversalString */
+		if (len & 3)
+			return -1;
+		for (it = 0; it < len && !rc; it += 4)
+			rc = buffer_append_utf8(&utf8, ((unsigned long) s[it] << 24) | (s[it + 1] << 16) | (s[it + 2] << 8) | s[it + 3]);
+		break;
+	default:
+		/* no directory string: keep the original encoding */
+		if (!(rc = buffer_append_tl(out, tag, len)))
+			rc = buffer_append(out, s, len);
+		return rc;
+	}
+
+	if (rc) {
+		xfree(utf8.data);
+		return rc;
+	}
+
+	/* strip leading and trailing whitespace, collapse inner whitespace */
+	for (start = 0; start < utf8.size && is_space(utf8.data[start]); start++);
+	for (end = utf8.size; end > start && is_space(utf8.data[end - 1]); end--);
+
+	for (len = 0, it = start; it < end;) {
+		if (utf8.data[it] & 0x80)
+			utf8.data[len++] = utf8.data[it++];
+		else if (is_space(utf8.data[it])) {
+			utf8.data[len++] = ' ';
+			while (is_space(utf8.data[it]))
+				it++;
+		} else {
+			unsigned char c = utf8.data[it++];
+			utf8.data[len++] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+		}
+	}
+
+	if (!(rc = buffer_append_tl(out, 0x0C, len)))
+		rc = buffer_append(out, utf8.data, len);
+
+	xfree(utf8.data);
+	return rc;
+}
+
+static int cmp_datum(const void *p1, const void *p2)
+{
+	const gnutls_datum_t *d1 = p1, *d2 = p2;
+	unsigned int n = d1->size < d2->size ? d1->size : d2->size;
+	int rc;
+
+	if ((rc = memcmp(d1->data, d2->data, n)))
+		return rc;
+
+	return d1->size < d2->size ? -1 : (d1->size > d2->size);
+}
+
+/* canonical encoding of one RDN: a DER SET OF AttributeTypeAndValue */
+static int canon_rdn(struct buffer *out, const unsigned char *s, const unsigned char *end)
+{
+	gnutls_datum_t avas[16];
+	struct buffer ava;
+	size_t navas = 0, it, total = 0;
+	int rc = -1;
+
+	while (s < end) {
+		const unsigned char *seq_end, *oid;
+		unsigned char tag;
+		size_t len, oid_len;
+
+		if (navas >= countof(avas))
+			goto out;
+
+		if (der_get_tl(&s, end, &tag, &len) || tag != 0x30)
+			goto out;
+		seq_end = s + len;
+
+		if (der_get_tl(&s, seq_end, &tag, &oid_len) || tag != 0x06)
+			goto out;
+		oid = s;
+		s += oid_len;
+
+		if (der_get_tl(&s, seq_end, &tag, &len))
+			goto out;
+
+		memset(&ava, 0, sizeof(ava));
+		if (buffer_append_tl(&ava, 0x06, oid_len) || buffer_append(&ava, oid, oid_len)
+			|| canon_string(&ava, tag, s, len))
+		{
+			xfree(ava.data);
+			goto out;
+		}
+		s = seq_end;
+
+		/* wrap into the AttributeTypeAndValue SEQUENCE */
+		avas[navas].data = malloc(ava.size + 6);
+		if (!avas[navas].data) {
+			xfree(ava.data);
+			goto out;
+		}
+		{
+			struct buffer seq = { avas[navas].data, 0, ava.size + 6 };
+
+			buffer_append_tl(&seq, 0x30, ava.size);
+			buffer_append(&seq, ava.data, ava.size);
+			avas[navas].size = seq.size;
+		}
+		total += avas[navas++].size;
+		xfree(ava.data);
+	}
+
+	/* DER wants the members of a SET OF in ascending order */
+	qsort(avas, navas, sizeof(avas[0]), cmp_datum);
+
+	if ((rc = buffer_append_tl(out, 0x31, total)))
+		goto out;
+
+	for (it = 0; it < navas && !rc; it++)
+		rc = buffer_append(out, avas[it].data, avas[it].size);
+
+out:
+	for (it = 0; it < navas; it++)
+		xfree(avas[it].data);
+
+	return rc;
+}
+
+/**
+ * capath_name_hash:
+ * @dn: DER encoded distinguished name
+ * @hash: output, the name hash
+ *
+ * Computes the hash of @dn the same way as OpenSSL's X509_NAME_hash(),
+ * which is what c_rehash uses to name the files of a CA directory.
+ *
+ * Returns: 0 on success, -1 if @dn could not be parsed.
+ */
+int capath_name_hash(const gnutls_datum_t *dn, unsigned long *hash)
+{
+	struct buffer canon = { NULL, 0, 0 };
+	const unsigned char *s = dn->data, *end = dn->data + dn->size;
+	unsigned char md[20], tag;
+	size_t len;
+	int rc;
+
+	if (der_get_tl(&s, end, &tag, &len) || tag != 0x30)
+		return -1;
+	end = s + len;
+
+	while (s < end) {
+		if (der_get_tl(&s, end, &tag, &len) || tag != 0x31 || canon_rdn(&canon, s, s + len)) {
+			xfree(canon.data);
+			return -1;
+		}
+		s += len;
+	}
+
+	rc = gnutls_hash_fast(GNUTLS_DIG_SHA1, canon.data ? canon.data : md, canon.size, md);
+	xfree(canon.data);
+	if (rc < 0)
+		return -1;
+
+	*hash = ((unsigned long) md[0] | ((unsigned long) md[1] << 8) | ((unsigned long) md[2] << 16) | ((unsigned long) md[3] << 24));
+
+	return 0;
+}
+
+/* takes ownership of store */
+capath_t *capath_init(vtls_config_t *config, gnutls_x509_trust_list_t tlist, const char *dir, castore_t *store)
+{
+	capath_t *capath;
+
+	if (!(capath = calloc(1, sizeof(*capath))))
+		return NULL;
+
+	if (dir && !(capath->dir = strdup(dir))) {
+		xfree(capath);
+		return NULL;
+	}
+
+	pthread_rwlock_init(&capath->lock, NULL);
+	capath->config = config;
+	capath->tlist = tlist;
+	capath->store = store;
+
+	return capath;
+}
+
+void capath_deinit(capath_t *capath)
+{
+	size_t it;
+
+	if (!capath)
+		return;
+
+	for (it = 0; it < capath->nissuers; it++)
+		xfree(capath->issuers[it].data);
+	for (it = 0; it < MISS_SLOTS; it++)
+		xfree(capath->misses[it].data);
+
+	pthread_rwlock_destroy(&capath->lock);
+	castore_close(capath->store);
+	xfree(capath->issuers);
+	xfree(capath->dir);
+	xfree(capath);
+}
+
+/*
+ * Peers can send chains with any issuer names, so the ones not found only go
+ * into a fixed number of slots, a later miss in the same slot replaces them.
+ */
+static unsigned int miss_slot(const gnutls_datum_t *dn)
+{
+	unsigned int hash = 5381, it; /* djb2 */
+
+	for (it = 0; it < dn->size; it++)
+		hash = hash * 33 + dn->data[it];
+
+	return hash % MISS_SLOTS;
+}
+
+/* the DN was looked up before, caller holds the lock */
+static int looked_up(capath_t *capath, const gnutls_datum_t *dn)
+{
+	const gnutls_datum_t *miss = &capath->misses[miss_slot(dn)];
+
+	if (miss->data && miss->size == dn->size && !memcmp(miss->data, dn->data, dn->size))
+		return 1;
+
+	return bsearch(dn, capath->issuers, capath->nissuers, sizeof(gnutls_datum_t), cmp_datum) != NULL;
+}
+
+/* called with the write lock held */
+static int capath_load_issuer(capath_t *capath, const gnutls_datum_t *dn)
+{
+	gnutls_datum_t *issuers, copy;
+	unsigned long hash;
+	int it, ncerts = 0, ndir = 0, found = 0;
+
+	if (looked_up(capath, dn))
+		return 0; /* already done (or tried) */
+
+	if (capath->store) {
+		unsigned int first, n = castore_find_subject(capath->store, dn, &first);
+		gnutls_x509_crt_t crts[n ? n : 1];
+		unsigned int ncrts = 0;
+
+		found = n > 0;
+
+		for (; n; n--, first++) {
+			gnutls_datum_t der;
+
+			if (castore_get_cert(capath->store, first, &der) == 0
+				&& gnutls_x509_crt_init(&crts[ncrts]) == 0)
+			{
+				if (gnutls_x509_crt_import(crts[ncrts], &der, GNUTLS_X509_FMT_DER) == 0)
+					ncrts++;
+				else
+					gnutls_x509_crt_deinit(crts[ncrts]);
+			}
+		}
+
+		/* the trust list takes over the certificates */
+		if (ncrts) {
+			int rc = gnutls_x509_trust_list_add_cas(capath->tlist, crts, ncrts, GNUTLS_TL_NO_DUPLICATES);
+
+			if (rc > 0)
+				ncerts += rc;
+		}
+
+		debug_printf(capath->config, "loaded %d certificates for issuer from CA store\n", ncerts);
+	}
+
+	if (capath->dir && capath_name_hash(dn, &hash) == 0) {
+		size_t dirlen = strlen(capath->dir);
+		char fname[dirlen + 16];
+
+		/* <hash>.0, <hash>.1, ... until there is no more file */
+		for (it = 0;; it++) {
+			int rc;
+
+			snprintf(fname, sizeof(fname), "%s/%08lx.%d", capath->dir, hash, it);
+			if ((rc = gnutls_x509_trust_list_add_trust_file(capath->tlist, fname, NULL,
+				GNUTLS_X509_FMT_PEM, GNUTLS_TL_NO_DUPLICATES, 0)) < 0)
+				break;
+
+			ndir += rc;
+		}
+		ncerts += ndir;
+		found |= it > 0;
+
+		debug_printf(capath->config, "loaded %d certificates for issuer hash %08lx from '%s'\n",
+			ndir, hash, capath->dir);
+	}
+
+	/* remember the DN, even if nothing was found */
+	if (!(copy.data = malloc(dn->size)))
+		return -1;
+	memcpy(copy.data, dn->data, dn->size);
+	copy.size = dn->size;
+
+	if (!found) {
+		unsigned int slot = miss_slot(dn);
+
+		xfree(capath->misses[slot].data);
+		capath->misses[slot] = copy;
+		return ncerts;
+	}
+
+	if (capath->nissuers >= capath->max_issuers) {
+		size_t max = capath->max_issuers ? capath->max_issuers * 2 : 16;
+
+		if (!(issuers = realloc(capath->issuers, max * sizeof(gnutls_datum_t)))) {
+			xfree(copy.data);
+			return -1;
+		}
+
+		capath->issuers = issuers;
+		capath->max_issuers = max;
+	}
+
+	for (it = capath->nissuers; it > 0 && cmp_datum(&capath->issuers[it - 1], &copy) > 0; it--)
+		capath->issuers[it] = capath->issuers[it - 1];
+	capath->issuers[it] = copy;
+	capath->nissuers++;
+
+	return ncerts;
+}
+
+/**
+ * capath_lock_chain:
+ * @capath: the CA directory
+ * @chain: the peer's certificate chain (DER)
+ * @chain_size: number of certificates in @chain
+ *
+ * Makes sure that the issuers of all certificates in @chain have been looked
+ * up in the CA directory and loaded into the trust list. The trust list
+ * must not be used for verification without holding this lock, since other
+ * sessions may add anchors to it.
+ *
+ * Returns with the trust list read-locked, release with capath_unlock().
+ */
+int capath_lock_chain(capath_t *capath, const gnutls_datum_t *chain, unsigned int chain_size)
+{
+	gnutls_datum_t dns[chain_size ? chain_size : 1];
+	gnutls_x509_crt_t crt;
+	unsigned int it, missing = 0;
+
+	memset(dns, 0, sizeof(dns));
+
+	if (gnutls_x509_crt_init(&crt) < 0) {
+		pthread_rwlock_rdlock(&capath->lock);
+		return -1;
+	}
+
+	pthread_rwlock_rdlock(&capath->lock);
+	for (it = 0; it < chain_size; it++) {
+		gnutls_datum_t dn;
+
+		if (gnutls_x509_crt_import(crt, &chain[it], GNUTLS_X509_FMT_DER) < 0
+			|| gnutls_x509_crt_get_raw_issuer_dn(crt, &dn) < 0)
+			continue;
+
+		if (looked_up(capath, &dn))
+			gnutls_free(dn.data);
+		else {
+			dns[it] = dn;
+			missing++;
+		}
+	}
+	pthread_rwlock_unlock(&capath->lock);
+
+	gnutls_x509_crt_deinit(crt);
+
+	if (missing) {
+		pthread_rwlock_wrlock(&capath->lock);
+		for (it = 0; it < chain_size; it++) {
+			if (dns[it].data) {
+				capath_load_issuer(capath, &dns[it]);
+				gnutls_free(dns[it].data);
+			}
+		}
+		pthread_rwlock_unlock(&capath->lock);
+	}
+
+	pthread_rwlock_rdlock(&capath->lock);
+
+	return 0;
+}
+
+void capath_unlock(capath_t *capath)
+{
+	pthread_rwlock_unlock(&capath->lock);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#ifndef _VTLS_CAPATH_H
+#define _VTLS_CAPATH_H
+
+#include <gnutls/x509.h>
+#include "backend.h"
+#include "castore.h"
+
+/*
+ * On-demand trust store, backed by a compiled CA store (see castore.h) and/or
+ * a c_rehash style CA directory, where each CA certificate is reachable as
+ * <subject-hash>.<n>. Instead of loading every certificate up front, only the
+ * issuers needed by a peer's chain are loaded into the trust list, and
+ * remembered for later handshakes.
+ */
+typedef struct capath_st capath_t;
+
+capath_t *capath_init(vtls_config_t *config, gnutls_x509_trust_list_t tlist, const char *dir, castore_t *store);
+void capath_deinit(capath_t *capath);
+int capath_lock_chain(capath_t *capath, const gnutls_datum_t *chain, unsigned int chain_size);
+void capath_unlock(capath_t *capath);
+int capath_name_hash(const gnutls_datum_t *dn, unsigned long *hash);
+
+#endif /* _VTLS_CAPATH_H */
@@ -0,0 +1,333 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+#include "common.h"
+#include "castore.h"
+
+struct castore_st {
+	const unsigned char *data; /* the mmap()ed file */
+	size_t size;
+	const struct castore_header *header;
+	const struct castore_entry *entries;
+};
+
+static int _range_ok(size_t size, uint32_t offset, uint32_t len)
+{
+	return offset <= size && len <= size - offset;
+}
+
+/**
+ * castore_open:
+ * @fname: file name of a compiled CA store
+ *
+ * Maps the CA store read-only into memory and checks its indexes.
+ *
+ * Returns: the store or %NULL if it could not be opened or is malformed.
+ */
+castore_t *castore_open(const char *fname)
+{
+	castore_t *store;
+	const struct castore_header *header;
+	struct stat st;
+	void *data;
+	uint32_t it;
+	int fd;
+
+	if ((fd = open(fname, O_RDONLY)) == -1)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct castore_header)
+		|| (data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	header = data;
+	if (memcmp(header->magic, CASTORE_MAGIC, sizeof(header->magic))
+		|| header->byteorder != CASTORE_BYTEORDER
+		|| header->size != (size_t) st.st_size
+		|| header->ncerts > st.st_size / sizeof(struct castore_entry)
+		|| !_range_ok(st.st_size, header->subject_index, header->ncerts * sizeof(struct castore_entry))
+		|| header->subject_index & 3)
+		goto err;
+
+	if (!(store = calloc(1, sizeof(*store))))
+		goto err;
+
+	store->data = data;
+	store->size = st.st_size;
+	store->header = header;
+	store->entries = (const struct castore_entry *)(store->data + header->subject_index);
+
+	for (it = 0; it < header->ncerts; it++) {
+		if (!_range_ok(store->size, store->entries[it].cert_offset, store->entries[it].cert_size)
+			|| !_range_ok(store->size, store->entries[it].subject_offset, store->entries[it].subject_size))
+		{
+			xfree(store);
+			goto err;
+		}
+	}
+
+	return store;
+
+err:
+	munmap(data, st.st_size);
+	return NULL;
+}
+
+void castore_close(castore_t *store)
+{
+	if (store) {
+		munmap((void *) store->data, store->size);
+		xfree(store);
+	}
+}
+
+unsigned int castore_count(const castore_t *store)
+{
+	return store->header->ncerts;
+}
+
+/* the returned datum points into the mapped file, don't free it */
+int castore_get_cert(const castore_t *store, unsigned int idx, gnutls_datum_t *cert)
+{
+	if (idx >= store->header->ncerts)
+		return -1;
+
+	cert->data = (unsigned char *) store->data + store->entries[idx].cert_offset;
+	cert->size = store->entries[idx].cert_size;
+
+	return 0;
+}
+
+static int _cmp_subject(const castore_t *store, unsigned int idx, const gnutls_datum_t *dn)
+{
+	const struct castore_entry *entry = &store->entries[idx];
+	size_t n = entry->subject_size < dn->size ? entry->subject_size : dn->size;
+	int rc;
+
+	if ((rc = memcmp(store->data + entry->subject_offset, dn->data, n)))
+		return rc;
+
+	return entry->subject_size < dn->size ? -1 : (entry->subject_size > dn->size);
+}
+
+/**
+ * castore_find_subject:
+ * @store: CA store
+ * @dn: raw DER subject DN to look for
+ * @first: output, index of the first matching certificate
+ *
+ * Binary search for the certificates with subject @dn.
+ *
+ * Returns: the number of matching certificates, starting at *@first.
+ */
+int castore_find_subject(const castore_t *store, const gnutls_datum_t *dn, unsigned int *first)
+{
+	unsigned int lo = 0, hi = store->header->ncerts, n;
+
+	/* lower bound */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (_cmp_subject(store, mid, dn) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (n = 0; lo + n < store->header->ncerts && _cmp_subject(store, lo + n, dn) == 0; n++);
+
+	*first = lo;
+	return n;
+}
+
+struct _cert_info {
+	const gnutls_datum_t *cert;
+	gnutls_datum_t subject;
+};
+
+static int _cmp_info_subject(const void *p1, const void *p2)
+{
+	const struct _cert_info *i1 = p1, *i2 = p2;
+	size_t n = i1->subject.size < i2->subject.size ? i1->subject.size : i2->subject.size;
+	int rc;
+
+	if ((rc = memcmp(i1->subject.data, i2->subject.data, n)))
+		return rc;
+	if (i1->subject.size != i2->subject.size)
+		return i1->subject.size < i2->subject.size ? -1 : 1;
+
+	/* same subject, order by certificate to find duplicates */
+	n = i1->cert->size < i2->cert->size ? i1->cert->size : i2->cert->size;
+	if ((rc = memcmp(i1->cert->data, i2->cert->data, n)))
+		return rc;
+
+	return i1->cert->size < i2->cert->size ? -1 : (i1->cert->size > i2->cert->size);
+}
+
+static int _get_info(struct _cert_info *info, const gnutls_datum_t *cert)
+{
+	gnutls_x509_crt_t crt = NULL;
+	int rc;
+
+	info->cert = cert;
+
+	if ((rc = gnutls_x509_crt_init(&crt)) == 0
+		&& (rc = gnutls_x509_crt_import(crt, cert, GNUTLS_X509_FMT_DER)) == 0)
+		rc = gnutls_x509_crt_get_raw_dn(crt, &info->subject);
+
+	if (crt)
+		gnutls_x509_crt_deinit(crt);
+
+	return rc < 0 ? -1 : 0;
+}
+
+/**
+ * castore_write:
+ * @fname: output file name
+ * @certs: DER encoded CA certificates
+ * @ncerts: number of certificates in @certs
+ *
+ * Writes a compiled CA store. Duplicate certificates are only written once.
+ * The file is created under a temporary name and renamed into place, so
+ * readers never see a partially written store.
+ *
+ * Returns: the number of certificates written or -1 on error.
+ */
+int castore_write(const char *fname, const gnutls_datum_t *certs, unsigned int ncerts)
+{
+	struct castore_header header;
+	struct castore_entry *entries = NULL;
+	struct _cert_info *infos;
+	unsigned int it, n = 0;
+	uint32_t offset;
+	char tmpname[strlen(fname) + 8];
+	FILE *fp = NULL;
+	int rc = -1;
+
+	*tmpname = 0;
+	if (!(infos = calloc(ncerts ? ncerts : 1, sizeof(*infos))))
+		return -1;
+
+	for (it = 0; it < ncerts; it++) {
+		if (_get_info(&infos[n], &certs[it]) == 0)
+			n++;
+		else {
+			gnutls_free(infos[n].subject.data);
+			infos[n].subject.data = NULL;
+		}
+	}
+
+	/* sort by subject and drop duplicates */
+	qsort(infos, n, sizeof(*infos), _cmp_info_subject);
+	for (ncerts = 0, it = 0; it < n; it++) {
+		if (ncerts && _cmp_info_subject(&infos[ncerts - 1], &infos[it]) == 0)
+			gnutls_free(infos[it].subject.data);
+		else
+			infos[ncerts++] = infos[it];
+	}
+	n = ncerts;
+
+	if (!(entries = calloc(n ? n : 1, sizeof(*entries))))
+		goto out;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CASTORE_MAGIC, sizeof(header.magic));
+	header.byteorder = CASTORE_BYTEORDER;
+	header.ncerts = n;
+	header.subject_index = sizeof(header);
+
+	offset = header.subject_index + n * sizeof(*entries);
+	for (it = 0; it < n; it++) {
+		entries[it].cert_offset = offset;
+		entries[it].cert_size = infos[it].cert->size;
+		offset += infos[it].cert->size;
+		entries[it].subject_offset = offset;
+		entries[it].subject_size = infos[it].subject.size;
+		offset += infos[it].subject.size;
+	}
+	header.size = offset;
+
+	snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", fname);
+	{
+		int fd = mkstemp(tmpname);
+
+		if (fd == -1 || !(fp = fdopen(fd, "w"))) {
+			if (fd != -1)
+				close(fd);
+			goto out;
+		}
+	}
+
+	if (fwrite(&header, sizeof(header), 1, fp) != 1
+		|| fwrite(entries, sizeof(*entries), n, fp) != n)
+		goto out;
+
+	/* the data follows in subject index order */
+	for (it = 0; it < n; it++) {
+		if (fwrite(infos[it].cert->data, 1, infos[it].cert->size, fp) != infos[it].cert->size
+			|| fwrite(infos[it].subject.data, 1, infos[it].subject.size, fp) != infos[it].subject.size)
+			goto out;
+	}
+
+	if (fclose(fp)) {
+		fp = NULL;
+		goto out;
+	}
+	fp = NULL;
+
+	chmod(tmpname, 0644);
+	if (rename(tmpname, fname) == 0)
+		rc = n;
+
+out:
+	if (fp)
+		fclose(fp);
+	if (rc < 0 && *tmpname)
+		unlink(tmpname);
+	for (it = 0; it < n; it++)
+		gnutls_free(infos[it].subject.data);
+	xfree(infos);
+	xfree(entries);
+
+	return rc;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#ifndef _VTLS_CASTORE_H
+#define _VTLS_CASTORE_H
+
+#include <stdint.h>
+#include <gnutls/gnutls.h>
+
+/*
+ * Compiled CA store, as written by vtls-trustc.
+ *
+ * The file holds DER encoded CA certificates plus an index sorted by raw
+ * subject DN. It is mmap()ed read-only, so all processes on a host share one page-cache copy
+ * and certificates are only parsed when a peer chain needs them.
+ *
+ * All integers are stored in host byte order (checked via 'byteorder').
+ */
+#define CASTORE_MAGIC "VTLSCAS2"
+#define CASTORE_BYTEORDER 0x01020304
+
+struct castore_header {
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t ncerts;
+	uint32_t subject_index; /* offset of ncerts struct castore_entry, sorted by subject */
+	uint32_t size; /* total file size */
+	uint32_t reserved;
+};
+
+struct castore_entry {
+	uint32_t cert_offset;
+	uint32_t cert_size;
+	uint32_t subject_offset;
+	uint32_t subject_size;
+};
+
+typedef struct castore_st castore_t;
+
+castore_t *castore_open(const char *fname);
+void castore_close(castore_t *store);
+unsigned int castore_count(const castore_t *store);
+int castore_get_cert(const castore_t *store, unsigned int idx, gnutls_datum_t *cert);
+int castore_find_subject(const castore_t *store, const gnutls_datum_t *dn, unsigned int *first);
+int castore_write(const char *fname, const gnutls_datum_t *certs, unsigned int ncerts);
+
+#endif /* _VTLS_CASTORE_H */
@@ -24,8 +24,21 @@
 
 #include <stdlib.h>
 
+#define countof(a) (sizeof(a)/sizeof(*(a)))
 #define xfree(a) do { if (a) { free((void *)(a)); a = NULL; } } while (0)
 
+/* Trace points, see VTLS_CFG_TRACE_LEVEL. Levels above VTLS_TRACE_MAX are
+ * compiled out, a disabled one costs a load and a well predicted branch. */
+#ifndef VTLS_TRACE_MAX
+#  define VTLS_TRACE_MAX 2
+#endif
+extern int _vtls_trace_level;
+#define trace_printf(level, ...) \
+	do { \
+		if ((level) <= VTLS_TRACE_MAX && __builtin_expect((level) <= _vtls_trace_level, 0)) \
+			debug_printf(NULL, __VA_ARGS__); \
+	} while (0)
+
 int vtls_strncasecmp_ascii(const char *s1, const char *s2, size_t n);
 int vtls_strcasecmp_ascii(const char *s1, const char *s2);
 int vtls_strcaseequal_ascii(const char* s1, const char* s2);
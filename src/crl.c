@@ -0,0 +1,405 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+#include "common.h"
+#include "crl.h"
+
+/* RFC 5280 limits serial numbers to 20 octets */
+#define MAX_SERIAL_SIZE 20
+
+struct crl_serial {
+	unsigned char size;
+	unsigned char data[MAX_SERIAL_SIZE];
+};
+
+struct crl_issuer {
+	gnutls_datum_t dn; /* raw DER issuer DN */
+	struct crl_serial *serials; /* sorted */
+	size_t nserials;
+	size_t max_serials;
+};
+
+struct crl_index {
+	struct crl_issuer *issuers; /* sorted by DN */
+	size_t nissuers;
+	int ncrls;
+	time_t next_update; /* earliest nextUpdate of all CRLs, 0 if none */
+};
+
+struct crl_st {
+	pthread_rwlock_t lock; /* protects index */
+	pthread_mutex_t refresh_lock;
+	vtls_config_t *config;
+	char *fname;
+	struct crl_index *index;
+	time_t mtime;
+	off_t size;
+	time_t checked; /* last time we looked at the file */
+	time_t loaded; /* last time the file has been parsed */
+};
+
+#define REFRESH_CHECK_INTERVAL 1 /* s */
+#define REFRESH_EXPIRED_INTERVAL 60 /* s, how often to re-read a file with outdated CRLs */
+
+static int cmp_datum(const gnutls_datum_t *d1, const gnutls_datum_t *d2)
+{
+	unsigned int n = d1->size < d2->size ? d1->size : d2->size;
+	int rc;
+
+	if ((rc = memcmp(d1->data, d2->data, n)))
+		return rc;
+
+	return d1->size < d2->size ? -1 : (d1->size > d2->size);
+}
+
+static int cmp_issuer(const void *p1, const void *p2)
+{
+	return cmp_datum(&((const struct crl_issuer *) p1)->dn, &((const struct crl_issuer *) p2)->dn);
+}
+
+static int cmp_serial(const void *p1, const void *p2)
+{
+	const struct crl_serial *s1 = p1, *s2 = p2;
+
+	if (s1->size != s2->size)
+		return s1->size < s2->size ? -1 : 1;
+
+	return memcmp(s1->data, s2->data, s1->size);
+}
+
+/* store a serial number without leading zero octets, returns -1 if it is too long */
+static int set_serial(struct crl_serial *serial, const unsigned char *data, size_t size)
+{
+	while (size > 1 && *data == 0) {
+		data++;
+		size--;
+	}
+
+	if (size > MAX_SERIAL_SIZE)
+		return -1;
+
+	serial->size = (unsigned char) size;
+	memcpy(serial->data, data, size);
+
+	return 0;
+}
+
+static void free_index(struct crl_index *index)
+{
+	size_t it;
+
+	if (!index)
+		return;
+
+	for (it = 0; it < index->nissuers; it++) {
+		gnutls_free(index->issuers[it].dn.data);
+		xfree(index->issuers[it].serials);
+	}
+	xfree(index->issuers);
+	xfree(index);
+}
+
+static struct crl_issuer *get_issuer(struct crl_index *index, gnutls_datum_t *dn)
+{
+	struct crl_issuer *issuer;
+	size_t it;
+
+	/* few issuers per file, the index is sorted after parsing */
+	for (it = 0; it < index->nissuers; it++) {
+		if (!cmp_datum(&index->issuers[it].dn, dn)) {
+			gnutls_free(dn->data);
+			return &index->issuers[it];
+		}
+	}
+
+	if (!(issuer = realloc(index->issuers, (index->nissuers + 1) * sizeof(struct crl_issuer))))
+		return NULL;
+
+	index->issuers = issuer;
+	issuer = &index->issuers[index->nissuers++];
+	memset(issuer, 0, sizeof(*issuer));
+	issuer->dn = *dn;
+
+	return issuer;
+}
+
+static int add_crl(struct crl_index *index, gnutls_x509_crl_t crl)
+{
+	struct crl_issuer *issuer;
+	gnutls_x509_crl_iter_t iter = NULL;
+	gnutls_datum_t dn;
+	unsigned char serial[64];
+	size_t serial_size;
+	time_t next_update;
+	int rc;
+
+	if (gnutls_x509_crl_get_raw_issuer_dn(crl, &dn) < 0)
+		return -1;
+
+	if (!(issuer = get_issuer(index, &dn))) {
+		gnutls_free(dn.data);
+		return -1;
+	}
+
+	next_update = gnutls_x509_crl_get_next_update(crl);
+	if (next_update != (time_t) -1 && (!index->next_update || next_update < index->next_update))
+		index->next_update = next_update;
+
+	for (;;) {
+		serial_size = sizeof(serial);
+		if ((rc = gnutls_x509_crl_iter_crt_serial(crl, &iter, serial, &serial_size, NULL)) < 0)
+			break;
+
+		if (issuer->nserials >= issuer->max_serials) {
+			size_t max = issuer->max_serials ? issuer->max_serials * 2 : 64;
+			struct crl_serial *p;
+
+			if (!(p = realloc(issuer->serials, max * sizeof(struct crl_serial)))) {
+				rc = GNUTLS_E_MEMORY_ERROR;
+				break;
+			}
+
+			issuer->serials = p;
+			issuer->max_serials = max;
+		}
+
+		if (set_serial(&issuer->serials[issuer->nserials], serial, serial_size) == 0)
+			issuer->nserials++;
+	}
+
+	gnutls_x509_crl_iter_deinit(iter);
+
+	return rc == GNUTLS_E_REQUESTED_DATA_NOT_AVAILABLE ? 0 : -1;
+}
+
+static struct crl_index *parse_file(vtls_config_t *config, const char *fname)
+{
+	struct crl_index *index;
+	gnutls_x509_crl_t *crls;
+	gnutls_datum_t data;
+	unsigned int ncrls, it;
+	size_t n, it2;
+	int rc;
+
+	if ((rc = gnutls_load_file(fname, &data)) < 0) {
+		error_printf(config, "error reading crl file %s (%s)\n", fname, gnutls_strerror(rc));
+		return NULL;
+	}
+
+	rc = gnutls_x509_crl_list_import2(&crls, &ncrls, &data, GNUTLS_X509_FMT_PEM, 0);
+	gnutls_free(data.data);
+	if (rc < 0) {
+		error_printf(config, "error reading crl file %s (%s)\n", fname, gnutls_strerror(rc));
+		return NULL;
+	}
+
+	if ((index = calloc(1, sizeof(*index)))) {
+		for (it = 0; it < ncrls && index; it++) {
+			if (add_crl(index, crls[it])) {
+				error_printf(config, "error indexing crl #%u in %s\n", it, fname);
+				free_index(index);
+				index = NULL;
+			}
+		}
+	}
+
+	for (it = 0; it < ncrls; it++)
+		gnutls_x509_crl_deinit(crls[it]);
+	gnutls_free(crls);
+
+	if (!index)
+		return NULL;
+
+	index->ncrls = ncrls;
+	qsort(index->issuers, index->nissuers, sizeof(struct crl_issuer), cmp_issuer);
+
+	for (it = 0; it < index->nissuers; it++) {
+		struct crl_issuer *issuer = &index->issuers[it];
+
+		qsort(issuer->serials, issuer->nserials, sizeof(struct crl_serial), cmp_serial);
+
+		/* drop duplicates (e.g. from overlapping CRLs) */
+		for (n = 0, it2 = 0; it2 < issuer->nserials; it2++) {
+			if (!n || cmp_serial(&issuer->serials[n - 1], &issuer->serials[it2]))
+				issuer->serials[n++] = issuer->serials[it2];
+		}
+		issuer->nserials = n;
+	}
+
+	return index;
+}
+
+/**
+ * crl_load:
+ * @config: config, used for messages
+ * @fname: PEM file with one or more CRLs
+ *
+ * Returns: the parsed CRLs or %NULL on error.
+ */
+crl_t *crl_load(vtls_config_t *config, const char *fname)
+{
+	crl_t *crl;
+	struct stat st;
+
+	if (stat(fname, &st)) {
+		error_printf(config, "error reading crl file %s\n", fname);
+		return NULL;
+	}
+
+	if (!(crl = calloc(1, sizeof(*crl))))
+		return NULL;
+
+	if (!(crl->fname = strdup(fname)) || !(crl->index = parse_file(config, fname))) {
+		xfree(crl->fname);
+		xfree(crl);
+		return NULL;
+	}
+
+	pthread_rwlock_init(&crl->lock, NULL);
+	pthread_mutex_init(&crl->refresh_lock, NULL);
+	crl->config = config;
+	crl->mtime = st.st_mtime;
+	crl->size = st.st_size;
+	crl->checked = crl->loaded = time(NULL);
+
+	return crl;
+}
+
+void crl_free(crl_t *crl)
+{
+	if (!crl)
+		return;
+
+	free_index(crl->index);
+	pthread_rwlock_destroy(&crl->lock);
+	pthread_mutex_destroy(&crl->refresh_lock);
+	xfree(crl->fname);
+	xfree(crl);
+}
+
+int crl_count(crl_t *crl)
+{
+	return crl->index->ncrls;
+}
+
+/* parse the file again if it changed or its CRLs are outdated */
+static void crl_refresh(crl_t *crl)
+{
+	struct crl_index *index, *old;
+	struct stat st;
+	time_t now = time(NULL);
+	int expired;
+
+	/* if another thread is at it, just use what we have */
+	if (pthread_mutex_trylock(&crl->refresh_lock))
+		return;
+
+	if (now - crl->checked < REFRESH_CHECK_INTERVAL)
+		goto out;
+	crl->checked = now;
+
+	if (stat(crl->fname, &st))
+		goto out;
+
+	expired = crl->index->next_update && now >= crl->index->next_update
+		&& now - crl->loaded >= REFRESH_EXPIRED_INTERVAL;
+
+	if (st.st_mtime == crl->mtime && st.st_size == crl->size && !expired)
+		goto out;
+
+	crl->loaded = now;
+	if (!(index = parse_file(crl->config, crl->fname)))
+		goto out; /* keep the old one */
+
+	debug_printf(crl->config, "reloaded %d CRLs from %s\n", index->ncrls, crl->fname);
+
+	pthread_rwlock_wrlock(&crl->lock);
+	old = crl->index;
+	crl->index = index;
+	crl->mtime = st.st_mtime;
+	crl->size = st.st_size;
+	pthread_rwlock_unlock(&crl->lock);
+
+	free_index(old);
+
+out:
+	pthread_mutex_unlock(&crl->refresh_lock);
+}
+
+/**
+ * crl_check_chain:
+ * @crl: parsed CRLs
+ * @chain: the peer's certificate chain (DER)
+ * @chain_size: number of certificates in @chain
+ *
+ * Returns: the position of the first revoked certificate in @chain, or -1 if
+ * none is revoked.
+ */
+int crl_check_chain(crl_t *crl, const gnutls_datum_t *chain, unsigned int chain_size)
+{
+	gnutls_x509_crt_t crt;
+	unsigned int it;
+	int revoked = -1;
+
+	crl_refresh(crl);
+
+	if (gnutls_x509_crt_init(&crt) < 0)
+		return -1;
+
+	pthread_rwlock_rdlock(&crl->lock);
+	for (it = 0; it < chain_size && revoked == -1; it++) {
+		struct crl_issuer key, *issuer;
+		struct crl_serial serial;
+		unsigned char buf[64];
+		size_t size = sizeof(buf);
+
+		if (gnutls_x509_crt_import(crt, &chain[it], GNUTLS_X509_FMT_DER) < 0
+			|| gnutls_x509_crt_get_raw_issuer_dn(crt, &key.dn) < 0)
+			continue;
+
+		issuer = bsearch(&key, crl->index->issuers, crl->index->nissuers, sizeof(struct crl_issuer), cmp_issuer);
+		gnutls_free(key.dn.data);
+
+		if (issuer && gnutls_x509_crt_get_serial(crt, buf, &size) == 0 && set_serial(&serial, buf, size) == 0
+			&& bsearch(&serial, issuer->serials, issuer->nserials, sizeof(struct crl_serial), cmp_serial))
+			revoked = it;
+	}
+	pthread_rwlock_unlock(&crl->lock);
+
+	gnutls_x509_crt_deinit(crt);
+
+	return revoked;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#ifndef _VTLS_CRL_H
+#define _VTLS_CRL_H
+
+#include <gnutls/gnutls.h>
+#include "backend.h"
+
+/*
+ * Revocation lists, parsed once into sorted arrays of revoked serial numbers
+ * per issuer, so that checking a peer chain is a couple of binary searches.
+ * The file is parsed again only when its mtime changes or when the earliest
+ * nextUpdate of its CRLs has passed.
+ */
+typedef struct crl_st crl_t;
+
+crl_t *crl_load(vtls_config_t *config, const char *fname);
+void crl_free(crl_t *crl);
+int crl_count(crl_t *crl);
+int crl_check_chain(crl_t *crl, const gnutls_datum_t *chain, unsigned int chain_size);
+
+#endif /* _VTLS_CRL_H */
@@ -0,0 +1,287 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "common.h"
+#include "select.h"
+#include "filewatch.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+struct watch {
+	int wd; /* inotify watch of the directory */
+	char *name; /* file name within the directory, NULL for any file */
+	int id;
+	char dirty;
+};
+
+struct filewatch_st {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	void (*callback)(void *ctx, int id);
+	void *ctx;
+	struct watch *watches;
+	int nwatches;
+	int max_watches;
+	int delay_ms;
+	int fd; /* inotify */
+	int pipefd[2]; /* to wake up the thread on stop */
+};
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+/* mark the watches matching an inotify event, returns the number of marks */
+static int _mark(filewatch_t *fw, const struct inotify_event *ev)
+{
+	int it, n = 0;
+
+	pthread_mutex_lock(&fw->mutex);
+	for (it = 0; it < fw->nwatches; it++) {
+		struct watch *w = &fw->watches[it];
+
+		if (w->wd == ev->wd && (!w->name || (ev->len && !strcmp(w->name, ev->name)))) {
+			w->dirty = 1;
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&fw->mutex);
+
+	return n;
+}
+
+static void _notify(filewatch_t *fw)
+{
+	int it, n, id;
+
+	for (;;) {
+		/* take one dirty id at a time, the callback may take a while */
+		pthread_mutex_lock(&fw->mutex);
+		for (id = -1, it = 0; it < fw->nwatches && id == -1; it++) {
+			if (fw->watches[it].dirty)
+				id = fw->watches[it].id;
+		}
+		for (n = 0; n < fw->nwatches; n++) {
+			if (fw->watches[n].id == id)
+				fw->watches[n].dirty = 0;
+		}
+		pthread_mutex_unlock(&fw->mutex);
+
+		if (id == -1)
+			break;
+
+		fw->callback(fw->ctx, id);
+	}
+}
+
+static void *_watcher(void *p)
+{
+	filewatch_t *fw = p;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	int pending = 0;
+
+	for (;;) {
+		struct pollfd fds[2] = {
+			{ .fd = fw->fd, .events = POLLIN },
+			{ .fd = fw->pipefd[0], .events = POLLIN }
+		};
+		int rc = poll(fds, 2, pending ? fw->delay_ms : -1);
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents)
+			break; /* filewatch_stop() */
+
+		if (rc == 0) {
+			/* changes settled down */
+			pending = 0;
+			_notify(fw);
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			ssize_t len = read(fw->fd, buf, sizeof(buf));
+			char *ptr;
+
+			for (ptr = buf; len > 0 && ptr < buf + len;) {
+				const struct inotify_event *ev = (const struct inotify_event *) ptr;
+
+				if (_mark(fw, ev))
+					pending = 1;
+				ptr += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+filewatch_t *filewatch_start(void (*callback)(void *ctx, int id), void *ctx, int delay_ms)
+{
+	filewatch_t *fw;
+
+	if (!(fw = calloc(1, sizeof(*fw))))
+		return NULL;
+
+	fw->callback = callback;
+	fw->ctx = ctx;
+	fw->delay_ms = delay_ms;
+	fw->pipefd[0] = fw->pipefd[1] = -1;
+	pthread_mutex_init(&fw->mutex, NULL);
+
+	if ((fw->fd = inotify_init1(IN_CLOEXEC)) == -1
+		|| pipe(fw->pipefd)
+		|| pthread_create(&fw->thread, NULL, _watcher, fw))
+	{
+		if (fw->fd != -1)
+			close(fw->fd);
+		if (fw->pipefd[0] != -1) {
+			close(fw->pipefd[0]);
+			close(fw->pipefd[1]);
+		}
+		pthread_mutex_destroy(&fw->mutex);
+		xfree(fw);
+	}
+
+	return fw;
+}
+
+/**
+ * filewatch_add:
+ * @fw: watcher
+ * @path: file or directory to watch
+ * @is_dir: watch any change within directory @path
+ * @id: passed to the callback when @path changes
+ *
+ * Files are watched through their directory, so that replacing a file by
+ * rename() is noticed as well.
+ *
+ * Returns: 0 on success, -1 on error.
+ */
+int filewatch_add(filewatch_t *fw, const char *path, int is_dir, int id)
+{
+	struct watch *w;
+	const char *name = NULL;
+	char *dir;
+	int wd;
+
+	if (is_dir)
+		dir = strdup(path);
+	else if ((name = strrchr(path, '/'))) {
+		if ((dir = strndup(path, name == path ? 1 : (size_t)(name - path))))
+			name++;
+	} else {
+		dir = strdup(".");
+		name = path;
+	}
+
+	if (!dir)
+		return -1;
+
+	wd = inotify_add_watch(fw->fd, dir, WATCH_MASK);
+	xfree(dir);
+	if (wd == -1)
+		return -1;
+
+	pthread_mutex_lock(&fw->mutex);
+	if (fw->nwatches >= fw->max_watches) {
+		int max = fw->max_watches ? fw->max_watches * 2 : 8;
+
+		if (!(w = realloc(fw->watches, max * sizeof(struct watch)))) {
+			pthread_mutex_unlock(&fw->mutex);
+			return -1;
+		}
+
+		fw->watches = w;
+		fw->max_watches = max;
+	}
+
+	w = &fw->watches[fw->nwatches];
+	w->wd = wd;
+	w->id = id;
+	w->dirty = 0;
+	if (name && !(w->name = strdup(name))) {
+		pthread_mutex_unlock(&fw->mutex);
+		return -1;
+	} else if (!name)
+		w->name = NULL;
+	fw->nwatches++;
+	pthread_mutex_unlock(&fw->mutex);
+
+	return 0;
+}
+
+void filewatch_stop(filewatch_t *fw)
+{
+	int it;
+
+	if (!fw)
+		return;
+
+	if (write(fw->pipefd[1], "", 1) == 1)
+		pthread_join(fw->thread, NULL);
+
+	close(fw->fd);
+	close(fw->pipefd[0]);
+	close(fw->pipefd[1]);
+
+	for (it = 0; it < fw->nwatches; it++)
+		xfree(fw->watches[it].name);
+	xfree(fw->watches);
+	pthread_mutex_destroy(&fw->mutex);
+	xfree(fw);
+}
+
+#else /* HAVE_SYS_INOTIFY_H */
+
+filewatch_t *filewatch_start(void (*callback)(void *ctx, int id), void *ctx, int delay_ms)
+{
+	return NULL;
+}
+
+int filewatch_add(filewatch_t *fw, const char *path, int is_dir, int id)
+{
+	return -1;
+}
+
+void filewatch_stop(filewatch_t *fw)
+{
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
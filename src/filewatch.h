@@ -0,0 +1,42 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#ifndef _VTLS_FILEWATCH_H
+#define _VTLS_FILEWATCH_H
+
+/*
+ * Background watcher for files and directories (inotify).
+ *
+ * Each watched path is registered with an integer id. When one of the paths
+ * changes, the callback is invoked once per affected id from the watcher
+ * thread, after the changes have settled for delay_ms (so that a burst of
+ * writes results in a single reload).
+ */
+typedef struct filewatch_st filewatch_t;
+
+filewatch_t *filewatch_start(void (*callback)(void *ctx, int id), void *ctx, int delay_ms);
+int filewatch_add(filewatch_t *fw, const char *path, int is_dir, int id);
+void filewatch_stop(filewatch_t *fw);
+
+#endif /* _VTLS_FILEWATCH_H */
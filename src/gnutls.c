@@ -32,12 +32,28 @@
 # include <config.h>
 #endif
 
+#include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef HAVE_LINUX_TLS_H
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #include <gnutls/abstract.h>
+#include <gnutls/crypto.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 
@@ -46,6 +62,13 @@
 #include "select.h"
 #include "inet_pton.h"
 #include "backend.h"
+#include "capath.h"
+#include "filewatch.h"
+#include "crl.h"
+#include "verifycache.h"
+#include "sesscache.h"
+#include "sessfile.h"
+#include "uring.h"
 
 #ifdef USE_GNUTLS_NETTLE
 #include <gnutls/crypto.h>
@@ -65,13 +88,51 @@
 #define GNUTLS_INT_TO_POINTER_CAST(i) ((void*) (long) (i))
 #endif
 
+/* certificate credentials, shared by all sessions using a matching config */
+struct cred_entry {
+	struct cred_entry *next;
+	vtls_config_t *config; /* private clone of the config, used as cache key */
+	gnutls_certificate_credentials_t cred;
+	capath_t *capath; /* CA certs loaded on demand, if config->capath_hashed */
+	crl_t *crl; /* revoked certificates from config->CRLfile */
+	verifycache_t *verifycache; /* peer chains that passed verification, if config->verify_cache_ttl */
+	sesscache_t *sesscache; /* resumable TLS sessions, if config->session_cache */
+	sessfile_t *sessstore[2]; /* TLS sessions shared with other processes: config->session_shm and config->session_file */
+	char fingerprint[17]; /* of the config, prefix of session cache keys */
+	int refcount; /* one reference held by the cache plus one per session */
+	int id; /* identifies the entry across reloads */
+	char loading; /* set while the credentials are being loaded */
+};
+
 struct backend_session_data {
 	gnutls_session_t session;
-	gnutls_certificate_credentials_t cred;
+	struct cred_entry *cred;
 	gnutls_certificate_credentials_t srp_client_cred;
+	char *cache_key; /* config fingerprint, host and port, key into the session caches */
+	char sock_nonblocking; /* O_NONBLOCK is set on sess->sockfd */
+	char bye_sent; /* close_notify is out */
+	char renegotiating; /* the peer asked for a new handshake, see renegotiate() */
+	char ktls_tx; /* the kernel encrypts what we send, see ktls_enable() */
+	char ktls_rx; /* the kernel decrypts what we receive */
+	char corked; /* vtls_cork() holds back records, TCP_CORK with ktls_tx */
+	char ra_short; /* the last read-ahead didn't fill the buffer */
+	char *ra_buf; /* read-ahead buffer, see vtls_pull() */
+	size_t ra_off; /* first unread byte in ra_buf */
+	size_t ra_len; /* unread bytes in ra_buf */
 };
 static int _init_backend = 0;
 
+static struct cred_entry *_cred_cache;
+static pthread_mutex_t _cred_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cred_cache_cond = PTHREAD_COND_INITIALIZER; /* signals the end of loading */
+static pthread_t _cred_preload_thread;
+static int _cred_preloading;
+static filewatch_t *_cred_watch; /* reloads entries when their CA files change */
+static int _cred_next_id;
+
+static void cred_cache_flush(void);
+static void *cred_preload(void *p);
+
 #if defined(GNUTLS_VERSION_NUMBER)
 #if (GNUTLS_VERSION_NUMBER >= 0x020c00)
 #undef gnutls_transport_set_lowat
@@ -141,28 +202,366 @@ static int gtls_mapped_sockerrno(void)
 }
 #endif
 
-static ssize_t vtls_push(void *s, const void *buf, size_t len)
+/*
+ * The transport pointer is the session, a reactor's io_uring may do the I/O.
+ * GnuTLS hands over all records it has ready at once, e.g. a whole handshake
+ * flight, so they leave with one writev().
+ */
+static ssize_t vtls_push(void *s, const giovec_t *iov, int iovcnt)
 {
-	ssize_t ret = write(GNUTLS_POINTER_TO_INT_CAST(s), buf, len);
+	vtls_session_t *sess = s;
+	ssize_t ret = sess->uring_data ? uring_push(sess->uring_data, iov, iovcnt) : writev(sess->sockfd, iov, iovcnt);
 #if defined(USE_WINSOCK) && !defined(GNUTLS_MAPS_WINSOCK_ERRORS)
 	if (ret < 0)
 		gnutls_transport_set_global_errno(gtls_mapped_sockerrno());
 #endif
-	error_printf(NULL, "[%d] w len=%zd ret=%zd\n",GNUTLS_POINTER_TO_INT_CAST(s), len, ret);
+	trace_printf(VTLS_TRACE_IO, "[%d] w iovcnt=%d ret=%zd\n", sess->sockfd, iovcnt, ret);
 	return ret;
 }
 
+/*
+ * GnuTLS reads the record header and then the body. With VTLS_CFG_READ_AHEAD,
+ * the socket is read in chunks of that size and such small reads are served
+ * from the buffer; reads of at least that size go to the socket directly.
+ * Once a chunk came in short and is used up, the socket is likely drained
+ * and the buffer is freed, so idle sessions don't hold it.
+ *
+ * Unread data is served first when an io_uring takes over the socket. With
+ * VTLS_CFG_KTLS, the handshake reads only what GnuTLS asks for, as data read
+ * ahead would keep the kernel from decrypting.
+ */
+static ssize_t read_ahead(vtls_session_t *sess, void *buf, size_t len)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	size_t size = sess->config->read_ahead;
+	ssize_t n;
+	int err;
+
+	if (backend->ra_len) {
+		if ((n = backend->ra_len) > (ssize_t) len)
+			n = len;
+		memcpy(buf, backend->ra_buf + backend->ra_off, n);
+		backend->ra_off += n;
+		if ((backend->ra_len -= n) == 0 && backend->ra_short)
+			xfree(backend->ra_buf);
+		return n;
+	}
+
+	if (sess->uring_data)
+		return uring_pull(sess->uring_data, buf, len);
+
+	if (len >= size || (sess->config->ktls && sess->state != ssl_connection_complete))
+		return read(sess->sockfd, buf, len);
+
+	if (!backend->ra_buf && !(backend->ra_buf = malloc(size)))
+		return read(sess->sockfd, buf, len);
+
+	if ((n = read(sess->sockfd, backend->ra_buf, size)) <= 0) {
+		err = errno;
+		xfree(backend->ra_buf);
+		errno = err;
+		return n;
+	}
+
+	backend->ra_short = (size_t) n < size;
+	backend->ra_off = 0;
+	backend->ra_len = n;
+
+	return read_ahead(sess, buf, len);
+}
+
 static ssize_t vtls_pull(void *s, void *buf, size_t len)
 {
-	ssize_t ret = read(GNUTLS_POINTER_TO_INT_CAST(s), buf, len);
+	vtls_session_t *sess = s;
+	ssize_t ret = sess->config->read_ahead > 0 ? read_ahead(sess, buf, len) :
+		sess->uring_data ? uring_pull(sess->uring_data, buf, len) : read(sess->sockfd, buf, len);
 #if defined(USE_WINSOCK) && !defined(GNUTLS_MAPS_WINSOCK_ERRORS)
 	if (ret < 0)
 		gnutls_transport_set_global_errno(gtls_mapped_sockerrno());
 #endif
-	error_printf(NULL, "[%d] r len=%zd ret=%zd\n",GNUTLS_POINTER_TO_INT_CAST(s), len, ret);
+	trace_printf(VTLS_TRACE_IO, "[%d] r len=%zu ret=%zd\n", sess->sockfd, len, ret);
 	return ret;
 }
 
+#ifdef HAVE_LINUX_TLS_H
+/*
+ * Kernel TLS: after the handshake, hand the record keys to the kernel, so
+ * reads and writes become plain recv()/send() calls on the socket. Only
+ * AES-GCM and ChaCha20-Poly1305 with TLS 1.2 and 1.3 qualify; with other
+ * ciphers or kernels without the tls module, GnuTLS keeps the record layer.
+ *
+ * The kernel passes non-data records up with their type: close_notify
+ * reads as EOF and TLS 1.3 session tickets are skipped. Anything else,
+ * like a renegotiation or KeyUpdate, fails the read.
+ */
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#define TLS_CONTENT_ALERT 21
+#define TLS_CONTENT_HANDSHAKE 22
+#define TLS_CONTENT_APPLICATION_DATA 23
+#define TLS_HANDSHAKE_NEW_SESSION_TICKET 4
+
+union ktls_crypto_info {
+	struct tls_crypto_info info;
+	struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+	struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+	struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+};
+
+/* the explicit nonce is the sequence number with TLS 1.2 and part of the IV with TLS 1.3 */
+#define KTLS_FILL_GCM(ci, iv, key, seq, tls13) \
+	do { \
+		memcpy((ci).salt, (iv).data, sizeof((ci).salt)); \
+		memcpy((ci).iv, (tls13) ? (iv).data + sizeof((ci).salt) : (seq), sizeof((ci).iv)); \
+		memcpy((ci).key, (key).data, sizeof((ci).key)); \
+		memcpy((ci).rec_seq, (seq), sizeof((ci).rec_seq)); \
+	} while (0)
+
+/* returns the size of the crypto info for setsockopt() or 0 if unsupported */
+static socklen_t ktls_crypto_info(gnutls_session_t session, int read, union ktls_crypto_info *ci)
+{
+	gnutls_datum_t iv, key;
+	unsigned char seq[8];
+	int tls13;
+
+	switch (gnutls_protocol_get_version(session)) {
+	case GNUTLS_TLS1_2:
+		tls13 = 0;
+		break;
+	case GNUTLS_TLS1_3:
+		tls13 = 1;
+		break;
+	default:
+		return 0;
+	}
+
+	if (gnutls_record_get_state(session, read, NULL, &iv, &key, seq) < 0)
+		return 0;
+
+	memset(ci, 0, sizeof(*ci));
+	ci->info.version = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+
+	switch (gnutls_cipher_get(session)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		if (key.size != TLS_CIPHER_AES_GCM_128_KEY_SIZE)
+			return 0;
+		ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		KTLS_FILL_GCM(ci->aes_gcm_128, iv, key, seq, tls13);
+		return sizeof(ci->aes_gcm_128);
+	case GNUTLS_CIPHER_AES_256_GCM:
+		if (key.size != TLS_CIPHER_AES_GCM_256_KEY_SIZE)
+			return 0;
+		ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		KTLS_FILL_GCM(ci->aes_gcm_256, iv, key, seq, tls13);
+		return sizeof(ci->aes_gcm_256);
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+		if (key.size != TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE || iv.size != TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE)
+			return 0;
+		ci->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy(ci->chacha20_poly1305.iv, iv.data, sizeof(ci->chacha20_poly1305.iv));
+		memcpy(ci->chacha20_poly1305.key, key.data, sizeof(ci->chacha20_poly1305.key));
+		memcpy(ci->chacha20_poly1305.rec_seq, seq, sizeof(ci->chacha20_poly1305.rec_seq));
+		return sizeof(ci->chacha20_poly1305);
+	default:
+		return 0;
+	}
+}
+
+/* called once the handshake is complete, falls back silently */
+static void ktls_enable(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	union ktls_crypto_info tx, rx;
+	socklen_t tx_size, rx_size;
+
+	if (!(tx_size = ktls_crypto_info(backend->session, 0, &tx))
+		|| !(rx_size = ktls_crypto_info(backend->session, 1, &rx)))
+	{
+		debug_printf(sess->config, "kTLS: %s not supported\n",
+			gnutls_cipher_get_name(gnutls_cipher_get(backend->session)));
+		return;
+	}
+
+	/* records GnuTLS already decrypted would be lost, corked ones sent with stale keys */
+	if (gnutls_record_check_pending(backend->session) > 0) {
+		debug_printf(sess->config, "kTLS: data pending, not enabled\n");
+	} else if (backend->corked) {
+		debug_printf(sess->config, "kTLS: corked, not enabled\n");
+	} else if (setsockopt(sess->sockfd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"))) {
+		debug_printf(sess->config, "kTLS: not available (%d)\n", errno);
+	} else {
+		backend->ktls_tx = !setsockopt(sess->sockfd, SOL_TLS, TLS_TX, &tx, tx_size);
+		/* the kernel can't decrypt what was read ahead already */
+		backend->ktls_rx = !backend->ra_len && !setsockopt(sess->sockfd, SOL_TLS, TLS_RX, &rx, rx_size);
+		debug_printf(sess->config, "kTLS: tx %s, rx %s\n",
+			backend->ktls_tx ? "on" : "off", backend->ktls_rx ? "on" : "off");
+	}
+
+	gnutls_memset(&tx, 0, sizeof(tx));
+	gnutls_memset(&rx, 0, sizeof(rx));
+}
+
+/* send() a record of the given type, returns like gnutls_record_send() */
+static ssize_t ktls_send(vtls_session_t *sess, unsigned char type, const void *buf, size_t count)
+{
+	char control[CMSG_SPACE(sizeof(type))];
+	struct iovec iov = { .iov_base = (void *) buf, .iov_len = count };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	ssize_t ret;
+
+	if (type != TLS_CONTENT_APPLICATION_DATA) {
+		struct cmsghdr *cmsg;
+
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_TLS;
+		cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(type));
+		memcpy(CMSG_DATA(cmsg), &type, sizeof(type));
+	}
+
+	ret = sendmsg(sess->sockfd, &msg, MSG_NOSIGNAL);
+	trace_printf(VTLS_TRACE_IO, "[%d] ktls w type=%u len=%zu ret=%zd\n", sess->sockfd, type, count, ret);
+
+	if (ret >= 0)
+		return ret;
+
+	return errno == EAGAIN || errno == EWOULDBLOCK ? GNUTLS_E_AGAIN :
+		errno == EINTR ? GNUTLS_E_INTERRUPTED : GNUTLS_E_PUSH_ERROR;
+}
+
+/* recvmsg() application data, returns like gnutls_record_recv() */
+static ssize_t ktls_recv(vtls_session_t *sess, void *buf, size_t count)
+{
+	for (;;) {
+		char control[CMSG_SPACE(sizeof(unsigned char))];
+		struct iovec iov = { .iov_base = buf, .iov_len = count };
+		struct msghdr msg = {
+			.msg_iov = &iov, .msg_iovlen = 1,
+			.msg_control = control, .msg_controllen = sizeof(control)
+		};
+		struct cmsghdr *cmsg;
+		unsigned char type = TLS_CONTENT_APPLICATION_DATA;
+		ssize_t ret = recvmsg(sess->sockfd, &msg, 0);
+
+		trace_printf(VTLS_TRACE_IO, "[%d] ktls r len=%zu ret=%zd\n", sess->sockfd, count, ret);
+
+		if (ret < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? GNUTLS_E_AGAIN :
+				errno == EINTR ? GNUTLS_E_INTERRUPTED : GNUTLS_E_PULL_ERROR;
+		if (ret == 0)
+			return GNUTLS_E_PREMATURE_TERMINATION;
+
+		if ((cmsg = CMSG_FIRSTHDR(&msg)) && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+			type = *CMSG_DATA(cmsg);
+
+		switch (type) {
+		case TLS_CONTENT_APPLICATION_DATA:
+			return ret;
+		case TLS_CONTENT_ALERT:
+			/* level, description; 0 is close_notify */
+			if (ret >= 2 && ((unsigned char *) buf)[1] == 0)
+				return 0;
+			return GNUTLS_E_FATAL_ALERT_RECEIVED;
+		case TLS_CONTENT_HANDSHAKE:
+			if (ret >= 1 && ((unsigned char *) buf)[0] == TLS_HANDSHAKE_NEW_SESSION_TICKET)
+				continue;
+			/* fall through */
+		default:
+			return GNUTLS_E_UNEXPECTED_PACKET;
+		}
+	}
+}
+
+#ifdef HAVE_SYS_SENDFILE_H
+/* let the kernel encrypt file pages into records, returns like gnutls_record_send() */
+static ssize_t ktls_sendfile(vtls_session_t *sess, int fd, off_t offset, size_t count)
+{
+	ssize_t ret = sendfile(sess->sockfd, fd, &offset, count);
+
+	trace_printf(VTLS_TRACE_IO, "[%d] ktls sendfile len=%zu ret=%zd\n", sess->sockfd, count, ret);
+
+	if (ret >= 0)
+		return ret;
+
+	return errno == EAGAIN || errno == EWOULDBLOCK ? GNUTLS_E_AGAIN :
+		errno == EINTR ? GNUTLS_E_INTERRUPTED : GNUTLS_E_PUSH_ERROR;
+}
+#endif
+
+static ssize_t record_send(vtls_session_t *sess, const void *buf, size_t count)
+{
+	struct backend_session_data *backend = sess->backend_data;
+
+	if (backend->ktls_tx)
+		return ktls_send(sess, TLS_CONTENT_APPLICATION_DATA, buf, count);
+
+	return gnutls_record_send(backend->session, buf, count);
+}
+
+static ssize_t record_recv(vtls_session_t *sess, void *buf, size_t count)
+{
+	struct backend_session_data *backend = sess->backend_data;
+
+	if (backend->ktls_rx)
+		return ktls_recv(sess, buf, count);
+
+	return gnutls_record_recv(backend->session, buf, count);
+}
+
+/* send close_notify, returns like gnutls_bye() */
+static int record_bye(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	static const unsigned char close_notify[2] = { 1, 0 }; /* warning, close_notify */
+	ssize_t ret;
+
+	if (!backend->ktls_tx)
+		return gnutls_bye(backend->session, GNUTLS_SHUT_WR);
+
+	return (ret = ktls_send(sess, TLS_CONTENT_ALERT, close_notify, sizeof(close_notify))) < 0 ? (int) ret : 0;
+}
+#else
+#define record_send(sess, buf, count) gnutls_record_send(((struct backend_session_data *) (sess)->backend_data)->session, buf, count)
+#define record_recv(sess, buf, count) gnutls_record_recv(((struct backend_session_data *) (sess)->backend_data)->session, buf, count)
+#define record_bye(sess) gnutls_bye(((struct backend_session_data *) (sess)->backend_data)->session, GNUTLS_SHUT_WR)
+#endif /* HAVE_LINUX_TLS_H */
+
+/*
+ * Send what vtls_cork() held back, returns like gnutls_record_uncork().
+ * After GNUTLS_E_AGAIN the session stays corked and the rest goes out with
+ * the next call. With kTLS the kernel encrypts each write right away and
+ * TCP_CORK only merges the records into full segments.
+ */
+static int uncork(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	int rc;
+
+	if (!backend->corked)
+		return 0;
+
+#ifdef HAVE_LINUX_TLS_H
+	if (backend->ktls_tx) {
+		int off = 0;
+
+		if (setsockopt(sess->sockfd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)))
+			return GNUTLS_E_PUSH_ERROR;
+	} else
+#endif
+	if ((rc = gnutls_record_uncork(backend->session, 0)) < 0)
+		return rc;
+
+	backend->corked = 0;
+	return 0;
+}
+
 int backend_get_engine(void)
 {
 	return CURLSSLBACKEND_GNUTLS;
@@ -186,14 +585,23 @@ int backend_init(vtls_config_t *config)
 		gnutls_global_set_log_function(tls_log_func);
 		gnutls_global_set_log_level(2);
 #endif
+		/* sessions that start before this is done wait for it in cred_get() */
+		if (config && config->trust_preload > 0)
+			_cred_preloading = pthread_create(&_cred_preload_thread, NULL, cred_preload, config) == 0;
 	}
 	return ret;
 }
 
 int backend_deinit(void)
 {
-	if (--_init_backend == 0)
+	if (--_init_backend == 0) {
+		if (_cred_preloading) {
+			pthread_join(_cred_preload_thread, NULL);
+			_cred_preloading = 0;
+		}
+		cred_cache_flush();
 		gnutls_global_deinit();
+	}
 
 	return 0;
 }
@@ -208,6 +616,10 @@ int backend_session_init(vtls_session_t *sess)
 
 void backend_session_deinit(vtls_session_t *sess)
 {
+	struct backend_session_data *backend = sess->backend_data;
+
+	if (backend)
+		xfree(backend->ra_buf);
 	xfree(sess->backend_data);
 }
 
@@ -260,28 +672,156 @@ static void unload_file(gnutls_datum_t data)
 	free(data.data);
 }
 
-/* this function does a SSL/TLS (re-)handshake */
+/* session_cache_key()
+ *
+ * Key for the session caches: the config fingerprint, the host name (which
+ * is also used for SNI) and the port of the peer.
+ */
+static char *session_cache_key(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	unsigned int port = 0;
+	size_t size;
+	char *key;
+
+	if (getpeername(sess->sockfd, (struct sockaddr *) &ss, &sslen) == 0) {
+		if (ss.ss_family == AF_INET)
+			port = ntohs(((struct sockaddr_in *) &ss)->sin_port);
+#ifdef ENABLE_IPV6
+		else if (ss.ss_family == AF_INET6)
+			port = ntohs(((struct sockaddr_in6 *) &ss)->sin6_port);
+#endif
+	}
+
+	size = sizeof(backend->cred->fingerprint) + strlen(sess->hostname) + 7;
+	if ((key = malloc(size)))
+		snprintf(key, size, "%s/%s:%u", backend->cred->fingerprint, sess->hostname, port);
+
+	return key;
+}
+
+static const char *sessstore_name(vtls_config_t *config, size_t idx)
+{
+	return idx == 0 ? config->session_shm : config->session_file;
+}
+
+/* session_cache_store()
+ *
+ * Put the current session into the cache, so the next connect to the same
+ * peer can resume it.
+ */
+static void session_cache_store(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	gnutls_datum_t data;
+	time_t expires;
+	size_t it;
+
+	if (gnutls_session_get_data2(backend->session, &data) != GNUTLS_E_SUCCESS)
+		return;
+
+	/* the lifetime of the session or, with TLS 1.3, the ticket lifetime hint */
+	expires = gnutls_db_check_entry_expire_time(&data);
+	if (expires > time(NULL)) {
+		if (backend->cred->sesscache && sesscache_put(backend->cred->sesscache, backend->cache_key, &data, expires) == 0)
+			trace_printf(VTLS_TRACE_SESSION, "stored TLS session for %s\n", backend->cache_key);
+		for (it = 0; it < countof(backend->cred->sessstore); it++) {
+			if (backend->cred->sessstore[it] && sessfile_put(backend->cred->sessstore[it], backend->cache_key, &data, expires) == 0)
+				trace_printf(VTLS_TRACE_SESSION, "stored TLS session for %s in %s\n", backend->cache_key, sessstore_name(sess->config, it));
+		}
+	}
+
+	gnutls_free(data.data);
+}
+
+/* session_cache_get()
+ *
+ * Look up a session for the current peer, first in memory, then in shared
+ * memory, then on disk. Sessions found outside of the process are kept in
+ * memory from then on.
+ */
+static int session_cache_get(vtls_session_t *sess, gnutls_datum_t *data)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	size_t it;
+
+	if (backend->cred->sesscache && sesscache_get(backend->cred->sesscache, backend->cache_key, data) == 0)
+		return 0;
+
+	for (it = 0; it < countof(backend->cred->sessstore); it++) {
+		if (backend->cred->sessstore[it] && sessfile_get(backend->cred->sessstore[it], backend->cache_key, data) == 0) {
+			trace_printf(VTLS_TRACE_SESSION, "loaded TLS session for %s from %s\n", backend->cache_key, sessstore_name(sess->config, it));
+			if (backend->cred->sesscache)
+				sesscache_put(backend->cred->sesscache, backend->cache_key, data, gnutls_db_check_entry_expire_time(data));
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* session_cache_remove()
+ *
+ * Forget the session for the current peer.
+ */
+static void session_cache_remove(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	size_t it;
+
+	if (backend->cred->sesscache)
+		sesscache_remove(backend->cred->sesscache, backend->cache_key);
+	for (it = 0; it < countof(backend->cred->sessstore); it++) {
+		if (backend->cred->sessstore[it])
+			sessfile_remove(backend->cred->sessstore[it], backend->cache_key);
+	}
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+/* TLS 1.3 tickets arrive after the handshake, possibly more than one */
+static int session_ticket_hook(gnutls_session_t session, unsigned int htype,
+	unsigned int when, unsigned int incoming, const gnutls_datum_t *msg)
+{
+	vtls_session_t *sess = gnutls_session_get_ptr(session);
+
+	(void) when;
+	(void) msg;
+
+	if (htype == GNUTLS_HANDSHAKE_NEW_SESSION_TICKET && incoming)
+		session_cache_store(sess);
+
+	return 0;
+}
+#endif
+
+/* this function does a SSL/TLS (re-)handshake
+ *
+ * With nonblocking set, it never waits: if GnuTLS needs the socket to become
+ * readable or writable, sess->connecting_state says which, and it returns 0.
+ */
 static int handshake(vtls_session_t *sess, int nonblocking)
 {
 	struct backend_session_data *backend = sess->backend_data;
 	vtls_config_t *config = sess->config;
 	int sockfd = sess->sockfd;
-	long timeout_ms;
+	long timeout_ms = 0;
 	int rc;
 
 	for (;;) {
-		/* check allowed time left */
-		timeout_ms = vtls_timeleft_ms(&sess->connect_start, sess->config->connect_timeout);
-
-		if (timeout_ms < 0) {
+		/* check allowed time left, a reactor enforces the timeout itself */
+		if (!sess->reactor_data
+			&& (timeout_ms = vtls_timeleft_ms(&sess->connect_start, sess->config->connect_timeout)) < 0)
+		{
 			/* no need to continue if time already is up */
 			error_printf(config, "SSL connection timeout\n");
 			return CURLE_OPERATION_TIMEDOUT;
 		}
 
 		/* if ssl is expecting something, check if it's available. */
-		if (sess->connecting_state == ssl_connect_2_reading
-			|| sess->connecting_state == ssl_connect_2_writing)
+		if (!nonblocking && (sess->connecting_state == ssl_connect_2_reading
+			|| sess->connecting_state == ssl_connect_2_writing))
 		{
 			int writefd = ssl_connect_2_writing == sess->connecting_state ? sockfd : -1;
 			int readfd = ssl_connect_2_reading == sess->connecting_state ? sockfd : -1;
@@ -292,9 +832,7 @@ static int handshake(vtls_session_t *sess, int nonblocking)
 				error_printf(config, "select/poll on SSL socket, errno: %d", SOCKERRNO);
 				return CURLE_SSL_CONNECT_ERROR;
 			} else if (0 == what) {
-				if (nonblocking)
-					return 0;
-				else if (timeout_ms) {
+				if (timeout_ms) {
 					/* timeout */
 					error_printf(config, "SSL connection timeout at %ld", timeout_ms);
 					return CURLE_OPERATION_TIMEDOUT;
@@ -308,6 +846,8 @@ static int handshake(vtls_session_t *sess, int nonblocking)
 		if ((rc == GNUTLS_E_AGAIN) || (rc == GNUTLS_E_INTERRUPTED)) {
 			sess->connecting_state = gnutls_record_get_direction(backend->session) ?
 				ssl_connect_2_writing : ssl_connect_2_reading;
+			if (nonblocking)
+				return 0;
 			continue;
 		} else if ((rc < 0) && !gnutls_error_is_fatal(rc)) {
 			const char *strerr = NULL;
@@ -351,13 +891,583 @@ static gnutls_x509_crt_fmt_t do_file_type(int type)
 	return -1;
 }
 
+struct dir_loader {
+	vtls_config_t *config;
+	char **files;
+	size_t nfiles;
+	size_t first; /* this loader parses files[first], files[first + step], ... */
+	size_t step;
+	gnutls_x509_crt_t *crts;
+	unsigned int ncrts;
+	unsigned int max_crts;
+};
+
+static void *dir_load_thread(void *p)
+{
+	struct dir_loader *loader = p;
+	size_t it;
+
+	for (it = loader->first; it < loader->nfiles; it += loader->step) {
+		gnutls_x509_crt_t *crts;
+		gnutls_datum_t data;
+		struct stat st;
+		unsigned int n;
+		int rc;
+
+		if (stat(loader->files[it], &st) || !S_ISREG(st.st_mode))
+			continue;
+
+		if ((rc = gnutls_load_file(loader->files[it], &data)) == 0) {
+			rc = gnutls_x509_crt_list_import2(&crts, &n, &data, GNUTLS_X509_FMT_PEM, 0);
+			gnutls_free(data.data);
+		}
+
+		if (rc < 0) {
+			error_printf(loader->config, "failed to load CA cert '%s': (%d)\n", loader->files[it], rc);
+			continue;
+		}
+
+		if (loader->ncrts + n > loader->max_crts) {
+			unsigned int max = (loader->ncrts + n) * 2;
+			gnutls_x509_crt_t *p;
+
+			if (!(p = realloc(loader->crts, max * sizeof(gnutls_x509_crt_t)))) {
+				while (n)
+					gnutls_x509_crt_deinit(crts[--n]);
+				gnutls_free(crts);
+				continue;
+			}
+
+			loader->crts = p;
+			loader->max_crts = max;
+		}
+
+		memcpy(loader->crts + loader->ncrts, crts, n * sizeof(gnutls_x509_crt_t));
+		loader->ncrts += n;
+		gnutls_free(crts);
+	}
+
+	return NULL;
+}
+
+/* cred_load_dir()
+ *
+ * Load all *.pem files from config->CApath into the trust list of cred.
+ * With config->trust_preload > 1, the files are parsed by that many threads
+ * and the results are merged into the trust list afterwards.
+ * Returns the number of certificates loaded.
+ */
+static int cred_load_dir(vtls_config_t *config, gnutls_certificate_credentials_t cred)
+{
+	gnutls_x509_trust_list_t tlist;
+	DIR *dir;
+	struct dirent *dp;
+	size_t dirlen = strlen(config->CApath), nfiles = 0, max_files = 0, nthreads, it;
+	char **files = NULL;
+	int ncerts = 0;
+
+	if (!(dir = opendir(config->CApath))) {
+		error_printf(config, "failed to open CA cert dir %s\n", config->CApath);
+		return 0;
+	}
+
+	while ((dp = readdir(dir))) {
+		size_t len = strlen(dp->d_name);
+
+		if (len >= 4 && !strncasecmp(dp->d_name + len - 4, ".pem", 4)) {
+			if (nfiles >= max_files) {
+				size_t max = max_files ? max_files * 2 : 64;
+				char **p;
+
+				if (!(p = realloc(files, max * sizeof(char *))))
+					break;
+
+				files = p;
+				max_files = max;
+			}
+
+			if (!(files[nfiles] = malloc(dirlen + 1 + len + 1)))
+				break;
+
+			snprintf(files[nfiles++], dirlen + 1 + len + 1, "%s/%s", config->CApath, dp->d_name);
+		}
+	}
+
+	closedir(dir);
+
+	nthreads = config->trust_preload > 1 ? (size_t) config->trust_preload : 1;
+	if (nthreads > nfiles)
+		nthreads = nfiles ? nfiles : 1;
+
+	{
+		struct dir_loader loaders[nthreads];
+		pthread_t threads[nthreads];
+		char started[nthreads];
+
+		memset(loaders, 0, sizeof(loaders));
+		for (it = 0; it < nthreads; it++) {
+			loaders[it].config = config;
+			loaders[it].files = files;
+			loaders[it].nfiles = nfiles;
+			loaders[it].first = it;
+			loaders[it].step = nthreads;
+		}
+
+		/* loader 0 runs in this thread, as do those we can't start a thread for */
+		for (it = 1; it < nthreads; it++)
+			started[it] = pthread_create(&threads[it], NULL, dir_load_thread, &loaders[it]) == 0;
+
+		dir_load_thread(&loaders[0]);
+
+		for (it = 1; it < nthreads; it++) {
+			if (started[it])
+				pthread_join(threads[it], NULL);
+			else
+				dir_load_thread(&loaders[it]);
+		}
+
+		/* the trust list takes over the parsed certificates */
+		gnutls_certificate_get_trust_list(cred, &tlist);
+		for (it = 0; it < nthreads; it++) {
+			if (loaders[it].ncrts) {
+				int rc = gnutls_x509_trust_list_add_cas(tlist, loaders[it].crts, loaders[it].ncrts, GNUTLS_TL_USE_IN_TLS);
+
+				if (rc > 0)
+					ncerts += rc;
+			}
+			xfree(loaders[it].crts);
+		}
+	}
+
+	for (it = 0; it < nfiles; it++)
+		xfree(files[it]);
+	xfree(files);
+
+	return ncerts;
+}
+
+/* config_fingerprint()
+ *
+ * Hash the config settings that affect whether a session may be resumed.
+ * Unlike the config clone held by a cache entry, this identifies the config
+ * across process lifetimes. Keep it in sync with vtls_config_matches().
+ */
+static void config_fingerprint(const vtls_config_t *config, char *hex)
+{
+	const char *strings[] = {
+		config->CApath, config->CAfile, config->CRLfile, config->CAstore,
+		config->CERTfile, config->KEYfile, config->issuercert, config->cipher_list
+	};
+	unsigned char flags[] = {
+		config->version, config->verifypeer, config->verifyhost, config->verifystatus, config->capath_hashed
+	};
+	unsigned char digest[32];
+	gnutls_hash_hd_t hd;
+	size_t it;
+
+	*hex = 0;
+	if (gnutls_hash_init(&hd, GNUTLS_DIG_SHA256) < 0)
+		return;
+
+	gnutls_hash(hd, flags, sizeof(flags));
+	for (it = 0; it < countof(strings); it++)
+		gnutls_hash(hd, strings[it] ? strings[it] : "", strings[it] ? strlen(strings[it]) + 1 : 1);
+	gnutls_hash_deinit(hd, digest);
+
+	for (it = 0; it < 8; it++)
+		snprintf(hex + it * 2, 3, "%02x", digest[it]);
+}
+
+/* load CA certs, CRLs and the client certificate as given by config into entry */
+static int cred_load(vtls_config_t *config, struct cred_entry *entry)
+{
+	gnutls_certificate_credentials_t cred = entry->cred;
+	const char *hashed_dir = NULL;
+	castore_t *store = NULL;
+	int rc;
+
+	if (config->CApath && *config->CApath && config->verifypeer) {
+		rc = -1;
+#if GNUTLS_VERSION_NUMBER >= 0x030014
+		if (!strcmp(config->CApath, "system")) {
+			rc = gnutls_certificate_set_x509_system_trust(cred);
+			if (rc < 0) {
+				error_printf(config, "error reading system CA cert dir (%s)\n", gnutls_strerror(rc));
+				return CURLE_SSL_CACERT_BADFILE;
+			}
+			debug_printf(config, "found %d certificates in system CA cert dir\n", rc);
+		}
+#else
+		error_printf(config, "system CA cert dir not supported - GnuTLS version too old\n");
+#endif
+		if (rc < 0 && config->capath_hashed) {
+			/* look up CA certs by subject hash when they are needed */
+			hashed_dir = config->CApath;
+			debug_printf(config, "loading CA certs on demand from hashed CA cert dir '%s'\n", config->CApath);
+		} else if (rc < 0) {
+			int ncerts = cred_load_dir(config, cred);
+
+			debug_printf(config, "found %d certificates in CA cert dir '%s'\n", ncerts, config->CApath);
+		}
+	}
+
+	if (config->CAstore && config->verifypeer) {
+		if (!(store = castore_open(config->CAstore))) {
+			error_printf(config, "error reading CA store %s\n", config->CAstore);
+			return CURLE_SSL_CACERT_BADFILE;
+		}
+		debug_printf(config, "found %u certificates in CA store '%s'\n", castore_count(store), config->CAstore);
+	}
+
+	if (hashed_dir || store) {
+		gnutls_x509_trust_list_t tlist;
+
+		gnutls_certificate_get_trust_list(cred, &tlist);
+		if (!(entry->capath = capath_init(entry->config, tlist, hashed_dir, store))) {
+			castore_close(store);
+			return CURLE_OUT_OF_MEMORY;
+		}
+	}
+
+	if (config->CAfile) {
+		/* set the trusted CA cert bundle file */
+		gnutls_certificate_set_verify_flags(cred, GNUTLS_VERIFY_ALLOW_X509_V1_CA_CRT);
+
+		rc = gnutls_certificate_set_x509_trust_file(cred, config->CAfile, GNUTLS_X509_FMT_PEM);
+		if (rc < 0) {
+			error_printf(config, "error reading CA cert file %s (%s)\n", config->CAfile, gnutls_strerror(rc));
+			if (config->verifypeer)
+				return CURLE_SSL_CACERT_BADFILE;
+		} else
+			debug_printf(config, "found %d certificates in CA cert file '%s'\n", rc, config->CAfile);
+	}
+
+	if (config->CRLfile) {
+		/* index the CRL list file, it is checked in gtls_connect_step3() */
+		if (!(entry->crl = crl_load(entry->config, config->CRLfile)))
+			return CURLE_SSL_CRL_BADFILE;
+
+		debug_printf(config, "found %d CRL in %s\n", crl_count(entry->crl), config->CRLfile);
+	}
+
+	if (config->verify_cache_ttl > 0 && config->verifypeer) {
+		/* a new cache per entry, so a reload of the trust store invalidates all results */
+		if (!(entry->verifycache = verifycache_init(config->verify_cache_ttl)))
+			return CURLE_OUT_OF_MEMORY;
+	}
+
+	if (config->session_cache > 0) {
+		/* like the verify cache, sessions must not outlive the trust store they were verified with */
+		if (!(entry->sesscache = sesscache_init(config->session_cache)))
+			return CURLE_OUT_OF_MEMORY;
+	}
+
+	/* sessions are only read from these when a host is first connected to */
+	if (config->session_shm) {
+		if (!(entry->sessstore[0] = sessfile_open_shm(config->session_shm)))
+			error_printf(config, "error opening TLS session shm segment %s\n", config->session_shm);
+	}
+
+	if (config->session_file) {
+		if (!(entry->sessstore[1] = sessfile_open(config->session_file)))
+			error_printf(config, "error opening TLS session file %s\n", config->session_file);
+	}
+
+	config_fingerprint(config, entry->fingerprint);
+
+	if (config->CERTfile) {
+		if (gnutls_certificate_set_x509_key_file(cred,
+			config->CERTfile,
+			config->KEYfile ? config->KEYfile : config->CERTfile,
+			do_file_type(config->cert_type)) != GNUTLS_E_SUCCESS)
+		{
+			error_printf(config, "error reading X.509 key or certificate file");
+			return CURLE_SSL_CONNECT_ERROR;
+		}
+	}
+
+	return 0;
+}
+
+/* cred_free()
+ *
+ * Free an entry that has no references left.
+ */
+static void cred_free(struct cred_entry *entry)
+{
+	capath_deinit(entry->capath);
+	crl_free(entry->crl);
+	verifycache_deinit(entry->verifycache);
+	sesscache_deinit(entry->sesscache);
+	sessfile_close(entry->sessstore[0]);
+	sessfile_close(entry->sessstore[1]);
+	if (entry->cred)
+		gnutls_certificate_free_credentials(entry->cred);
+	vtls_config_deinit(entry->config);
+	xfree(entry);
+}
+
+/* cred_new()
+ *
+ * Allocate an empty entry for config, with one reference for the caller.
+ */
+static struct cred_entry *cred_new(vtls_config_t *config)
+{
+	struct cred_entry *entry;
+
+	if (!(entry = calloc(1, sizeof(*entry))))
+		return NULL;
+
+	if (vtls_config_clone(config, &entry->config)) {
+		cred_free(entry);
+		return NULL;
+	}
+
+	entry->refcount = 1;
+	return entry;
+}
+
+/* allocate the credentials of entry and load them from disk, returns a CURLcode */
+static int cred_fill(struct cred_entry *entry)
+{
+	int rc = gnutls_certificate_allocate_credentials(&entry->cred);
+
+	if (rc != GNUTLS_E_SUCCESS) {
+		error_printf(entry->config, "gnutls_cert_all_cred() failed: %s\n", gnutls_strerror(rc));
+		entry->cred = NULL;
+		return CURLE_SSL_CONNECT_ERROR;
+	}
+
+	return cred_load(entry->config, entry);
+}
+
+/* cred_create()
+ *
+ * Load a new set of credentials for config, with one reference for the caller.
+ * On error, NULL is returned and *result is set to a CURLcode.
+ */
+static struct cred_entry *cred_create(vtls_config_t *config, int *result)
+{
+	struct cred_entry *entry;
+
+	if (!(entry = cred_new(config))) {
+		*result = CURLE_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+	if ((*result = cred_fill(entry))) {
+		cred_free(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/* release a reference taken by cred_get() */
+static void cred_put(struct cred_entry *entry)
+{
+	int refcount;
+
+	pthread_mutex_lock(&_cred_cache_mutex);
+	refcount = --entry->refcount;
+	pthread_mutex_unlock(&_cred_cache_mutex);
+
+	if (refcount == 0)
+		cred_free(entry);
+}
+
+/* cred_reload()
+ *
+ * Called from the watcher thread when a file of the entry with the given id
+ * changed. The new credentials are built without holding the cache lock and
+ * then swapped in. Sessions still using the old ones keep their reference,
+ * the old entry goes away when the last of them is closed.
+ */
+static void cred_reload(void *ctx, int id)
+{
+	struct cred_entry *entry, *old, **pp;
+	int rc;
+
+	(void) ctx;
+
+	pthread_mutex_lock(&_cred_cache_mutex);
+	for (old = _cred_cache; old && old->id != id; old = old->next);
+	if (old)
+		old->refcount++;
+	pthread_mutex_unlock(&_cred_cache_mutex);
+
+	if (!old)
+		return;
+
+	if (!(entry = cred_create(old->config, &rc))) {
+		error_printf(old->config, "failed to reload CA certs (%d), keeping the old ones\n", rc);
+		cred_put(old);
+		return;
+	}
+
+	pthread_mutex_lock(&_cred_cache_mutex);
+	for (pp = &_cred_cache; *pp && *pp != old; pp = &(*pp)->next);
+	if (*pp) {
+		entry->id = old->id;
+		entry->next = old->next;
+		*pp = entry;
+		old->refcount--; /* the cache's reference, now held by entry */
+		entry = NULL;
+	}
+	pthread_mutex_unlock(&_cred_cache_mutex);
+
+	if (entry)
+		cred_put(entry); /* the cache was flushed meanwhile */
+	else
+		debug_printf(old->config, "reloaded CA certs\n");
+
+	cred_put(old);
+}
+
+/* watch the files of entry for changes, called with the cache lock held */
+static void cred_watch(struct cred_entry *entry)
+{
+	vtls_config_t *config = entry->config;
+	int rc = 0;
+
+	if (!_cred_watch && !(_cred_watch = filewatch_start(cred_reload, NULL, 1000))) {
+		error_printf(config, "failed to start watching CA cert files\n");
+		return;
+	}
+
+	if (config->CApath && strcmp(config->CApath, "system"))
+		rc |= filewatch_add(_cred_watch, config->CApath, 1, entry->id);
+	if (config->CAfile)
+		rc |= filewatch_add(_cred_watch, config->CAfile, 0, entry->id);
+	if (config->CRLfile)
+		rc |= filewatch_add(_cred_watch, config->CRLfile, 0, entry->id);
+	if (config->CAstore)
+		rc |= filewatch_add(_cred_watch, config->CAstore, 0, entry->id);
+
+	if (rc)
+		error_printf(config, "failed to watch some CA cert files for changes\n");
+}
+
+/* cred_get()
+ *
+ * Return the certificate credentials matching config, loading them from disk
+ * only if no session has done so before. The returned entry holds a reference
+ * for the caller, which must be released with cred_put().
+ * On error, NULL is returned and *result is set to a CURLcode.
+ */
+static struct cred_entry *cred_get(vtls_config_t *config, int *result)
+{
+	struct cred_entry *entry, **pp;
+
+	pthread_mutex_lock(&_cred_cache_mutex);
+
+	for (entry = _cred_cache; entry;) {
+		if (entry->config->cert_type == config->cert_type && vtls_config_matches(entry->config, config)) {
+			if (entry->loading) {
+				/* someone else (e.g. the preload thread) is loading it, wait for that */
+				pthread_cond_wait(&_cred_cache_cond, &_cred_cache_mutex);
+				entry = _cred_cache; /* the list may have changed meanwhile */
+				continue;
+			}
+
+			entry->refcount++;
+			pthread_mutex_unlock(&_cred_cache_mutex);
+			return entry;
+		}
+		entry = entry->next;
+	}
+
+	/* not found, add a placeholder while loading, so that concurrent sessions
+		with the same config wait for us instead of loading it twice */
+	if (!(entry = cred_new(config))) {
+		pthread_mutex_unlock(&_cred_cache_mutex);
+		*result = CURLE_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+	entry->refcount++; /* the cache's reference plus the caller's */
+	entry->loading = 1;
+	entry->id = ++_cred_next_id;
+	entry->next = _cred_cache;
+	_cred_cache = entry;
+
+	pthread_mutex_unlock(&_cred_cache_mutex);
+
+	*result = cred_fill(entry);
+
+	pthread_mutex_lock(&_cred_cache_mutex);
+	entry->loading = 0;
+	if (*result) {
+		/* remove it from the cache, unless the cache has been flushed meanwhile */
+		for (pp = &_cred_cache; *pp && *pp != entry; pp = &(*pp)->next);
+		if (*pp) {
+			*pp = entry->next;
+			entry->refcount--;
+		}
+	} else if (config->trust_reload)
+		cred_watch(entry);
+	pthread_cond_broadcast(&_cred_cache_cond);
+	pthread_mutex_unlock(&_cred_cache_mutex);
+
+	if (*result) {
+		cred_put(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/* build the trust store of the default config in the background */
+static void *cred_preload(void *p)
+{
+	vtls_config_t *config = p;
+	struct cred_entry *entry;
+	int rc;
+
+	if ((entry = cred_get(config, &rc)))
+		cred_put(entry);
+	else
+		error_printf(config, "failed to preload CA certs (%d)\n", rc);
+
+	return NULL;
+}
+
+/* drop the cache's references, entries still in use are freed by their last session */
+static void cred_cache_flush(void)
+{
+	struct cred_entry *entry, *next;
+
+	/* stop reloading first, the watcher thread takes the cache lock */
+	filewatch_stop(_cred_watch);
+	_cred_watch = NULL;
+
+	pthread_mutex_lock(&_cred_cache_mutex);
+	entry = _cred_cache;
+	_cred_cache = NULL;
+	pthread_mutex_unlock(&_cred_cache_mutex);
+
+	for (; entry; entry = next) {
+		next = entry->next;
+		cred_put(entry);
+	}
+}
+
+/* record layer state of one connection, gone with its TLS layer */
+static void reset_record_state(struct backend_session_data *backend)
+{
+	backend->bye_sent = backend->corked = backend->renegotiating = 0;
+	backend->ktls_tx = backend->ktls_rx = 0;
+	backend->ra_short = 0;
+	backend->ra_off = backend->ra_len = 0;
+	xfree(backend->ra_buf);
+}
+
 static int
 gtls_connect_step1(vtls_session_t *sess)
 {
 //	struct SessionHandle *data = conn->data;
 	struct backend_session_data *backend = sess->backend_data;
 	vtls_config_t *config = sess->config;
-	const char *ca_directory = sess->config->CApath;
 	int rc;
 	int sni = 1; /* default is SNI enabled */
 #ifdef ENABLE_IPV6
@@ -406,12 +1516,12 @@ gtls_connect_step1(vtls_session_t *sess)
 	} else if (sess->config->version == CURL_SSLVERSION_SSLv3)
 		sni = 0; /* SSLv3 has no SNI */
 
-	/* allocate a cred struct */
-	rc = gnutls_certificate_allocate_credentials(&backend->cred);
-	if (rc != GNUTLS_E_SUCCESS) {
-		error_printf(config, "gnutls_cert_all_cred() failed: %s\n", gnutls_strerror(rc));
-		return CURLE_SSL_CONNECT_ERROR;
-	}
+	/* nothing of an earlier connection of this session carries over */
+	reset_record_state(backend);
+
+	/* get the (shared) certificate credentials for this config */
+	if (!(backend->cred = cred_get(config, &rc)))
+		return rc;
 
 #ifdef USE_TLS_SRP
 	if (sess->config->authtype == CURL_TLSAUTH_SRP) {
@@ -425,86 +1535,13 @@ gtls_connect_step1(vtls_session_t *sess)
 
 		rc = gnutls_srp_set_client_credentials(sess->srp_client_cred,
 			data->set.ssl.username,
-			data->set.ssl.password);
-		if (rc != GNUTLS_E_SUCCESS) {
-			error_printf(config, "gnutls_srp_set_client_cred() failed: %s\n", gnutls_strerror(rc));
-			return CURLE_BAD_FUNCTION_ARGUMENT;
-		}
-	}
-#endif
-
-	if (ca_directory && *ca_directory && sess->config->verifypeer) {
-		rc = -1;
-#if GNUTLS_VERSION_NUMBER >= 0x030014
-		if (!strcmp(ca_directory, "system")) {
-			rc = gnutls_certificate_set_x509_system_trust(backend->cred);
-			if (rc < 0) {
-				error_printf(config, "error reading system CA cert dir (%s)\n", gnutls_strerror(rc));
-				return CURLE_SSL_CACERT_BADFILE;
-			}
-			debug_printf(config, "found %d certificates in system CA cert dir\n", rc);
-		}
-#else
-		error_printf(config, "system CA cert dir not supported - GnuTLS version too old\n");
-#endif
-		if (rc < 0) {
-			DIR *dir;
-			int ncerts = 0;
-
-			if ((dir = opendir(ca_directory))) {
-				struct dirent *dp;
-				size_t dirlen = strlen(ca_directory);
-
-				while ((dp = readdir(dir))) {
-					size_t len = strlen(dp->d_name);
-
-					if (len >= 4 && !strncasecmp(dp->d_name + len - 4, ".pem", 4)) {
-						struct stat st;
-						char fname[dirlen + 1 + len + 1];
-
-						snprintf(fname, sizeof(fname), "%s/%s", ca_directory, dp->d_name);
-						if (stat(fname, &st) == 0 && S_ISREG(st.st_mode)) {
-							int rc;
-
-							if ((rc = gnutls_certificate_set_x509_trust_file(backend->cred, fname, GNUTLS_X509_FMT_PEM)) <= 0)
-								error_printf(config, "failed to load CA cert '%s': (%d)\n", fname, rc);
-							else
-								ncerts += rc;
-						}
-					}
-				}
-
-				closedir(dir);
-			} else {
-				error_printf(config, "failed to open CA cert dir %s\n", ca_directory);
-			}
-
-			debug_printf(config, "found %d certificates in CA cert dir '%s'\n", ncerts, ca_directory);
-		}
-	}
-
-	if (sess->config->CAfile) {
-		/* set the trusted CA cert bundle file */
-		gnutls_certificate_set_verify_flags(backend->cred, GNUTLS_VERIFY_ALLOW_X509_V1_CA_CRT);
-
-		rc = gnutls_certificate_set_x509_trust_file(backend->cred, sess->config->CAfile, GNUTLS_X509_FMT_PEM);
-		if (rc < 0) {
-			error_printf(config, "error reading CA cert file %s (%s)\n", sess->config->CAfile, gnutls_strerror(rc));
-			if (sess->config->verifypeer)
-				return CURLE_SSL_CACERT_BADFILE;
-		} else
-			debug_printf(config, "found %d certificates in CA cert file '%s'\n", rc, sess->config->CAfile);
-	}
-
-	if (sess->config->CRLfile) {
-		/* set the CRL list file */
-		rc = gnutls_certificate_set_x509_crl_file(backend->cred, sess->config->CRLfile, GNUTLS_X509_FMT_PEM);
-		if (rc < 0) {
-			error_printf(config, "error reading crl file %s (%s)", sess->config->CRLfile, gnutls_strerror(rc));
-			return CURLE_SSL_CRL_BADFILE;
-		} else
-			debug_printf(config, "found %d CRL in %s\n", rc, sess->config->CRLfile);
+			data->set.ssl.password);
+		if (rc != GNUTLS_E_SUCCESS) {
+			error_printf(config, "gnutls_srp_set_client_cred() failed: %s\n", gnutls_strerror(rc));
+			return CURLE_BAD_FUNCTION_ARGUMENT;
+		}
 	}
+#endif
 
 	/* Initialize TLS session as a client */
 	rc = gnutls_init(&backend->session, GNUTLS_CLIENT);
@@ -649,17 +1686,6 @@ gtls_connect_step1(vtls_session_t *sess)
 	}
 #endif
 
-	if (sess->config->CERTfile) {
-		if (gnutls_certificate_set_x509_key_file(backend->cred,
-			sess->config->CERTfile,
-			sess->config->KEYfile ? sess->config->KEYfile : sess->config->CERTfile,
-			do_file_type(sess->config->cert_type)) != GNUTLS_E_SUCCESS)
-		{
-			error_printf(config, "error reading X.509 key or certificate file");
-			return CURLE_SSL_CONNECT_ERROR;
-		}
-	}
-
 #ifdef USE_TLS_SRP
 	/* put the credentials to the current session */
 	if (data->set.ssl.authtype == CURL_TLSAUTH_SRP) {
@@ -668,13 +1694,14 @@ gtls_connect_step1(vtls_session_t *sess)
 			error_printf(config, "gnutls_credentials_set() failed: %s", gnutls_strerror(rc));
 	} else
 #endif
-		rc = gnutls_credentials_set(backend->session, GNUTLS_CRD_CERTIFICATE, backend->cred);
+		rc = gnutls_credentials_set(backend->session, GNUTLS_CRD_CERTIFICATE, backend->cred->cred);
 
 	/* set the connection handle (file descriptor for the socket) */
-	gnutls_transport_set_ptr(backend->session, GNUTLS_INT_TO_POINTER_CAST(sess->sockfd));
+	gnutls_transport_set_ptr(backend->session, sess);
+	backend->sock_nonblocking = (fcntl(sess->sockfd, F_GETFL) & O_NONBLOCK) != 0;
 
 	/* register callback functions to send and receive data. */
-	gnutls_transport_set_push_function(backend->session, vtls_push);
+	gnutls_transport_set_vec_push_function(backend->session, vtls_push);
 	gnutls_transport_set_pull_function(backend->session, vtls_pull);
 
 	/* lowat must be set to zero when using custom push and pull functions. */
@@ -690,16 +1717,26 @@ gtls_connect_step1(vtls_session_t *sess)
 	}
 #endif
 
-	/* This might be a reconnect, so we check for a session ID in the cache
+	/* This might be a reconnect, so we check for a session in the cache
 		to speed up things */
+	xfree(backend->cache_key);
+	if ((backend->cred->sesscache || backend->cred->sessstore[0] || backend->cred->sessstore[1])
+		&& (backend->cache_key = session_cache_key(sess))) {
+		gnutls_datum_t data;
+
+		if (session_cache_get(sess, &data) == 0) {
+			/* we got a session, use it! */
+			if (gnutls_session_set_data(backend->session, data.data, data.size) == GNUTLS_E_SUCCESS)
+				trace_printf(VTLS_TRACE_SESSION, "SSL re-using session for %s\n", backend->cache_key);
+			xfree(data.data);
+		}
 
-//	if (!Curl_ssl_getsessionid(sess, &ssl_sessionid, &ssl_idsize)) {
-		/* we got a session id, use it! */
-//		gnutls_session_set_data(backend->session, ssl_sessionid, ssl_idsize);
-
-		/* Informational message */
-//		debug_printf(config, "SSL re-using session ID\n");
-//	}
+		gnutls_session_set_ptr(backend->session, sess);
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+		gnutls_handshake_set_hook_function(backend->session, GNUTLS_HANDSHAKE_NEW_SESSION_TICKET,
+			GNUTLS_HOOK_POST, session_ticket_hook);
+#endif
+	}
 
 	return 0;
 }
@@ -775,9 +1812,9 @@ static int gtls_connect_step3(vtls_session_t *sess)
 	const char *ptr;
 	struct backend_session_data *backend = sess->backend_data;
 	vtls_config_t *config = sess->config;
+	unsigned char cache_key[VERIFYCACHE_KEY_SIZE];
+	int use_cache = 0, cached = 0;
 	int rc;
-//	int incache;
-//	void *ssl_sessionid;
 #ifdef HAS_ALPN
 	gnutls_datum_t proto;
 #endif
@@ -812,6 +1849,14 @@ static int gtls_connect_step3(vtls_session_t *sess)
 		debug_printf(config, "\t common name: WARNING couldn't obtain\n");
 	}
 
+	/* OCSP responses are stapled per handshake and only checked by verify_peers2() */
+	if (backend->cred->verifycache && chainp && sess->hostname && !sess->config->verifystatus) {
+		if (verifycache_key(chainp, cert_list_size, sess->hostname, cache_key) == 0) {
+			use_cache = 1;
+			cached = verifycache_lookup(backend->cred->verifycache, cache_key);
+		}
+	}
+
 	if (sess->config->verifypeer) {
 		/* This function will try to verify the peer's certificate and return its
 			status (trusted, invalid etc.). The value of status should be one or
@@ -820,10 +1865,33 @@ static int gtls_connect_step3(vtls_session_t *sess)
 			regarding the certificate key size and chain size are set. To override
 			them use gnutls_certificate_set_verify_limits(). */
 
-		rc = gnutls_certificate_verify_peers2(backend->session, &verify_status);
-		if (rc < 0) {
-			error_printf(config, "server cert verify failed: %d", rc);
-			return CURLE_SSL_CONNECT_ERROR;
+		if (cached) {
+			/* same chain, hostname and trust store as before: skip the expensive part */
+			debug_printf(config, "\t server certificate chain found in verify cache\n");
+			verify_status = 0;
+		} else {
+			if (backend->cred->capath) {
+				/* load the CA certs the chain needs, blocks others from adding certs while we verify */
+				capath_lock_chain(backend->cred->capath, chainp, cert_list_size);
+				rc = gnutls_certificate_verify_peers2(backend->session, &verify_status);
+				capath_unlock(backend->cred->capath);
+			} else
+				rc = gnutls_certificate_verify_peers2(backend->session, &verify_status);
+			if (rc < 0) {
+				error_printf(config, "server cert verify failed: %d", rc);
+				return CURLE_SSL_CONNECT_ERROR;
+			}
+		}
+
+		/* CRLs may be refreshed at any time, so this is done for cached chains as well */
+
+		if (backend->cred->crl && chainp) {
+			int revoked = crl_check_chain(backend->cred->crl, chainp, cert_list_size);
+
+			if (revoked >= 0) {
+				debug_printf(config, "\t certificate #%d of the server's chain is REVOKED\n", revoked);
+				verify_status |= GNUTLS_CERT_REVOKED | GNUTLS_CERT_INVALID;
+			}
 		}
 
 		/* verify_status is a bitmask of gnutls_certificate_status bits */
@@ -863,6 +1931,10 @@ static int gtls_connect_step3(vtls_session_t *sess)
 			gnutls_x509_crt_t format */
 		gnutls_x509_crt_import(x509_cert, chainp, GNUTLS_X509_FMT_DER);
 
+	/* issuer, hostname and validity period have been checked when the chain was cached */
+	if (cached)
+		goto verified;
+
 	if (sess->config->issuercert) {
 		gnutls_x509_crt_init(&x509_issuer);
 		issuerp = load_file(sess->config->issuercert);
@@ -991,6 +2063,11 @@ static int gtls_connect_step3(vtls_session_t *sess)
 		} else
 			debug_printf(config, "\t server certificate activation date OK\n");
 	}
+
+	if (use_cache)
+		verifycache_store(backend->cred->verifycache, cache_key, chainp, cert_list_size);
+
+verified:
 /*
 	ptr = data->set.str[STRING_SSL_PINNEDPUBLICKEY];
 	if (ptr) {
@@ -1078,40 +2155,15 @@ static int gtls_connect_step3(vtls_session_t *sess)
 //	conn->recv[sockindex] = gtls_recv;
 //	conn->send[sockindex] = gtls_send;
 
-#ifdef unsused_code
-	{
-		/* we always unconditionally get the session id here, as even if we
-			already got it from the cache and asked to use it in the connection, it
-			might've been rejected and then a new one is in use now and we need to
-			detect that. */
-		void *connect_sessionid;
-		size_t connect_idsize = 0;
-
-		/* get the session ID data size */
-		gnutls_session_get_data(session, NULL, &connect_idsize);
-		connect_sessionid = malloc(connect_idsize); /* get a buffer for it */
-
-		if (connect_sessionid) {
-			/* extract session ID to the allocated buffer */
-			gnutls_session_get_data(session, connect_sessionid, &connect_idsize);
-
-			incache = !(Curl_ssl_getsessionid(conn, &ssl_sessionid, NULL));
-			if (incache) {
-				/* there was one before in the cache, so instead of risking that the
-					previous one was rejected, we just kill that and store the new */
-				Curl_ssl_delsessionid(conn, ssl_sessionid);
-			}
-
-			/* store this session id */
-			result = Curl_ssl_addsessionid(conn, connect_sessionid, connect_idsize);
-			if (result) {
-				free(connect_sessionid);
-				result = CURLE_OUT_OF_MEMORY;
-			}
-		} else
-			result = CURLE_OUT_OF_MEMORY;
-	}
+	if (backend->cache_key) {
+		/* we always get the session here, as even if we resumed one from the
+			cache, it might've been rejected and then a new one is in use now.
+			TLS 1.3 tickets are stored by session_ticket_hook() as they arrive. */
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+		if (gnutls_protocol_get_version(backend->session) != GNUTLS_TLS1_3)
 #endif
+			session_cache_store(sess);
+	}
 
 	return result;
 }
@@ -1139,15 +2191,25 @@ static int gtls_connect_common(vtls_session_t *sess, int nonblocking, int *done)
 	}
 
 	rc = handshake(sess, nonblocking);
-	if (rc)
-		/* handshake() sets its own error message with failf() */
-		return rc;
 
 	/* Finish connecting once the handshake is done */
-	if (ssl_connect_1 == sess->connecting_state) {
+	if (!rc && ssl_connect_1 == sess->connecting_state) {
 		rc = gtls_connect_step3(sess);
-		if (rc)
-			return rc;
+#ifdef HAVE_LINUX_TLS_H
+		/* not with an io_uring, which owns the socket's data */
+		if (!rc && sess->config->ktls && !sess->uring_data)
+			ktls_enable(sess);
+#endif
+	}
+
+	if (rc) {
+		/* handshake() sets its own error message with failf() */
+		struct backend_session_data *backend = sess->backend_data;
+
+		/* don't offer a session again that may have caused the failure */
+		if (backend->cache_key)
+			session_cache_remove(sess);
+		return rc;
 	}
 
 	*done = ssl_connect_1 == sess->connecting_state;
@@ -1160,11 +2222,110 @@ int backend_connect(vtls_session_t *sess)
 	int result;
 	int done = 0;
 
-	result = gtls_connect_common(sess, 1, &done);
+	result = gtls_connect_common(sess, 0, &done);
 	if (result)
 		return result;
 
-//	DEBUGASSERT(done);
+	return done ? 0 : CURLE_SSL_CONNECT_ERROR;
+}
+
+int backend_connect_nonblocking(vtls_session_t *sess, int *done)
+{
+	return gtls_connect_common(sess, 1, done);
+}
+
+/*
+ * Renegotiation requested by the peer (TLS 1.2 and older), run from
+ * backend_read() and backend_write(). On a non-blocking socket or with a
+ * reactor it never waits: it returns CURLE_AGAIN and vtls_want() says what
+ * for, until the next read or write finishes it.
+ *
+ * Returns 0 once the session is established again.
+ */
+static int renegotiate(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	int rc;
+
+	if (!backend->renegotiating) {
+		trace_printf(VTLS_TRACE_SESSION, "peer requested renegotiation\n");
+		backend->renegotiating = 1;
+		sess->state = ssl_connection_negotiating;
+		sess->connecting_state = ssl_connect_2;
+		if (!sess->reactor_data)
+			sess->connect_start = curlx_tvnow(); /* the connect timeout applies */
+	}
+
+	/* handshake() writes error message on its own */
+	if ((rc = handshake(sess, backend->sock_nonblocking || sess->reactor_data)))
+		return rc;
+
+	if (sess->connecting_state != ssl_connect_1)
+		return CURLE_AGAIN;
+
+	backend->renegotiating = 0;
+	sess->state = ssl_connection_complete;
+	return 0;
+}
+
+/*
+ * Run before each read or write. A renegotiation goes on, but the initial
+ * handshake is only finished by vtls_connect_nonblocking(), which verifies
+ * the peer, so there is nothing to read or write until then.
+ */
+static int io_allowed(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+
+	if (backend->renegotiating)
+		return renegotiate(sess);
+
+	if (sess->state == ssl_connection_negotiating)
+		return backend->session ? CURLE_AGAIN : CURLE_SSL_CONNECT_ERROR;
+
+	return 0;
+}
+
+/*
+ * O_NONBLOCK is sampled when the handshake starts. A reactor sets it later on
+ * sessions connected before vtls_reactor_add(), and never lets us wait.
+ */
+static int is_nonblocking(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+
+	return backend->sock_nonblocking || sess->reactor_data;
+}
+
+/* wait_socket()
+ *
+ * Wait until the socket is readable resp. writable, within timeout_ms of
+ * the first wait of the current vtls_read()/vtls_write() call. The clock is
+ * only read here, so a call that doesn't have to wait never reads it.
+ *
+ * Returns 0 when ready, CURLE_AGAIN if timeout_ms is 0 and the socket isn't
+ * ready, CURLE_OPERATION_TIMEDOUT or CURLE_SSL_CONNECT_ERROR.
+ */
+static int wait_socket(vtls_session_t *sess, int writing, int timeout_ms, struct timeval *start)
+{
+	int left = timeout_ms, what;
+
+	/* a reactor reports when the socket is ready */
+	if (sess->reactor_data)
+		return CURLE_AGAIN;
+
+	if (!start->tv_sec && !start->tv_usec)
+		*start = curlx_tvnow();
+	else if (timeout_ms && (left = vtls_timeleft_ms(start, timeout_ms)) <= 0)
+		return CURLE_OPERATION_TIMEDOUT;
+
+	what = Curl_socket_ready(writing ? -1 : sess->sockfd, writing ? sess->sockfd : -1, left);
+	if (what < 0) {
+		/* fatal error */
+		error_printf(sess->config, "select/poll on SSL socket, errno: %d\n", SOCKERRNO);
+		return CURLE_SSL_CONNECT_ERROR;
+	} else if (0 == what)
+		return timeout_ms ? CURLE_OPERATION_TIMEDOUT : CURLE_AGAIN;
 
 	return 0;
 }
@@ -1174,45 +2335,261 @@ ssize_t backend_write(vtls_session_t *sess,
 	size_t count,
 	int *curlcode)
 {
-	struct backend_session_data *backend = sess->backend_data;
+	struct timeval start = {0, 0};
+	int timeout = sess->config->write_timeout;
+	/* with a non-blocking socket, just try and only poll() after GNUTLS_E_AGAIN */
+	int ready = is_nonblocking(sess) || !timeout;
 	ssize_t rc;
 
-	int what = Curl_socket_ready(-1, sess->sockfd, sess->config->write_timeout);
-	if (what < 0) {
-		/* fatal error */
-		debug_printf(sess->config, "select/poll on SSL socket, errno: %d\n", SOCKERRNO);
-		return CURLE_SSL_CONNECT_ERROR;
-	} else if (0 == what) {
-		if (sess->config->write_timeout) {
-			/* timeout */
-			debug_printf(sess->config, "SSL connection write timeout at %d\n", sess->config->write_timeout);
-			return CURLE_OPERATION_TIMEDOUT;
+	if ((*curlcode = io_allowed(sess)))
+		return -1;
+
+	for (;;) {
+		if (!ready && (*curlcode = wait_socket(sess, 1, timeout, &start))) {
+			if (*curlcode == CURLE_OPERATION_TIMEDOUT)
+				debug_printf(sess->config, "SSL connection write timeout at %d\n", timeout);
+			return -1;
 		}
-	}
 
-	rc = gnutls_record_send(backend->session, buf, count);
+		rc = record_send(sess, buf, count);
+		if (rc != GNUTLS_E_AGAIN && rc != GNUTLS_E_INTERRUPTED)
+			break;
+		ready = 0;
+	}
 
 	if (rc < 0) {
-		*curlcode = (rc == GNUTLS_E_AGAIN) ? CURLE_AGAIN : CURLE_SEND_ERROR;
+		*curlcode = CURLE_SEND_ERROR;
 		rc = -1;
 	}
 
 	return rc;
 }
 
+/*
+ * Hold back records until backend_flush(), so a batch of small writes goes
+ * out in one push. GnuTLS still makes one record per write.
+ */
+int backend_cork(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+
+	if (!backend->session)
+		return CURLE_SEND_ERROR;
+
+	if (backend->corked)
+		return 0;
+
+#ifdef HAVE_LINUX_TLS_H
+	if (backend->ktls_tx) {
+		int on = 1;
+
+		if (setsockopt(sess->sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)))
+			return CURLE_SEND_ERROR;
+	} else
+#endif
+	gnutls_record_cork(backend->session);
+
+	backend->corked = 1;
+	return 0;
+}
+
+/* like backend_write() for the corked records, 0 once all are out */
+int backend_flush(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	struct timeval start = {0, 0};
+	int timeout = sess->config->write_timeout;
+	int nonblocking = is_nonblocking(sess);
+	int ready = nonblocking || !timeout;
+	int rc, curlcode;
+
+	if (!backend->session)
+		return backend->corked ? CURLE_SEND_ERROR : 0;
+
+	for (;;) {
+		if (!ready && (curlcode = wait_socket(sess, 1, timeout, &start))) {
+			if (curlcode == CURLE_OPERATION_TIMEDOUT)
+				debug_printf(sess->config, "SSL connection flush timeout at %d\n", timeout);
+			return curlcode;
+		}
+
+		rc = uncork(sess);
+		if (rc != GNUTLS_E_AGAIN && rc != GNUTLS_E_INTERRUPTED)
+			break;
+		/* the rest stays corked, the caller polls and flushes again */
+		if (nonblocking && rc == GNUTLS_E_AGAIN)
+			return CURLE_AGAIN;
+		ready = 0;
+	}
+
+	if (rc < 0) {
+		debug_printf(sess->config, "SSL flush failed: %s\n", gnutls_strerror(rc));
+		return CURLE_SEND_ERROR;
+	}
+
+	return 0;
+}
+
+/* bytes of a file mapped at once by backend_sendfile() */
+#define SENDFILE_WINDOW (4 * 1024 * 1024)
+
+#ifdef __linux__
+#ifndef F_GET_SEALS
+#define F_GET_SEALS 1034
+#endif
+#ifndef F_SEAL_SHRINK
+#define F_SEAL_SHRINK 0x0002
+#endif
+#endif
+
+/*
+ * Pages of a mapping past the end of a file that shrank raise SIGBUS, and no
+ * size check before the access rules that out. So only map files nobody can
+ * truncate: sealed against shrinking (memfd) or on a read-only file system.
+ */
+static int cant_shrink(int fd)
+{
+	struct statvfs vfs;
+#ifdef __linux__
+	int seals = fcntl(fd, F_GET_SEALS);
+
+	if (seals > 0 && (seals & F_SEAL_SHRINK))
+		return 1;
+#endif
+
+	return fstatvfs(fd, &vfs) == 0 && (vfs.f_flag & ST_RDONLY);
+}
+
+/*
+ * With kTLS, sendfile() has the kernel encrypt regular files straight from
+ * the page cache. Else files that can't shrink are mmap()ed window by window
+ * and GnuTLS encrypts each record right out of the mapping, saving the copy
+ * into a read buffer. Anything else goes through pread(), or read() for pipes
+ * and sockets.
+ *
+ * A non-blocking socket returns what went out so far; retrying with the
+ * advanced offset presents GnuTLS the same data it is still holding.
+ */
+ssize_t backend_sendfile(vtls_session_t *sess,
+	int fd,
+	off_t offset,
+	size_t count,
+	int *curlcode)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	struct stat st;
+	size_t sent = 0, done;
+	ssize_t rc = 0, n;
+	int regular = 0, seekable = 1;
+
+	if ((*curlcode = io_allowed(sess)))
+		return -1;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		/* like sendfile(), stop at the current size */
+		if (offset >= st.st_size)
+			return 0;
+		if ((uintmax_t) count > (uintmax_t) (st.st_size - offset))
+			count = (size_t) (st.st_size - offset);
+		regular = 1;
+	}
+
+#if defined(HAVE_LINUX_TLS_H) && defined(HAVE_SYS_SENDFILE_H)
+	if (backend->ktls_tx && regular) {
+		struct timeval start = {0, 0};
+
+		while (sent < count) {
+			if ((rc = ktls_sendfile(sess, fd, offset + sent, count - sent)) > 0)
+				sent += rc;
+			else if (rc == 0)
+				break; /* file got truncated */
+			else if (rc == GNUTLS_E_INTERRUPTED)
+				continue;
+			else if (rc != GNUTLS_E_AGAIN) {
+				*curlcode = CURLE_SEND_ERROR;
+				break;
+			} else if (sent && is_nonblocking(sess))
+				break;
+			else if ((*curlcode = wait_socket(sess, 1, sess->config->write_timeout, &start))) {
+				rc = -1;
+				break;
+			}
+		}
+		return sent ? (ssize_t) sent : rc < 0 ? -1 : 0;
+	}
+#endif
+
+	if (regular && cant_shrink(fd)) {
+		long pagesize = sysconf(_SC_PAGESIZE);
+
+		while (sent < count) {
+			off_t pos = offset + (off_t) sent, base = pos - pos % pagesize;
+			size_t len = count - sent < SENDFILE_WINDOW ? count - sent : SENDFILE_WINDOW;
+			size_t maplen = len + (size_t) (pos - base);
+			char *map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, base);
+
+			if (map == MAP_FAILED)
+				break; /* try pread() */
+
+			madvise(map, maplen, MADV_SEQUENTIAL);
+			for (done = 0; done < len && (rc = backend_write(sess, map + (pos - base) + done, len - done, curlcode)) > 0; done += rc)
+				;
+			munmap(map, maplen);
+
+			sent += done;
+			if (rc < 0)
+				return sent ? (ssize_t) sent : -1;
+		}
+	}
+
+	while (sent < count) {
+		char buf[16384]; /* a full record */
+
+		size_t len = count - sent < sizeof(buf) ? count - sent : sizeof(buf);
+
+		if ((n = seekable ? pread(fd, buf, len, offset + (off_t) sent) : read(fd, buf, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ESPIPE && seekable) {
+				seekable = 0;
+				continue;
+			}
+			error_printf(sess->config, "sendfile: failed to read fd %d (%d)\n", fd, errno);
+			*curlcode = CURLE_READ_ERROR;
+			return sent ? (ssize_t) sent : -1;
+		}
+		if (n == 0)
+			break;
+
+		for (done = 0; done < (size_t) n && (rc = backend_write(sess, buf + done, n - done, curlcode)) > 0; done += rc)
+			;
+
+		sent += done;
+		if (rc < 0)
+			return sent ? (ssize_t) sent : -1;
+	}
+
+	return sent;
+}
+
 static void close_one(vtls_session_t *sess)
 {
 	struct backend_session_data *backend = sess->backend_data;
 
 	if (backend->session) {
-		gnutls_bye(backend->session, GNUTLS_SHUT_RDWR);
+		/* don't wait for the peer's close_notify, that may take long and
+			the connection is going away anyway */
+		if (!backend->bye_sent && !uncork(sess))
+			record_bye(sess);
 		gnutls_deinit(backend->session);
 		backend->session = NULL;
 	}
+	reset_record_state(backend);
 	if (backend->cred) {
-		gnutls_certificate_free_credentials(backend->cred);
+		cred_put(backend->cred);
 		backend->cred = NULL;
 	}
+	xfree(backend->cache_key);
 #ifdef USE_TLS_SRP
 	if (backend->srp_client_cred) {
 		gnutls_srp_free_client_credentials(backend->srp_client_cred);
@@ -1237,8 +2614,9 @@ int backend_shutdown(vtls_session_t *sess)
 	ssize_t result;
 	int retval = 0;
 //	struct SessionHandle *data = conn->data;
-	int done = 0;
+	int done = 0, left;
 	char buf[120];
+	struct timeval start = curlx_tvnow();
 
 	/* This has only been tested on the proftpd server, and the mod_tls code
 		sends a close notify alert without waiting for a close notify alert in
@@ -1248,13 +2626,21 @@ int backend_shutdown(vtls_session_t *sess)
 //	if (data->set.ftp_ccc == CURLFTPSSL_CCC_ACTIVE)
 //		gnutls_bye(sess->ssl_session, GNUTLS_SHUT_WR);
 
+	/* the TLS ULP can't be removed, the socket would never carry cleartext */
+	if (backend->ktls_tx || backend->ktls_rx) {
+		error_printf(sess->config, "SSL shutdown: kTLS is on, the connection can only be closed\n");
+		return -1;
+	}
+
 	if (backend->session) {
 		while (!done) {
-			int what = Curl_socket_ready(sess->sockfd, -1, SSL_SHUTDOWN_TIMEOUT);
+			/* SSL_SHUTDOWN_TIMEOUT is for the whole shutdown, not per wait */
+			int what = (left = vtls_timeleft_ms(&start, SSL_SHUTDOWN_TIMEOUT)) <= 0 ? 0 :
+				backend_pending(sess) > 0 ? 1 : Curl_socket_ready(sess->sockfd, -1, left);
 			if (what > 0) {
 				/* Something to read, let's do it and hope that it is the close
 					notify alert from the server */
-				result = gnutls_record_recv(backend->session, buf, sizeof(buf));
+				result = record_recv(sess, buf, sizeof(buf));
 				switch (result) {
 				case 0:
 					/* This is the expected response. There was no data but only
@@ -1285,9 +2671,12 @@ int backend_shutdown(vtls_session_t *sess)
 		gnutls_deinit(backend->session);
 		backend->session = NULL;
 	}
+	reset_record_state(backend);
 
-	gnutls_certificate_free_credentials(backend->cred);
-	backend->cred = NULL;
+	if (backend->cred) {
+		cred_put(backend->cred);
+		backend->cred = NULL;
+	}
 
 #ifdef USE_TLS_SRP
 	if (sess->config->authtype == CURL_TLSAUTH_SRP && sess->config->username) {
@@ -1299,6 +2688,59 @@ int backend_shutdown(vtls_session_t *sess)
 	return retval;
 }
 
+/*
+ * Send close_notify and, with VTLS_SHUTDOWN_FULL, read until the peer's
+ * arrives, dropping application data still in flight. Never waits: if the
+ * socket isn't ready, sess->connecting_state says for what and it returns 0.
+ * Once *done is set, the session is closed as by backend_close().
+ */
+int backend_shutdown_nonblocking(vtls_session_t *sess, int how, int *done)
+{
+	struct backend_session_data *backend = sess->backend_data;
+	char buf[256];
+	ssize_t rc = 0;
+
+	*done = 0;
+
+	if (backend->session && !backend->bye_sent) {
+		/* corked records go first, gnutls_bye() would drop them */
+		if ((rc = uncork(sess)) == 0)
+			rc = record_bye(sess);
+		if (rc == GNUTLS_E_AGAIN || rc == GNUTLS_E_INTERRUPTED) {
+			sess->connecting_state = backend->ktls_tx || gnutls_record_get_direction(backend->session) ?
+				ssl_connect_2_writing : ssl_connect_2_reading;
+			return 0;
+		}
+
+		backend->bye_sent = 1;
+		trace_printf(VTLS_TRACE_SESSION, "sent close_notify\n");
+	}
+
+	while (rc == 0 && backend->session && how == VTLS_SHUTDOWN_FULL) {
+		if ((rc = record_recv(sess, buf, sizeof(buf))) == 0) {
+			trace_printf(VTLS_TRACE_SESSION, "received close_notify\n");
+			break;
+		}
+
+		if (rc == GNUTLS_E_AGAIN || rc == GNUTLS_E_INTERRUPTED) {
+			sess->connecting_state = ssl_connect_2_reading;
+			return 0;
+		}
+
+		if (rc > 0)
+			rc = 0;
+	}
+
+	if (rc < 0)
+		debug_printf(sess->config, "SSL shutdown failed: %s\n", gnutls_strerror((int) rc));
+
+	close_one(sess);
+	sess->connecting_state = ssl_connect_1;
+	*done = 1;
+
+	return rc < 0 ? CURLE_SSL_SHUTDOWN_FAILED : 0;
+}
+
 ssize_t backend_read(vtls_session_t *sess,
 	char *buf, /* store read data here */
 	size_t count, /* max amount to read */
@@ -1306,39 +2748,45 @@ ssize_t backend_read(vtls_session_t *sess,
 {
 	struct backend_session_data *backend = sess->backend_data;
 	vtls_config_t *config = sess->config;
+	struct timeval start = {0, 0};
+	int timeout = config->read_timeout;
+	/* with a non-blocking socket or data already buffered by GnuTLS or read
+		ahead, just try and only poll() after GNUTLS_E_AGAIN */
+	int ready = is_nonblocking(sess) || !timeout || backend_pending(sess) > 0;
+	int writing = 0;
 	ssize_t ret;
 
-	int what = Curl_socket_ready(sess->sockfd, -1, sess->config->read_timeout);
-	if (what < 0) {
-		/* fatal error */
-		error_printf(config, "select/poll on SSL socket, errno: %d", SOCKERRNO);
-		return CURLE_SSL_CONNECT_ERROR;
-	} else if (0 == what) {
-		if (sess->config->read_timeout) {
-			/* timeout */
-			error_printf(config, "SSL connection timeout at %d", sess->config->read_timeout);
-			return CURLE_OPERATION_TIMEDOUT;
+	/* finish a renegotiation the peer asked for before reading on */
+	if ((*curlcode = io_allowed(sess)))
+		return -1;
+
+	for (;;) {
+		if (!ready && (*curlcode = wait_socket(sess, writing, timeout, &start))) {
+			if (*curlcode == CURLE_OPERATION_TIMEDOUT)
+				error_printf(config, "SSL connection timeout at %d\n", timeout);
+			return -1;
 		}
-	}
 
-	ret = gnutls_record_recv(backend->session, buf, count);
-	if ((ret == GNUTLS_E_AGAIN) || (ret == GNUTLS_E_INTERRUPTED)) {
-		*curlcode = CURLE_AGAIN;
-		return -1;
-	}
+		ret = record_recv(sess, buf, count);
 
-	if (ret == GNUTLS_E_REHANDSHAKE) {
-		/* BLOCKING call, this is bad but a work-around for now. Fixing this "the
-			proper way" takes a whole lot of work. */
-		int result = handshake(sess, 0);
-		if (result)
-			/* handshake() writes error message on its own */
-			*curlcode = result;
-		else
-			*curlcode = CURLE_AGAIN; /* then return as if this was a wouldblock */
-		return -1;
+		if (ret == GNUTLS_E_REHANDSHAKE) {
+			if ((*curlcode = renegotiate(sess)))
+				return -1;
+			ready = 1; /* established again, read on */
+			continue;
+		}
+
+		if (ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED)
+			break;
+
+		/* e.g. the answer to a TLS 1.3 KeyUpdate may have to be sent first */
+		writing = !backend->ktls_rx && gnutls_record_get_direction(backend->session);
+		sess->connecting_state = writing ? ssl_connect_2_writing : ssl_connect_2_reading;
+		ready = 0;
 	}
 
+	sess->connecting_state = ssl_connect_1;
+
 	if (ret < 0) {
 		error_printf(config, "GnuTLS recv error (%d): %s\n", (int) ret, gnutls_strerror((int) ret));
 		*curlcode = CURLE_RECV_ERROR;
@@ -1385,6 +2833,33 @@ int backend_md5sum(unsigned char *tmp, /* input */
 	return -1;
 }
 
+void backend_session_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+	sesscache_stats(hits, misses);
+}
+
+int backend_session_resumed(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+
+	return backend->session && gnutls_session_is_resumed(backend->session);
+}
+
+size_t backend_pending(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+
+	return (backend->session ? gnutls_record_check_pending(backend->session) : 0) + backend->ra_len;
+}
+
+/* the kernel does the record I/O on the socket, see ktls_enable() */
+int backend_ktls_active(vtls_session_t *sess)
+{
+	struct backend_session_data *backend = sess->backend_data;
+
+	return backend->ktls_tx || backend->ktls_rx;
+}
+
 int backend_cert_status_request(void)
 {
 #ifdef HAS_OCSP
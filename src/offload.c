@@ -0,0 +1,134 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <vtls.h>
+
+#include "common.h"
+#include "offload.h"
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	offload_job_t *head, *tail;
+	pthread_t *tids;
+	int nthreads;
+	int stop;
+} _pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+
+static void *offload_thread(void *p)
+{
+	offload_job_t *job;
+
+	pthread_mutex_lock(&_pool.mutex);
+	for (;;) {
+		while (!_pool.head && !_pool.stop)
+			pthread_cond_wait(&_pool.cond, &_pool.mutex);
+
+		/* finish queued jobs before stopping, their owners wait for them */
+		if (!(job = _pool.head))
+			break;
+
+		if (!(_pool.head = job->next))
+			_pool.tail = NULL;
+
+		pthread_mutex_unlock(&_pool.mutex);
+		job->run(job);
+		pthread_mutex_lock(&_pool.mutex);
+	}
+	pthread_mutex_unlock(&_pool.mutex);
+
+	return p;
+}
+
+/* start the pool, called from vtls_init() */
+int offload_init(int nthreads)
+{
+	if (nthreads <= 0)
+		return 0;
+
+	if (!(_pool.tids = calloc(nthreads, sizeof(pthread_t))))
+		return CURLE_OUT_OF_MEMORY;
+
+	_pool.stop = 0;
+	for (_pool.nthreads = 0; _pool.nthreads < nthreads; _pool.nthreads++) {
+		if (pthread_create(&_pool.tids[_pool.nthreads], NULL, offload_thread, NULL)) {
+			offload_deinit();
+			return CURLE_FAILED_INIT;
+		}
+	}
+
+	debug_printf(NULL, "started %d handshake threads\n", nthreads);
+	return 0;
+}
+
+void offload_deinit(void)
+{
+	int it;
+
+	pthread_mutex_lock(&_pool.mutex);
+	_pool.stop = 1;
+	pthread_cond_broadcast(&_pool.cond);
+	pthread_mutex_unlock(&_pool.mutex);
+
+	for (it = 0; it < _pool.nthreads; it++)
+		pthread_join(_pool.tids[it], NULL);
+
+	xfree(_pool.tids);
+	_pool.nthreads = 0;
+}
+
+int offload_enabled(void)
+{
+	return _pool.nthreads > 0;
+}
+
+/* queue a job, returns CURLE_NOT_BUILT_IN if there is no pool to run it */
+int offload_submit(offload_job_t *job)
+{
+	if (!_pool.nthreads)
+		return CURLE_NOT_BUILT_IN;
+
+	job->next = NULL;
+
+	pthread_mutex_lock(&_pool.mutex);
+	if (_pool.tail)
+		_pool.tail->next = job;
+	else
+		_pool.head = job;
+	_pool.tail = job;
+	pthread_cond_signal(&_pool.cond);
+	pthread_mutex_unlock(&_pool.mutex);
+
+	return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#ifndef _VTLS_OFFLOAD_H
+#define _VTLS_OFFLOAD_H
+
+/*
+ * Bounded thread pool for CPU heavy handshake steps.
+ *
+ * Jobs are embedded into the caller's structures, so submitting never
+ * allocates. A job runs exactly once; the pool doesn't report completion,
+ * job->run() does that itself (e.g. by waking the submitting reactor).
+ */
+typedef struct offload_job_st offload_job_t;
+
+struct offload_job_st {
+	offload_job_t *next;
+	void (*run)(offload_job_t *job);
+};
+
+int offload_init(int nthreads);
+void offload_deinit(void);
+int offload_enabled(void);
+int offload_submit(offload_job_t *job);
+
+#endif /* _VTLS_OFFLOAD_H */
@@ -0,0 +1,800 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include <vtls.h>
+
+#include "common.h"
+#include "backend.h"
+#include "offload.h"
+#include "timerwheel.h"
+#include "timeval.h"
+#include "uring.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/*
+ * Event loop for many sessions on one thread (epoll).
+ *
+ * Sessions are level-triggered, so unread socket data is reported again on
+ * the next run. Plaintext that GnuTLS has already decrypted and buffered, and
+ * data read ahead (VTLS_CFG_READ_AHEAD), are invisible to epoll: sessions
+ * with such data are kept on a pending list, get VTLS_EVENT_READABLE on the
+ * next run and make that run not block.
+ *
+ * With VTLS_CFG_HANDSHAKE_THREADS, handshake steps (key exchange and chain
+ * verification) run on the offload pool instead of the reactor thread. The
+ * socket is not watched meanwhile and the pool thread owns the session; it
+ * puts the entry on the done list and wakes the reactor when finished.
+ *
+ * Deadlines live in a timer wheel: the connect timeout runs from
+ * vtls_reactor_add(), the read timeout from the last readable event and the
+ * write timeout from vtls_reactor_want_write() resp. the last writable
+ * event. The clock is read once per vtls_reactor_run(), not per session.
+ *
+ * vtls_reactor_shutdown() drives vtls_shutdown_nonblocking() the same way as
+ * a handshake, bounded by SSL_SHUTDOWN_TIMEOUT.
+ *
+ * With VTLS_CFG_IO_URING, sessions do their socket I/O through an io_uring
+ * of the reactor instead (see uring.c): completions make them readable resp.
+ * writable and epoll is only left with the wakeup eventfd and kTLS sessions.
+ * The ring waits on the epoll fd then, so one io_uring_enter() per run
+ * submits and waits for everything.
+ */
+
+struct reactor_entry {
+	offload_job_t job; /* handshake step for the offload pool */
+	struct reactor_entry *next_ready; /* list of entries to dispatch in this run */
+	struct reactor_entry *next_pending; /* list of entries with buffered plaintext */
+	struct reactor_entry *next_done; /* list of entries back from the offload pool */
+	vtls_reactor_t *reactor;
+	vtls_session_t *sess;
+	wheel_timer_t timer; /* connect deadline, then read deadline */
+	wheel_timer_t wtimer; /* write deadline while want_write */
+	vtls_reactor_callback_t callback;
+	void *ctx;
+	int fd;
+	int events; /* VTLS_EVENT_* collected for the dispatch */
+	uint32_t interest; /* EPOLL* flags currently registered */
+	int step_rc; /* result of the offloaded handshake step */
+	int step_done;
+	char connected;
+	char want_write;
+	char ready; /* on the ready list */
+	char pending; /* on the pending list */
+	char removed; /* freed at the end of the current run */
+	char offloaded; /* a handshake step is queued or running on the offload pool */
+	char finished; /* the offloaded step is on the done list */
+	char timed_out; /* the connect deadline passed while offloaded */
+	char closing; /* vtls_reactor_shutdown() in progress */
+	char draining; /* the TLS layer is shut down, the ring still sends its alert */
+	char close_how; /* VTLS_SHUTDOWN_* */
+	char uring; /* socket I/O goes through the reactor's io_uring */
+	char stopped; /* stop_watching() was called, io_uring events are dropped */
+};
+
+struct vtls_reactor_st {
+	pthread_mutex_t mutex; /* protects done and the finished flags */
+	pthread_cond_t cond; /* signalled when a step finishes */
+	struct reactor_entry *done;
+	struct reactor_entry *pending;
+	struct reactor_entry *garbage;
+	timerwheel_t wheel;
+	uint64_t now; /* ms, read once per run */
+	uring_t *ring; /* with VTLS_CFG_IO_URING, else NULL */
+	int epfd;
+	int wakefd; /* eventfd for vtls_reactor_wakeup(), registered with a NULL pointer */
+	int running;
+	int noffloaded;
+};
+
+static uint64_t now_ms(void)
+{
+	struct timeval tv = curlx_tvnow();
+
+	return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int vtls_reactor_init(vtls_reactor_t **reactor)
+{
+	if (!(*reactor = calloc(1, sizeof(**reactor))))
+		return CURLE_OUT_OF_MEMORY;
+
+	if (((*reactor)->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		xfree(*reactor);
+		return CURLE_FAILED_INIT;
+	}
+
+	if (((*reactor)->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1
+		|| epoll_ctl((*reactor)->epfd, EPOLL_CTL_ADD, (*reactor)->wakefd, &(struct epoll_event) { .events = EPOLLIN }))
+	{
+		if ((*reactor)->wakefd != -1)
+			close((*reactor)->wakefd);
+		close((*reactor)->epfd);
+		xfree(*reactor);
+		return CURLE_FAILED_INIT;
+	}
+
+	pthread_mutex_init(&(*reactor)->mutex, NULL);
+	pthread_cond_init(&(*reactor)->cond, NULL);
+	timerwheel_init(&(*reactor)->wheel, now_ms());
+
+	/* epoll alone if io_uring isn't configured or the kernel lacks it */
+	if (uring_init(&(*reactor)->ring, (*reactor)->epfd) == CURLE_FAILED_INIT)
+		debug_printf(NULL, "io_uring not available, the reactor uses epoll\n");
+
+	return 0;
+}
+
+void vtls_reactor_deinit(vtls_reactor_t *reactor)
+{
+	struct reactor_entry *e, *next;
+
+	if (reactor) {
+		/* sessions removed while their step was offloaded */
+		for (e = reactor->done; e; e = next) {
+			next = e->next_done;
+			xfree(e);
+		}
+
+		uring_deinit(reactor->ring);
+		pthread_cond_destroy(&reactor->cond);
+		pthread_mutex_destroy(&reactor->mutex);
+		close(reactor->wakefd);
+		close(reactor->epfd);
+		xfree(reactor);
+	}
+}
+
+/**
+ * vtls_reactor_wakeup:
+ * @reactor: reactor
+ *
+ * Make a vtls_reactor_run() that is waiting, or the next one, return early.
+ * This is the only reactor function that may be called from any thread.
+ */
+void vtls_reactor_wakeup(vtls_reactor_t *reactor)
+{
+	uint64_t one = 1;
+
+	if (write(reactor->wakefd, &one, sizeof(one)) < 0) {
+		/* the counter is saturated, so a wakeup is pending anyway */
+	}
+}
+
+/* (re-)arm a deadline timeout_ms from now, 0 = none */
+static void arm_timer(vtls_reactor_t *reactor, wheel_timer_t *timer, int timeout_ms)
+{
+	if (timeout_ms <= 0) {
+		timerwheel_del(&reactor->wheel, timer);
+		return;
+	}
+
+	/* outside of vtls_reactor_run() the cached time may be old */
+	if (!reactor->running)
+		reactor->now = now_ms();
+
+	timerwheel_add(&reactor->wheel, timer, reactor->now + timeout_ms, reactor->now);
+}
+
+/* report events from the next run */
+static void defer_events(vtls_reactor_t *reactor, struct reactor_entry *e, int events)
+{
+	e->events |= events;
+	if (!e->pending) {
+		e->pending = 1;
+		e->next_pending = reactor->pending;
+		reactor->pending = e;
+	}
+}
+
+/* register what the entry waits for with epoll */
+static int update_interest(vtls_reactor_t *reactor, struct reactor_entry *e)
+{
+	struct epoll_event ev;
+
+	if (e->offloaded)
+		return 0; /* the pool thread owns the session */
+
+	if (e->uring) {
+		/* the receive stays armed, writable means room in the send queue */
+		int want = vtls_want(e->sess) == VTLS_WANT_WRITE || (e->connected && !e->closing && e->want_write);
+
+		if (want && !e->stopped && uring_writable(e->sess->uring_data))
+			defer_events(reactor, e, VTLS_EVENT_WRITABLE);
+		return 0;
+	}
+
+	if (e->connected && !e->closing)
+		ev.events = EPOLLIN | EPOLLRDHUP | (e->want_write || vtls_want(e->sess) == VTLS_WANT_WRITE ? EPOLLOUT : 0);
+	else
+		ev.events = vtls_want(e->sess) == VTLS_WANT_WRITE ? EPOLLOUT : EPOLLIN;
+
+	if (ev.events == e->interest)
+		return 0;
+
+	ev.data.ptr = e;
+	if (epoll_ctl(reactor->epfd, e->interest ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, e->fd, &ev))
+		return CURLE_SSL_CONNECT_ERROR;
+
+	e->interest = ev.events;
+	return 0;
+}
+
+static void stop_watching(vtls_reactor_t *reactor, struct reactor_entry *e)
+{
+	timerwheel_del(&reactor->wheel, &e->timer);
+	timerwheel_del(&reactor->wheel, &e->wtimer);
+	if (e->interest) {
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+		e->interest = 0;
+	}
+	e->stopped = 1;
+}
+
+/* data the session can read without waiting for the socket */
+static size_t buffered(struct reactor_entry *e)
+{
+	return backend_pending(e->sess) + (e->sess->uring_data ? uring_buffered(e->sess->uring_data) : 0);
+}
+
+static void mark_ready(struct reactor_entry **ready, struct reactor_entry *e, int events)
+{
+	e->events |= events;
+	if (!e->ready) {
+		e->ready = 1;
+		e->next_ready = *ready;
+		*ready = e;
+	}
+}
+
+/* report the outcome of a handshake step once it is known */
+static void finish_handshake(vtls_reactor_t *reactor, struct reactor_entry *e, int rc, int done)
+{
+	if (rc == 0) {
+		if (done) {
+			e->connected = 1;
+			arm_timer(reactor, &e->timer, e->sess->config->read_timeout);
+		}
+		if ((rc = update_interest(reactor, e)) == 0) {
+			/* the handshake read ahead, or ring completions during an offloaded step were dropped */
+			if (!e->pending && buffered(e) > 0)
+				defer_events(reactor, e, 0);
+			if (done)
+				e->callback(e->sess, VTLS_EVENT_CONNECTED, e->ctx);
+			return;
+		}
+	}
+
+	/* stop watching, the application is expected to remove the session */
+	stop_watching(reactor, e);
+	e->callback(e->sess, VTLS_EVENT_ERROR, e->ctx);
+}
+
+/* runs on an offload pool thread */
+static void handshake_job(offload_job_t *job)
+{
+	struct reactor_entry *e = (struct reactor_entry *) ((char *) job - offsetof(struct reactor_entry, job));
+	vtls_reactor_t *reactor = e->reactor;
+
+	e->step_rc = vtls_connect_nonblocking(e->sess, e->fd, e->sess->hostname, &e->step_done);
+
+	/* the reactor may be gone right after unlocking */
+	pthread_mutex_lock(&reactor->mutex);
+	e->finished = 1;
+	e->next_done = reactor->done;
+	reactor->done = e;
+	pthread_cond_broadcast(&reactor->cond);
+	vtls_reactor_wakeup(reactor);
+	pthread_mutex_unlock(&reactor->mutex);
+}
+
+/* continue the handshake, on the offload pool if there is one */
+static void advance_handshake(vtls_reactor_t *reactor, struct reactor_entry *e)
+{
+	int done, rc;
+
+	if (offload_enabled()) {
+		if (e->interest) {
+			epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+			e->interest = 0;
+		}
+
+		e->offloaded = 1;
+		e->job.run = handshake_job;
+		if (offload_submit(&e->job) == 0) {
+			reactor->noffloaded++;
+			return;
+		}
+		e->offloaded = 0;
+	}
+
+	rc = vtls_connect_nonblocking(e->sess, e->fd, e->sess->hostname, &done);
+	finish_handshake(reactor, e, rc, done);
+}
+
+/* pick up handshake steps that the offload pool finished */
+static int collect_offloaded(vtls_reactor_t *reactor)
+{
+	struct reactor_entry *done, *e, *next;
+	int n = 0;
+
+	pthread_mutex_lock(&reactor->mutex);
+	done = reactor->done;
+	reactor->done = NULL;
+	pthread_mutex_unlock(&reactor->mutex);
+
+	for (e = done; e; e = next) {
+		next = e->next_done;
+		reactor->noffloaded--;
+
+		if (e->removed) {
+			xfree(e);
+			continue;
+		}
+
+		e->offloaded = 0;
+		e->finished = 0;
+
+		if (e->timed_out && !(e->step_rc == 0 && e->step_done)) {
+			/* the socket isn't watched while offloaded */
+			e->callback(e->sess, VTLS_EVENT_TIMEOUT, e->ctx);
+		} else
+			finish_handshake(reactor, e, e->step_rc, e->step_done);
+		n++;
+	}
+
+	return n;
+}
+
+/**
+ * vtls_reactor_add:
+ * @reactor: reactor
+ * @sess: initialized session
+ * @sockfd: connected socket, it is switched to non-blocking mode
+ * @hostname: host name for SNI and certificate verification
+ * @callback: called with VTLS_EVENT_* flags for the session
+ * @ctx: passed to @callback
+ *
+ * Start the handshake of @sess and let the reactor drive it. Reads and
+ * writes on the session never wait from then on, they return CURLE_AGAIN
+ * until the reactor reports the session as readable resp. writable.
+ *
+ * A session that is already connected, e.g. one removed from a reactor of
+ * another thread, is taken over as it is. It is reported as readable once,
+ * in case it has buffered data.
+ *
+ * Returns: 0 or a CURLcode.
+ */
+int vtls_reactor_add(vtls_reactor_t *reactor, vtls_session_t *sess, int sockfd, const char *hostname,
+	vtls_reactor_callback_t callback, void *ctx)
+{
+	struct reactor_entry *e;
+	int done, flags, rc;
+
+	if (sess->reactor_data)
+		return CURLE_BAD_FUNCTION_ARGUMENT;
+
+	if ((flags = fcntl(sockfd, F_GETFL)) == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return CURLE_BAD_FUNCTION_ARGUMENT;
+
+	if (!(e = calloc(1, sizeof(*e))))
+		return CURLE_OUT_OF_MEMORY;
+
+	e->reactor = reactor;
+	e->sess = sess;
+	e->fd = sockfd;
+	e->callback = callback;
+	e->ctx = ctx;
+	e->timer.data = e;
+	e->wtimer.data = e;
+	sess->reactor_data = e;
+
+	/* kTLS does the socket I/O itself, such sessions stay with epoll */
+	if (reactor->ring && !backend_ktls_active(sess) && uring_attach(reactor->ring, sess, sockfd, e) == 0)
+		e->uring = 1;
+
+	if (sess->state == ssl_connection_complete) {
+		e->connected = 1;
+		defer_events(reactor, e, VTLS_EVENT_READABLE);
+		arm_timer(reactor, &e->timer, sess->config->read_timeout);
+		rc = update_interest(reactor, e);
+	} else if ((rc = vtls_connect_nonblocking(sess, sockfd, hostname, &done)) == 0) {
+		arm_timer(reactor, &e->timer, done ? sess->config->read_timeout : sess->config->connect_timeout);
+		if (done) {
+			/* report it from the next vtls_reactor_run() */
+			e->connected = 1;
+			defer_events(reactor, e, VTLS_EVENT_CONNECTED);
+		}
+		rc = update_interest(reactor, e);
+	}
+
+	if (rc) {
+		if (e->pending)
+			reactor->pending = e->next_pending; /* it was pushed last */
+		timerwheel_del(&reactor->wheel, &e->timer);
+		if (e->uring) {
+			uring_detach(sess);
+			uring_free(sess);
+		}
+		sess->reactor_data = NULL;
+		xfree(e);
+	}
+
+	return rc;
+}
+
+/**
+ * vtls_reactor_remove:
+ * @reactor: reactor
+ * @sess: session added with vtls_reactor_add()
+ *
+ * Stop driving @sess, e.g. before closing it. May be called from the
+ * session's callback. If a handshake step of @sess runs on the offload
+ * pool, this waits for it to finish. With io_uring, data @sess queued but
+ * the peer didn't take yet is written ahead of the next vtls_write() or
+ * close_notify, so keep the session until then, e.g. by vtls_close().
+ */
+void vtls_reactor_remove(vtls_reactor_t *reactor, vtls_session_t *sess)
+{
+	struct reactor_entry *e = sess->reactor_data, **ep;
+
+	if (!e)
+		return;
+
+	timerwheel_del(&reactor->wheel, &e->timer);
+	timerwheel_del(&reactor->wheel, &e->wtimer);
+
+	if (e->offloaded) {
+		/* the entry is on the done list (or about to be) and freed from there */
+		pthread_mutex_lock(&reactor->mutex);
+		while (!e->finished)
+			pthread_cond_wait(&reactor->cond, &reactor->mutex);
+		pthread_mutex_unlock(&reactor->mutex);
+	}
+
+	if (e->uring)
+		uring_detach(sess);
+
+	if (e->offloaded) {
+		e->removed = 1;
+		sess->reactor_data = NULL;
+		return;
+	}
+
+	if (e->interest)
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+
+	if (e->pending) {
+		for (ep = &reactor->pending; *ep; ep = &(*ep)->next_pending) {
+			if (*ep == e) {
+				*ep = e->next_pending;
+				break;
+			}
+		}
+	}
+
+	sess->reactor_data = NULL;
+
+	if (reactor->running) {
+		/* the entry may still be on the ready list */
+		e->removed = 1;
+		e->next_pending = reactor->garbage;
+		reactor->garbage = e;
+	} else
+		xfree(e);
+}
+
+/**
+ * vtls_reactor_want_write:
+ * @reactor: reactor
+ * @sess: session added with vtls_reactor_add()
+ * @enable: 1 to get VTLS_EVENT_WRITABLE, 0 to stop it
+ *
+ * Ask for VTLS_EVENT_WRITABLE, e.g. after vtls_write() returned CURLE_AGAIN.
+ * Retry the write with the same data then.
+ *
+ * Returns: 0 or a CURLcode.
+ */
+int vtls_reactor_want_write(vtls_reactor_t *reactor, vtls_session_t *sess, int enable)
+{
+	struct reactor_entry *e = sess->reactor_data;
+
+	if (!e)
+		return CURLE_BAD_FUNCTION_ARGUMENT;
+
+	if (e->want_write != !!enable) {
+		e->want_write = !!enable;
+		arm_timer(reactor, &e->wtimer, enable ? sess->config->write_timeout : 0);
+	}
+
+	return update_interest(reactor, e);
+}
+
+/* continue the shutdown, report the outcome once it is known */
+static void advance_shutdown(vtls_reactor_t *reactor, struct reactor_entry *e, int report_now)
+{
+	int done, rc = 0, events;
+
+	if (!e->draining && (rc = vtls_shutdown_nonblocking(e->sess, e->close_how, &done)) == 0 && !done) {
+		if ((rc = update_interest(reactor, e)) == 0)
+			return;
+	}
+
+	/* vtls_reactor_remove() doesn't wait for the queued close_notify, so do it here */
+	if (!rc && e->uring && (rc = uring_sent_all(e->sess->uring_data)) == CURLE_AGAIN) {
+		e->draining = 1;
+		return;
+	}
+
+	stop_watching(reactor, e);
+	events = rc ? VTLS_EVENT_ERROR : VTLS_EVENT_SHUTDOWN;
+
+	if (report_now)
+		e->callback(e->sess, events, e->ctx);
+	else
+		defer_events(reactor, e, events);
+}
+
+/**
+ * vtls_reactor_shutdown:
+ * @reactor: reactor
+ * @sess: connected session added with vtls_reactor_add()
+ * @how: VTLS_SHUTDOWN_FAST or VTLS_SHUTDOWN_FULL
+ *
+ * Shut the TLS layer of @sess down without blocking the reactor thread.
+ * No more data is reported for @sess; the callback gets VTLS_EVENT_SHUTDOWN
+ * when done, VTLS_EVENT_ERROR if that failed or VTLS_EVENT_TIMEOUT after
+ * SSL_SHUTDOWN_TIMEOUT ms. Remove the session then.
+ *
+ * Returns: 0 or a CURLcode.
+ */
+int vtls_reactor_shutdown(vtls_reactor_t *reactor, vtls_session_t *sess, int how)
+{
+	struct reactor_entry *e = sess->reactor_data;
+
+	if (!e || !e->connected || e->closing)
+		return CURLE_BAD_FUNCTION_ARGUMENT;
+
+	e->closing = 1;
+	e->close_how = (char) how;
+	e->want_write = 0;
+	e->events &= ~(VTLS_EVENT_READABLE | VTLS_EVENT_WRITABLE);
+
+	timerwheel_del(&reactor->wheel, &e->wtimer);
+	arm_timer(reactor, &e->timer, SSL_SHUTDOWN_TIMEOUT);
+	advance_shutdown(reactor, e, 0);
+
+	return 0;
+}
+
+/**
+ * vtls_reactor_run:
+ * @reactor: reactor
+ * @timeout_ms: how long to wait for events, -1 = forever
+ *
+ * Wait for events once and dispatch them: handshakes are advanced, then
+ * the callbacks of established sessions are invoked. Doesn't wait past the
+ * next session deadline; expired sessions get VTLS_EVENT_TIMEOUT and stay
+ * registered until removed.
+ *
+ * Returns: the number of sessions dispatched or -1 on error.
+ */
+int vtls_reactor_run(vtls_reactor_t *reactor, int timeout_ms)
+{
+	struct epoll_event events[64];
+	struct reactor_entry *ready = NULL, *pending, *e, *next;
+	wheel_timer_t *timer, *expired;
+	int n, it, ndispatched = 0;
+
+	if (reactor->pending)
+		timeout_ms = 0;
+	else if (reactor->wheel.count) {
+		int64_t next_ms = timerwheel_next(&reactor->wheel, now_ms());
+
+		if (timeout_ms < 0 || next_ms < timeout_ms)
+			timeout_ms = (int) next_ms;
+	}
+
+	if (!reactor->ring)
+		n = epoll_wait(reactor->epfd, events, countof(events), timeout_ms);
+	else if ((n = uring_run(reactor->ring, timeout_ms)) > 0)
+		n = epoll_wait(reactor->epfd, events, countof(events), 0);
+
+	if (n == -1) {
+		if (errno != EINTR)
+			return -1;
+		n = 0;
+	}
+
+	reactor->now = now_ms();
+	reactor->running = 1;
+
+	if (reactor->noffloaded)
+		ndispatched += collect_offloaded(reactor);
+
+	for (it = 0; it < n; it++) {
+		uint32_t ev = events[it].events;
+		int flags = 0;
+
+		if (!events[it].data.ptr) {
+			uint64_t count;
+
+			if (read(reactor->wakefd, &count, sizeof(count)) < 0) {
+				/* nothing to do, another thread just wanted us to return */
+			}
+			continue;
+		}
+
+		if (ev & (EPOLLIN | EPOLLPRI))
+			flags |= VTLS_EVENT_READABLE;
+		if (ev & EPOLLOUT)
+			flags |= VTLS_EVENT_WRITABLE;
+		if (ev & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+			flags |= VTLS_EVENT_CLOSED | VTLS_EVENT_READABLE; /* let the application read the rest */
+
+		mark_ready(&ready, events[it].data.ptr, flags);
+	}
+
+	if (reactor->ring) {
+		int flags;
+
+		/* an offloaded step pulls the data itself */
+		while ((e = uring_next_event(reactor->ring, &flags))) {
+			if (!e->offloaded && !e->stopped)
+				mark_ready(&ready, e, flags);
+		}
+	}
+
+	for (expired = timerwheel_expire(&reactor->wheel, reactor->now); expired; expired = timer) {
+		timer = expired->next;
+		e = expired->data;
+
+		if (e->offloaded)
+			e->timed_out = 1;
+		else
+			mark_ready(&ready, e, VTLS_EVENT_TIMEOUT);
+	}
+
+	/* buffered plaintext counts as readable, including what was deferred above */
+	pending = reactor->pending;
+	reactor->pending = NULL;
+	for (e = pending; e; e = next) {
+		next = e->next_pending;
+		e->pending = 0;
+		mark_ready(&ready, e, buffered(e) > 0 ? VTLS_EVENT_READABLE : 0);
+	}
+
+	for (e = ready; e; e = e->next_ready) {
+		int flags = e->events;
+
+		e->ready = 0;
+		e->events = 0;
+
+		if (e->removed)
+			continue;
+
+		if (!e->connected || e->closing) {
+			if (flags & (VTLS_EVENT_SHUTDOWN | VTLS_EVENT_ERROR)) {
+				e->callback(e->sess, flags & (VTLS_EVENT_SHUTDOWN | VTLS_EVENT_ERROR), e->ctx);
+			} else if (flags & VTLS_EVENT_TIMEOUT) {
+				stop_watching(reactor, e);
+				e->callback(e->sess, VTLS_EVENT_TIMEOUT, e->ctx);
+			} else if (e->closing)
+				advance_shutdown(reactor, e, 1);
+			else
+				advance_handshake(reactor, e);
+		} else {
+			/* a read (renegotiation, KeyUpdate) waited for writability */
+			if ((flags & VTLS_EVENT_WRITABLE) && vtls_want(e->sess) == VTLS_WANT_WRITE)
+				flags |= VTLS_EVENT_READABLE;
+			if (!e->want_write)
+				flags &= ~VTLS_EVENT_WRITABLE;
+			if (flags & VTLS_EVENT_READABLE)
+				arm_timer(reactor, &e->timer, e->sess->config->read_timeout);
+			if (flags & VTLS_EVENT_WRITABLE)
+				arm_timer(reactor, &e->wtimer, e->sess->config->write_timeout);
+			if (flags)
+				e->callback(e->sess, flags, e->ctx);
+		}
+
+		/* epoll won't tell about what GnuTLS or the ring has buffered already */
+		if (!e->removed && e->connected && !e->closing) {
+			if (!e->pending && buffered(e) > 0)
+				defer_events(reactor, e, 0);
+			update_interest(reactor, e); /* the session may wait for writability now */
+		}
+
+		ndispatched++;
+	}
+
+	reactor->running = 0;
+
+	for (e = reactor->garbage; e; e = next) {
+		next = e->next_pending;
+		xfree(e);
+	}
+	reactor->garbage = NULL;
+
+	return ndispatched;
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+int vtls_reactor_init(vtls_reactor_t **reactor)
+{
+	*reactor = NULL;
+	return CURLE_NOT_BUILT_IN;
+}
+
+void vtls_reactor_deinit(vtls_reactor_t *reactor)
+{
+}
+
+void vtls_reactor_wakeup(vtls_reactor_t *reactor)
+{
+}
+
+int vtls_reactor_add(vtls_reactor_t *reactor, vtls_session_t *sess, int sockfd, const char *hostname,
+	vtls_reactor_callback_t callback, void *ctx)
+{
+	return CURLE_NOT_BUILT_IN;
+}
+
+void vtls_reactor_remove(vtls_reactor_t *reactor, vtls_session_t *sess)
+{
+}
+
+int vtls_reactor_want_write(vtls_reactor_t *reactor, vtls_session_t *sess, int enable)
+{
+	return CURLE_NOT_BUILT_IN;
+}
+
+int vtls_reactor_shutdown(vtls_reactor_t *reactor, vtls_session_t *sess, int how)
+{
+	return CURLE_NOT_BUILT_IN;
+}
+
+int vtls_reactor_run(vtls_reactor_t *reactor, int timeout_ms)
+{
+	return -1;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
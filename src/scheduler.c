@@ -0,0 +1,428 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <vtls.h>
+
+#include "common.h"
+#include "backend.h"
+
+/*
+ * Thread per core runtime on top of vtls_reactor.
+ *
+ * Each worker thread runs its own reactor (epoll set). New sessions are
+ * queued to a worker and started there. A worker with an empty queue steals
+ * queued sessions from the worker with the longest queue, so a burst of
+ * handshakes is spread over all cores instead of piling up on the thread
+ * that accepted the sockets.
+ *
+ * A session belongs to exactly one worker at a time and its callback runs on
+ * that worker's thread. Migrating a session removes it from the reactor of
+ * its thread and queues it to another worker. The queue mutex orders all
+ * accesses of the old thread before those of the new one.
+ */
+
+struct work {
+	struct work *next;
+	vtls_session_t *sess;
+	vtls_reactor_callback_t callback;
+	void *ctx;
+	char *hostname;
+	int fd;
+};
+
+struct worker {
+	pthread_mutex_t mutex; /* protects the queue */
+	struct work *head, *tail; /* sessions to start or take over */
+	vtls_scheduler_t *sched;
+	vtls_reactor_t *reactor;
+	pthread_t tid;
+	int nqueued;
+	int nsessions;
+	char idle; /* waiting for events with an empty queue */
+	char started; /* thread has been created */
+} __attribute__ ((aligned(64)));
+
+struct vtls_scheduler_st {
+	struct worker *workers;
+	int nworkers;
+	unsigned int next; /* round robin for submissions from non-worker threads */
+	int stop;
+};
+
+/* sessions started per round, so established sessions get their turn during bursts */
+#define START_BATCH 16
+
+static __thread struct worker *_current;
+
+static void enqueue(struct worker *w, struct work *work)
+{
+	work->next = NULL;
+
+	pthread_mutex_lock(&w->mutex);
+	if (w->tail)
+		w->tail->next = work;
+	else
+		w->head = work;
+	w->tail = work;
+	__atomic_add_fetch(&w->nqueued, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+static struct work *dequeue(struct worker *w)
+{
+	struct work *work;
+
+	pthread_mutex_lock(&w->mutex);
+	if ((work = w->head)) {
+		if (!(w->head = work->next))
+			w->tail = NULL;
+		__atomic_sub_fetch(&w->nqueued, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&w->mutex);
+
+	return work;
+}
+
+/* take a queued session from the worker with the longest queue */
+static struct work *steal(struct worker *self)
+{
+	vtls_scheduler_t *sched = self->sched;
+	struct worker *victim = NULL;
+	int it, most = 0;
+
+	for (it = 0; it < sched->nworkers; it++) {
+		struct worker *w = &sched->workers[it];
+		int n = __atomic_load_n(&w->nqueued, __ATOMIC_RELAXED);
+
+		if (w != self && n > most) {
+			most = n;
+			victim = w;
+		}
+	}
+
+	return victim ? dequeue(victim) : NULL;
+}
+
+/* queue work to w and make sure somebody picks it up soon */
+static void submit(struct worker *w, struct work *work)
+{
+	vtls_scheduler_t *sched = w->sched;
+	int it;
+
+	enqueue(w, work);
+	vtls_reactor_wakeup(w->reactor);
+
+	/* more than w can start at once: let an idle worker steal */
+	if (__atomic_load_n(&w->nqueued, __ATOMIC_RELAXED) > 1) {
+		for (it = 0; it < sched->nworkers; it++) {
+			struct worker *idle = &sched->workers[it];
+
+			if (idle != w && __atomic_load_n(&idle->idle, __ATOMIC_RELAXED)) {
+				vtls_reactor_wakeup(idle->reactor);
+				break;
+			}
+		}
+	}
+}
+
+static void start(struct worker *w, struct work *work)
+{
+	if (vtls_reactor_add(w->reactor, work->sess, work->fd, work->hostname, work->callback, work->ctx))
+		work->callback(work->sess, VTLS_EVENT_ERROR, work->ctx);
+	else
+		__atomic_add_fetch(&w->nsessions, 1, __ATOMIC_RELAXED);
+
+	xfree(work->hostname);
+	xfree(work);
+}
+
+static void *worker_thread(void *p)
+{
+	struct worker *w = p;
+	struct work *work;
+
+	_current = w;
+
+	while (!__atomic_load_n(&w->sched->stop, __ATOMIC_ACQUIRE)) {
+		int started = 0;
+
+		while (started < START_BATCH && (work = dequeue(w))) {
+			start(w, work);
+			started++;
+		}
+
+		if (!started && (work = steal(w))) {
+			start(w, work);
+			started++;
+		}
+
+		if (__atomic_load_n(&w->nqueued, __ATOMIC_RELAXED)) {
+			vtls_reactor_run(w->reactor, 0);
+		} else {
+			__atomic_store_n(&w->idle, !started, __ATOMIC_RELAXED);
+			vtls_reactor_run(w->reactor, started ? 0 : -1);
+			__atomic_store_n(&w->idle, 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	/* sessions still queued were never started, report them as failed */
+	while ((work = dequeue(w))) {
+		work->callback(work->sess, VTLS_EVENT_ERROR, work->ctx);
+		xfree(work->hostname);
+		xfree(work);
+	}
+
+	return NULL;
+}
+
+/**
+ * vtls_scheduler_init:
+ * @sched: receives the scheduler
+ * @nthreads: number of worker threads, 0 = one per online CPU
+ *
+ * Returns: 0 or a CURLcode.
+ */
+int vtls_scheduler_init(vtls_scheduler_t **sched, int nthreads)
+{
+	int it, rc = 0;
+
+	if (nthreads <= 0 && (nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+		nthreads = 1;
+
+	if (!(*sched = calloc(1, sizeof(**sched))))
+		return CURLE_OUT_OF_MEMORY;
+
+	if (posix_memalign((void **) &(*sched)->workers, 64, nthreads * sizeof(struct worker))) {
+		xfree(*sched);
+		return CURLE_OUT_OF_MEMORY;
+	}
+
+	memset((*sched)->workers, 0, nthreads * sizeof(struct worker));
+	(*sched)->nworkers = nthreads;
+
+	for (it = 0; it < nthreads && !rc; it++) {
+		struct worker *w = &(*sched)->workers[it];
+
+		pthread_mutex_init(&w->mutex, NULL);
+		w->sched = *sched;
+
+		if (!(rc = vtls_reactor_init(&w->reactor))) {
+			if (pthread_create(&w->tid, NULL, worker_thread, w))
+				rc = CURLE_FAILED_INIT;
+			else
+				w->started = 1;
+		}
+	}
+
+	if (rc) {
+		vtls_scheduler_deinit(*sched);
+		*sched = NULL;
+	}
+
+	return rc;
+}
+
+/**
+ * vtls_scheduler_deinit:
+ * @sched: scheduler
+ *
+ * Stop and join the worker threads. Sessions that are still registered
+ * are not closed, remove them from their callbacks before.
+ */
+void vtls_scheduler_deinit(vtls_scheduler_t *sched)
+{
+	int it;
+
+	if (!sched)
+		return;
+
+	__atomic_store_n(&sched->stop, 1, __ATOMIC_RELEASE);
+
+	for (it = 0; it < sched->nworkers; it++) {
+		struct worker *w = &sched->workers[it];
+
+		if (w->started) {
+			vtls_reactor_wakeup(w->reactor);
+			pthread_join(w->tid, NULL);
+		}
+		vtls_reactor_deinit(w->reactor);
+		pthread_mutex_destroy(&w->mutex);
+	}
+
+	xfree(sched->workers);
+	xfree(sched);
+}
+
+/**
+ * vtls_scheduler_add:
+ * @sched: scheduler
+ * @sess: initialized session
+ * @sockfd: connected socket
+ * @hostname: host name for SNI and certificate verification
+ * @callback: called with VTLS_EVENT_* flags, on the thread owning the session
+ * @ctx: passed to @callback
+ *
+ * Hand a session to the scheduler, like vtls_reactor_add(). Called from a
+ * worker thread, the session is queued to that worker; else the workers
+ * take turns. Queued sessions may be stolen by idle workers.
+ * May be called from any thread.
+ *
+ * Returns: 0 or a CURLcode.
+ */
+int vtls_scheduler_add(vtls_scheduler_t *sched, vtls_session_t *sess, int sockfd, const char *hostname,
+	vtls_reactor_callback_t callback, void *ctx)
+{
+	struct work *work;
+	struct worker *w;
+
+	if (!(work = calloc(1, sizeof(*work))))
+		return CURLE_OUT_OF_MEMORY;
+
+	if (hostname && !(work->hostname = strdup(hostname))) {
+		xfree(work);
+		return CURLE_OUT_OF_MEMORY;
+	}
+
+	work->sess = sess;
+	work->fd = sockfd;
+	work->callback = callback;
+	work->ctx = ctx;
+
+	if (_current && _current->sched == sched)
+		w = _current;
+	else
+		w = &sched->workers[__atomic_fetch_add(&sched->next, 1, __ATOMIC_RELAXED) % sched->nworkers];
+
+	submit(w, work);
+
+	return 0;
+}
+
+/**
+ * vtls_scheduler_remove:
+ * @sched: scheduler
+ * @sess: session added with vtls_scheduler_add()
+ *
+ * Stop driving @sess. Must be called from the session's callback.
+ */
+void vtls_scheduler_remove(vtls_scheduler_t *sched, vtls_session_t *sess)
+{
+	if (_current && _current->sched == sched && sess->reactor_data) {
+		vtls_reactor_remove(_current->reactor, sess);
+		__atomic_sub_fetch(&_current->nsessions, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * vtls_scheduler_want_write:
+ * @sched: scheduler
+ * @sess: session added with vtls_scheduler_add()
+ * @enable: 1 to get VTLS_EVENT_WRITABLE, 0 to stop it
+ *
+ * Like vtls_reactor_want_write(). Must be called from the session's callback.
+ *
+ * Returns: 0 or a CURLcode.
+ */
+int vtls_scheduler_want_write(vtls_scheduler_t *sched, vtls_session_t *sess, int enable)
+{
+	if (!_current || _current->sched != sched)
+		return CURLE_BAD_FUNCTION_ARGUMENT;
+
+	return vtls_reactor_want_write(_current->reactor, sess, enable);
+}
+
+/**
+ * vtls_scheduler_shutdown:
+ * @sched: scheduler
+ * @sess: session added with vtls_scheduler_add()
+ * @how: VTLS_SHUTDOWN_FAST or VTLS_SHUTDOWN_FULL
+ *
+ * Like vtls_reactor_shutdown(). Must be called from the session's callback.
+ *
+ * Returns: 0 or a CURLcode.
+ */
+int vtls_scheduler_shutdown(vtls_scheduler_t *sched, vtls_session_t *sess, int how)
+{
+	if (!_current || _current->sched != sched)
+		return CURLE_BAD_FUNCTION_ARGUMENT;
+
+	return vtls_reactor_shutdown(_current->reactor, sess, how);
+}
+
+/**
+ * vtls_scheduler_migrate:
+ * @sched: scheduler
+ * @sess: session added with vtls_scheduler_add()
+ * @worker: index of the worker to move to, -1 = the one with the least sessions
+ * @callback: callback from now on
+ * @ctx: passed to @callback
+ *
+ * Move @sess, connected or still in the handshake, to another worker
+ * thread. Must be called from the session's callback. Don't touch the
+ * session from this thread afterwards.
+ *
+ * Returns: 0 or a CURLcode.
+ */
+int vtls_scheduler_migrate(vtls_scheduler_t *sched, vtls_session_t *sess, int worker,
+	vtls_reactor_callback_t callback, void *ctx)
+{
+	struct work *work;
+	struct worker *w;
+	int it;
+
+	if (!_current || _current->sched != sched || !sess->reactor_data || worker >= sched->nworkers)
+		return CURLE_BAD_FUNCTION_ARGUMENT;
+
+	if (worker < 0) {
+		for (worker = 0, it = 1; it < sched->nworkers; it++) {
+			if (__atomic_load_n(&sched->workers[it].nsessions, __ATOMIC_RELAXED)
+				< __atomic_load_n(&sched->workers[worker].nsessions, __ATOMIC_RELAXED))
+				worker = it;
+		}
+	}
+
+	if ((w = &sched->workers[worker]) == _current)
+		return 0;
+
+	if (!(work = calloc(1, sizeof(*work))))
+		return CURLE_OUT_OF_MEMORY;
+
+	work->sess = sess;
+	work->fd = sess->sockfd;
+	work->callback = callback;
+	work->ctx = ctx;
+
+	vtls_scheduler_remove(sched, sess);
+	submit(w, work);
+
+	return 0;
+}
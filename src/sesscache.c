@@ -0,0 +1,438 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <gnutls/gnutls.h>
+
+#include "common.h"
+#include "sesscache.h"
+
+/*
+ * Many threads connecting to the same upstreams hit this cache at once, so
+ * lookups don't write anything another thread reads or writes.
+ *
+ * The cache is split into shards by key hash, each with a mutex for writers
+ * and its own bucket table. Entries are never changed once linked, a
+ * replacement is a new entry. Readers walk the chains without a lock and
+ * announce the global epoch they started in, in a record of their own
+ * thread. Writers unlink an entry, advance the epoch and free the entry once
+ * no reader is left in an epoch as old as that (epoch based reclamation).
+ *
+ * LRU is approximate: lookups stamp an entry with the insert counter of its
+ * shard, which changes with each insert only, so a hot entry is written once
+ * per insert instead of once per lookup. Eviction drops the oldest stamp.
+ * Hit and miss counters live in the per-thread records as well.
+ */
+#define MAX_SHARDS 16
+#define MIN_PER_SHARD 16 /* smaller caches get fewer shards */
+
+struct entry {
+	struct entry *next; /* hash bucket chain */
+	struct entry *next_retired;
+	unsigned long last_used; /* shard->clock at the last lookup */
+	unsigned long retired; /* _epoch when it was unlinked */
+	unsigned int hash;
+	time_t expires;
+	gnutls_datum_t data;
+	char key[1]; /* allocated with the entry */
+};
+
+struct shard {
+	pthread_mutex_t lock; /* serializes writers */
+	struct entry **buckets;
+	struct entry *retired; /* unlinked, maybe still read */
+	unsigned long clock; /* ticks with every insert */
+	int nbuckets;
+	int nentries;
+	int max_entries;
+} __attribute__ ((aligned(64)));
+
+struct sesscache_st {
+	struct shard shards[MAX_SHARDS];
+	unsigned int nshards;
+};
+
+/* per thread, linked into _readers for good and reused after the thread exits */
+static struct reader {
+	struct reader *next;
+	unsigned long epoch; /* _epoch while in sesscache_get(), else 0 */
+	unsigned long hits; /* process wide statistics for vtls_session_cache_stats() */
+	unsigned long misses;
+	int in_use;
+} __attribute__ ((aligned(64))) *_readers;
+
+static unsigned long _epoch = 1;
+static __thread struct reader *_reader;
+static pthread_key_t _reader_key;
+static pthread_once_t _reader_once = PTHREAD_ONCE_INIT;
+
+static void release_reader(void *reader)
+{
+	__atomic_store_n(&((struct reader *) reader)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_reader_key(void)
+{
+	pthread_key_create(&_reader_key, release_reader);
+}
+
+/* the record of the calling thread, NULL on out of memory */
+static struct reader *get_reader(void)
+{
+	struct reader *r;
+
+	if (_reader)
+		return _reader;
+
+	/* take over the record of a thread that exited, its counts stay */
+	for (r = __atomic_load_n(&_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+		int unused = 0;
+
+		if (__atomic_compare_exchange_n(&r->in_use, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (!r) {
+		if (posix_memalign((void **) &r, 64, sizeof(*r)))
+			return NULL;
+		memset(r, 0, sizeof(*r));
+		r->in_use = 1;
+		r->next = __atomic_load_n(&_readers, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&_readers, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	pthread_once(&_reader_once, create_reader_key);
+	pthread_setspecific(_reader_key, r);
+
+	return _reader = r;
+}
+
+static void free_entry(struct entry *e)
+{
+	xfree(e->data.data);
+	xfree(e);
+}
+
+/* free the retired entries no reader can see any more, caller holds the lock */
+static void reclaim(struct shard *shard)
+{
+	struct entry **ep, *e;
+	struct reader *r;
+	unsigned long oldest = (unsigned long) -1, epoch;
+
+	if (!shard->retired)
+		return;
+
+	/* pairs with the fence in sesscache_get(): a reader we miss here
+	 * started after the unlink and can't find the entries */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (r = __atomic_load_n(&_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+		if ((epoch = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE)) && epoch < oldest)
+			oldest = epoch;
+	}
+
+	for (ep = &shard->retired; (e = *ep);) {
+		if (e->retired < oldest) {
+			*ep = e->next_retired;
+			free_entry(e);
+		} else
+			ep = &e->next_retired;
+	}
+}
+
+sesscache_t *sesscache_init(int max_entries)
+{
+	sesscache_t *cache;
+	int it, per_shard;
+
+	if (posix_memalign((void **) &cache, 64, sizeof(*cache)))
+		return NULL;
+
+	memset(cache, 0, sizeof(*cache));
+
+	/* a power of two, so a shard holds at least MIN_PER_SHARD entries */
+	for (cache->nshards = 1; cache->nshards < MAX_SHARDS && (int) cache->nshards * 2 * MIN_PER_SHARD <= max_entries; cache->nshards *= 2)
+		;
+	per_shard = (max_entries + cache->nshards - 1) / cache->nshards;
+
+	for (it = 0; it < (int) cache->nshards; it++) {
+		struct shard *shard = &cache->shards[it];
+
+		/* about one entry per bucket when full */
+		for (shard->nbuckets = 4; shard->nbuckets < per_shard; shard->nbuckets *= 2)
+			;
+
+		if (!(shard->buckets = calloc(shard->nbuckets, sizeof(*shard->buckets)))) {
+			while (--it >= 0) {
+				xfree(cache->shards[it].buckets);
+				pthread_mutex_destroy(&cache->shards[it].lock);
+			}
+			xfree(cache);
+			return NULL;
+		}
+
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->max_entries = per_shard;
+	}
+
+	return cache;
+}
+
+/* no lookups may be running any more */
+void sesscache_deinit(sesscache_t *cache)
+{
+	struct entry *e, *next;
+	int it, bucket;
+
+	if (!cache)
+		return;
+
+	for (it = 0; it < (int) cache->nshards; it++) {
+		struct shard *shard = &cache->shards[it];
+
+		for (bucket = 0; bucket < shard->nbuckets; bucket++) {
+			for (e = shard->buckets[bucket]; e; e = next) {
+				next = e->next;
+				free_entry(e);
+			}
+		}
+		for (e = shard->retired; e; e = next) {
+			next = e->next_retired;
+			free_entry(e);
+		}
+
+		pthread_mutex_destroy(&shard->lock);
+		xfree(shard->buckets);
+	}
+
+	xfree(cache);
+}
+
+static unsigned int hash_key(const char *key)
+{
+	unsigned int hash = 5381; /* djb2 */
+
+	while (*key)
+		hash = hash * 33 + (unsigned char) *key++;
+
+	return hash;
+}
+
+/* the low bits select the bucket, so use the high bits for the shard */
+static inline struct shard *get_shard(sesscache_t *cache, unsigned int hash)
+{
+	return &cache->shards[(hash >> 24) & (cache->nshards - 1)];
+}
+
+/* caller holds the lock */
+static struct entry **find(struct shard *shard, const char *key, unsigned int hash)
+{
+	struct entry **ep;
+
+	for (ep = &shard->buckets[hash & (shard->nbuckets - 1)]; *ep; ep = &(*ep)->next) {
+		if ((*ep)->hash == hash && !strcmp((*ep)->key, key))
+			break;
+	}
+
+	return ep;
+}
+
+/* unlink *ep from the shard and retire it, caller holds the lock */
+static void drop(struct shard *shard, struct entry **ep)
+{
+	struct entry *e = *ep;
+
+	__atomic_store_n(ep, e->next, __ATOMIC_RELEASE);
+	shard->nentries--;
+
+	e->retired = __atomic_fetch_add(&_epoch, 1, __ATOMIC_SEQ_CST);
+	e->next_retired = shard->retired;
+	shard->retired = e;
+}
+
+/* find the least recently used entry of a full shard, caller holds the lock */
+static struct entry **find_lru(struct shard *shard)
+{
+	struct entry **ep, **lru = NULL;
+	int bucket;
+
+	for (bucket = 0; bucket < shard->nbuckets; bucket++) {
+		for (ep = &shard->buckets[bucket]; *ep; ep = &(*ep)->next) {
+			if (!lru || __atomic_load_n(&(*ep)->last_used, __ATOMIC_RELAXED) < __atomic_load_n(&(*lru)->last_used, __ATOMIC_RELAXED))
+				lru = ep;
+		}
+	}
+
+	return lru;
+}
+
+/**
+ * sesscache_get:
+ * @cache: session cache
+ * @key: host and port of the peer
+ * @data: receives a copy of the session data, free data->data with free()
+ *
+ * Returns: 0 if a valid session was found, else -1.
+ */
+int sesscache_get(sesscache_t *cache, const char *key, gnutls_datum_t *data)
+{
+	unsigned int hash = hash_key(key);
+	struct shard *shard = get_shard(cache, hash);
+	struct reader *r = get_reader();
+	struct entry *e;
+	unsigned long clock;
+	int ret = -1, expired = 0;
+
+	if (!r)
+		return -1;
+
+	__atomic_store_n(&r->epoch, __atomic_load_n(&_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (e = __atomic_load_n(&shard->buckets[hash & (shard->nbuckets - 1)], __ATOMIC_ACQUIRE); e;
+		e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE))
+	{
+		if (e->hash == hash && !strcmp(e->key, key))
+			break;
+	}
+
+	if (e) {
+		if (e->expires <= time(NULL)) {
+			expired = 1;
+		} else if ((data->data = malloc(e->data.size))) {
+			memcpy(data->data, e->data.data, e->data.size);
+			data->size = e->data.size;
+			clock = __atomic_load_n(&shard->clock, __ATOMIC_RELAXED);
+			if (__atomic_load_n(&e->last_used, __ATOMIC_RELAXED) != clock)
+				__atomic_store_n(&e->last_used, clock, __ATOMIC_RELAXED);
+			ret = 0;
+		}
+	}
+
+	__atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+
+	if (expired)
+		sesscache_remove(cache, key);
+
+	/* only this thread writes them */
+	if (ret == 0)
+		__atomic_store_n(&r->hits, r->hits + 1, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(&r->misses, r->misses + 1, __ATOMIC_RELAXED);
+
+	return ret;
+}
+
+/**
+ * sesscache_put:
+ * @cache: session cache
+ * @key: host and port of the peer
+ * @data: session data
+ * @expires: when the session can't be resumed any more
+ *
+ * Add or replace the session for @key, dropping the least recently used
+ * entry of the shard if it is full.
+ *
+ * Returns: 0 on success, -1 on out of memory.
+ */
+int sesscache_put(sesscache_t *cache, const char *key, const gnutls_datum_t *data, time_t expires)
+{
+	unsigned int hash = hash_key(key);
+	struct shard *shard = get_shard(cache, hash);
+	size_t keylen = strlen(key);
+	struct entry **ep, *e;
+
+	if (!(e = malloc(sizeof(*e) + keylen)))
+		return -1;
+
+	if (!(e->data.data = malloc(data->size))) {
+		xfree(e);
+		return -1;
+	}
+
+	memcpy(e->data.data, data->data, data->size);
+	e->data.size = data->size;
+	memcpy(e->key, key, keylen + 1);
+	e->hash = hash;
+	e->expires = expires;
+
+	pthread_mutex_lock(&shard->lock);
+
+	if (*(ep = find(shard, key, hash)))
+		drop(shard, ep);
+	else if (shard->nentries >= shard->max_entries) {
+		drop(shard, find_lru(shard));
+		ep = find(shard, key, hash);
+	}
+
+	__atomic_store_n(&shard->clock, shard->clock + 1, __ATOMIC_RELAXED);
+	e->last_used = shard->clock;
+	e->next = *ep;
+	__atomic_store_n(ep, e, __ATOMIC_RELEASE);
+	shard->nentries++;
+
+	reclaim(shard);
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return 0;
+}
+
+void sesscache_remove(sesscache_t *cache, const char *key)
+{
+	unsigned int hash = hash_key(key);
+	struct shard *shard = get_shard(cache, hash);
+	struct entry **ep;
+
+	pthread_mutex_lock(&shard->lock);
+	if (*(ep = find(shard, key, hash)))
+		drop(shard, ep);
+	reclaim(shard);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void sesscache_stats(unsigned long *hits, unsigned long *misses)
+{
+	unsigned long h = 0, m = 0;
+	struct reader *r;
+
+	for (r = __atomic_load_n(&_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+		h += __atomic_load_n(&r->hits, __ATOMIC_RELAXED);
+		m += __atomic_load_n(&r->misses, __ATOMIC_RELAXED);
+	}
+
+	if (hits)
+		*hits = h;
+	if (misses)
+		*misses = m;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#ifndef _VTLS_SESSCACHE_H
+#define _VTLS_SESSCACHE_H
+
+#include <time.h>
+#include <gnutls/gnutls.h>
+
+/*
+ * Client side TLS session resumption cache.
+ *
+ * Maps a key (host and port of the peer) to the session data from
+ * gnutls_session_get_data2(), valid until the expiry of the session or
+ * ticket. The cache is safe to share between threads, lookups take no
+ * lock. It is split into shards, and each shard drops about its least
+ * recently used entry when full.
+ */
+typedef struct sesscache_st sesscache_t;
+
+sesscache_t *sesscache_init(int max_entries);
+void sesscache_deinit(sesscache_t *cache);
+int sesscache_get(sesscache_t *cache, const char *key, gnutls_datum_t *data);
+int sesscache_put(sesscache_t *cache, const char *key, const gnutls_datum_t *data, time_t expires);
+void sesscache_remove(sesscache_t *cache, const char *key);
+void sesscache_stats(unsigned long *hits, unsigned long *misses);
+
+#endif /* _VTLS_SESSCACHE_H */
@@ -0,0 +1,394 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include <gnutls/gnutls.h>
+
+#include "common.h"
+#include "sessfile.h"
+
+#define NBUCKETS (SESSFILE_SLOTS / SESSFILE_WAYS)
+#define SLOTS_OFFSET ((sizeof(struct sessfile_header) + NBUCKETS * sizeof(struct sessfile_bucket) + 4095) & ~4095)
+#define MAX_DATA (SESSFILE_SLOT_SIZE - sizeof(struct sessfile_slot))
+#define LOCK_TRIES 1000
+
+#define LOCK_SEQ(lock) ((uint32_t) (lock))
+#define LOCK_TIME(lock) ((uint32_t) ((lock) >> 32))
+#define LOCK_WORD(seq, t) (((uint64_t) (uint32_t) (t) << 32) | (uint32_t) (seq))
+
+struct sessfile_st {
+	unsigned char *data; /* the mmap()ed file */
+	size_t size;
+	struct sessfile_bucket *buckets;
+};
+
+static inline struct sessfile_slot *get_slot(sessfile_t *sf, uint32_t bucket, int way)
+{
+	return (struct sessfile_slot *)(sf->data + SLOTS_OFFSET + SESSFILE_SLOT_SIZE * ((size_t) bucket * SESSFILE_WAYS + way));
+}
+
+/* FNV-1a */
+static uint32_t checksum(const struct sessfile_slot *slot)
+{
+	const unsigned char *p = (const unsigned char *) &slot->size;
+	const unsigned char *end = slot->data + slot->size;
+	uint32_t hash = 2166136261U;
+
+	while (p < end)
+		hash = (hash ^ *p++) * 16777619U;
+
+	return hash;
+}
+
+static uint32_t hash_key(const char *key)
+{
+	uint32_t hash = 5381; /* djb2 */
+
+	while (*key)
+		hash = hash * 33 + (unsigned char) *key++;
+
+	return hash;
+}
+
+/* returns 1 if slot holds an intact entry */
+static int slot_valid(const struct sessfile_slot *slot)
+{
+	return slot->size
+		&& slot->size <= MAX_DATA
+		&& memchr(slot->key, 0, SESSFILE_KEY_SIZE)
+		&& slot->checksum == checksum(slot);
+}
+
+/* map fd, initializing it if it is new or has a different layout */
+static sessfile_t *map_fd(int fd)
+{
+	sessfile_t *sf;
+	struct sessfile_header header;
+	size_t size = SLOTS_OFFSET + SESSFILE_SLOT_SIZE * (size_t) SESSFILE_SLOTS;
+	struct stat st;
+	void *data;
+
+	/* keep other processes from mapping the store while it is set up */
+	if (flock(fd, LOCK_EX)) {
+		close(fd);
+		return NULL;
+	}
+
+	if (fstat(fd, &st)
+		|| (size_t) st.st_size != size
+		|| pread(fd, &header, sizeof(header), 0) != sizeof(header)
+		|| memcmp(header.magic, SESSFILE_MAGIC, sizeof(header.magic))
+		|| header.byteorder != SESSFILE_BYTEORDER
+		|| header.nslots != SESSFILE_SLOTS
+		|| header.slot_size != SESSFILE_SLOT_SIZE
+		|| header.slots_offset != SLOTS_OFFSET)
+	{
+		/* new or incompatible: start over with an empty, sparse file */
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, SESSFILE_MAGIC, sizeof(header.magic));
+		header.byteorder = SESSFILE_BYTEORDER;
+		header.nslots = SESSFILE_SLOTS;
+		header.slot_size = SESSFILE_SLOT_SIZE;
+		header.slots_offset = SLOTS_OFFSET;
+
+		if (ftruncate(fd, 0) || ftruncate(fd, size)
+			|| pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+		{
+			close(fd);
+			return NULL;
+		}
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); /* also drops the lock */
+	if (data == MAP_FAILED)
+		return NULL;
+
+	if (!(sf = calloc(1, sizeof(*sf)))) {
+		munmap(data, size);
+		return NULL;
+	}
+
+	sf->data = data;
+	sf->size = size;
+	sf->buckets = (struct sessfile_bucket *)(sf->data + sizeof(struct sessfile_header));
+
+	return sf;
+}
+
+/**
+ * sessfile_open:
+ * @fname: file name of the session store
+ *
+ * Maps a session store file into memory, creating or resetting it if it
+ * doesn't exist or has a different layout.
+ *
+ * Returns: the store or %NULL on error.
+ */
+sessfile_t *sessfile_open(const char *fname)
+{
+	int fd;
+
+	if ((fd = open(fname, O_RDWR | O_CREAT, 0600)) == -1)
+		return NULL;
+
+	return map_fd(fd);
+}
+
+/**
+ * sessfile_open_shm:
+ * @name: POSIX shared memory object name, e.g. "/vtls-sessions"
+ *
+ * Like sessfile_open(), for a store that lives as long as the host.
+ *
+ * Returns: the store or %NULL on error.
+ */
+sessfile_t *sessfile_open_shm(const char *name)
+{
+	int fd;
+
+	if ((fd = shm_open(name, O_RDWR | O_CREAT, 0600)) == -1)
+		return NULL;
+
+	return map_fd(fd);
+}
+
+void sessfile_close(sessfile_t *sf)
+{
+	if (sf) {
+		msync(sf->data, sf->size, MS_ASYNC);
+		munmap(sf->data, sf->size);
+		xfree(sf);
+	}
+}
+
+/*
+ * Take the bucket's seqlock for writing. Returns the lock word we set, with
+ * an odd sequence, or 0. The time is stamped by the same CAS, so whoever
+ * sees a stale stamp sees the very word the dead writer left.
+ */
+static uint64_t bucket_lock(struct sessfile_bucket *bucket)
+{
+	uint64_t lock = __atomic_load_n(&bucket->lock, __ATOMIC_RELAXED), locked;
+	int tries;
+
+	for (tries = 0; tries < LOCK_TRIES; tries++) {
+		uint32_t seq = LOCK_SEQ(lock), now = (uint32_t) time(NULL);
+
+		if (!(seq & 1)) {
+			locked = LOCK_WORD(seq + 1, now);
+			if (__atomic_compare_exchange_n(&bucket->lock, &lock, locked, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return locked;
+			continue;
+		}
+
+		/* the writer may have died, take over (seq stays odd) */
+		if ((int32_t) (now - LOCK_TIME(lock)) > SESSFILE_STALE) {
+			locked = LOCK_WORD(seq + 2, now);
+			if (__atomic_compare_exchange_n(&bucket->lock, &lock, locked, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				return locked;
+			continue;
+		}
+
+		sched_yield();
+		lock = __atomic_load_n(&bucket->lock, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+/* a writer that was taken over leaves the bucket to its successor */
+static void bucket_unlock(struct sessfile_bucket *bucket, uint64_t locked)
+{
+	__atomic_compare_exchange_n(&bucket->lock, &locked, LOCK_WORD(LOCK_SEQ(locked) + 1, 0), 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+/* clear expired and broken slots of a bucket, caller holds its seqlock */
+static void bucket_clean(sessfile_t *sf, uint32_t b)
+{
+	time_t now = time(NULL);
+	int way;
+
+	for (way = 0; way < SESSFILE_WAYS; way++) {
+		struct sessfile_slot *slot = get_slot(sf, b, way);
+
+		if (slot->size && (!slot_valid(slot) || slot->expires <= now))
+			slot->size = 0;
+	}
+}
+
+/**
+ * sessfile_get:
+ * @sf: session store
+ * @key: identifies the peer and config
+ * @data: receives a copy of the session data, free data->data with free()
+ *
+ * Returns: 0 if a valid session was found, else -1.
+ */
+int sessfile_get(sessfile_t *sf, const char *key, gnutls_datum_t *data)
+{
+	uint32_t b = hash_key(key) % NBUCKETS;
+	struct sessfile_bucket *bucket = &sf->buckets[b];
+	struct sessfile_slot *copy = NULL;
+	int way, tries, found = 0, stale = 0;
+
+	for (tries = 0; tries < 3 && !found; tries++) {
+		uint64_t lock = __atomic_load_n(&bucket->lock, __ATOMIC_ACQUIRE);
+
+		if (LOCK_SEQ(lock) & 1)
+			break; /* a writer is busy, don't wait for it */
+
+		for (way = 0; way < SESSFILE_WAYS; way++) {
+			struct sessfile_slot *slot = get_slot(sf, b, way);
+			uint32_t size = slot->size;
+
+			if (!size || size > MAX_DATA || strncmp(slot->key, key, SESSFILE_KEY_SIZE))
+				continue;
+
+			if (!copy && !(copy = malloc(SESSFILE_SLOT_SIZE)))
+				return -1;
+
+			memcpy(copy, slot, sizeof(*slot) + size);
+			copy->size = size;
+			found = 1;
+			break;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&bucket->lock, __ATOMIC_RELAXED) != lock)
+			found = 0; /* raced with a writer, try again */
+	}
+
+	if (found) {
+		if (!slot_valid(copy) || copy->expires <= time(NULL)) {
+			found = 0;
+			stale = 1;
+		} else if ((data->data = malloc(copy->size))) {
+			memcpy(data->data, copy->data, copy->size);
+			data->size = copy->size;
+		} else
+			found = 0;
+	}
+
+	xfree(copy);
+
+	if (stale) {
+		uint64_t lock = bucket_lock(bucket);
+
+		if (lock) {
+			bucket_clean(sf, b);
+			bucket_unlock(bucket, lock);
+		}
+	}
+
+	return found ? 0 : -1;
+}
+
+/**
+ * sessfile_put:
+ * @sf: session store
+ * @key: identifies the peer and config
+ * @data: session data
+ * @expires: when the session can't be resumed any more
+ *
+ * Add or replace the session for @key. If all slots of the bucket are taken,
+ * the one that expires first is overwritten.
+ *
+ * Returns: 0 on success, -1 if the key or data don't fit into a slot or the
+ * bucket is busy.
+ */
+int sessfile_put(sessfile_t *sf, const char *key, const gnutls_datum_t *data, time_t expires)
+{
+	uint32_t b = hash_key(key) % NBUCKETS;
+	uint64_t lock;
+	struct sessfile_bucket *bucket = &sf->buckets[b];
+	struct sessfile_slot *slot = NULL;
+	size_t keylen = strlen(key);
+	int way;
+
+	if (keylen >= SESSFILE_KEY_SIZE || !data->size || data->size > MAX_DATA)
+		return -1;
+
+	if (!(lock = bucket_lock(bucket)))
+		return -1;
+
+	bucket_clean(sf, b);
+
+	for (way = 0; way < SESSFILE_WAYS; way++) {
+		struct sessfile_slot *probe = get_slot(sf, b, way);
+
+		if (probe->size && !strcmp(probe->key, key)) {
+			slot = probe;
+			break;
+		}
+		if (!slot || !probe->size || (slot->size && probe->expires < slot->expires))
+			slot = probe;
+	}
+
+	/* invalidate first, so a crash in between leaves an empty slot */
+	slot->size = 0;
+	slot->expires = expires;
+	memset(slot->key, 0, SESSFILE_KEY_SIZE);
+	memcpy(slot->key, key, keylen);
+	memcpy(slot->data, data->data, data->size);
+	slot->size = data->size;
+	slot->checksum = checksum(slot);
+
+	bucket_unlock(bucket, lock);
+
+	return 0;
+}
+
+void sessfile_remove(sessfile_t *sf, const char *key)
+{
+	uint32_t b = hash_key(key) % NBUCKETS;
+	uint64_t lock;
+	struct sessfile_bucket *bucket = &sf->buckets[b];
+	int way;
+
+	if (!(lock = bucket_lock(bucket)))
+		return;
+
+	for (way = 0; way < SESSFILE_WAYS; way++) {
+		struct sessfile_slot *slot = get_slot(sf, b, way);
+
+		if (slot->size && !strncmp(slot->key, key, SESSFILE_KEY_SIZE))
+			slot->size = 0;
+	}
+
+	bucket_unlock(bucket, lock);
+}
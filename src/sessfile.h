@@ -0,0 +1,92 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#ifndef _VTLS_SESSFILE_H
+#define _VTLS_SESSFILE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <gnutls/gnutls.h>
+
+/*
+ * Shared TLS session store.
+ *
+ * A file or POSIX shared memory segment of fixed-size slots, mmap()ed by
+ * every process that uses it. A file keeps resumption data across restarts;
+ * a shm segment lets sibling processes resume each other's sessions. A key
+ * hashes to a bucket of SESSFILE_WAYS slots.
+ *
+ * Each bucket is guarded by a seqlock. Readers don't write to the shared
+ * memory, they retry or give up if the sequence changed while they copied
+ * a slot. Writers make the sequence odd with a CAS that also stamps the
+ * time into the same word. If a writer dies with the sequence odd, the next
+ * writer takes the bucket over after SESSFILE_STALE seconds; as the stamp
+ * is part of the word it CASes, only one writer can win the takeover. Each slot also carries a checksum that is
+ * written last, so a slot torn by a crash or a taken-over writer reads as
+ * empty. Expired and corrupt slots are cleared when their bucket is looked
+ * up.
+ *
+ * The store contains session secrets and is created with mode 0600.
+ * All integers are stored in host byte order (checked via 'byteorder').
+ */
+#define SESSFILE_MAGIC "VTLSSES3"
+#define SESSFILE_BYTEORDER 0x01020304
+#define SESSFILE_SLOTS 1024
+#define SESSFILE_WAYS 4
+#define SESSFILE_SLOT_SIZE 16384
+#define SESSFILE_KEY_SIZE 128
+#define SESSFILE_STALE 2
+
+struct sessfile_header {
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t nslots;
+	uint32_t slot_size;
+	uint32_t slots_offset; /* page aligned, the buckets follow this header */
+};
+
+struct sessfile_bucket {
+	uint64_t lock; /* sequence in the low 32 bits, odd while a writer is active;
+		the time the writer took the bucket in the high 32 bits */
+	char pad[56]; /* one bucket per cache line */
+};
+
+struct sessfile_slot {
+	uint32_t checksum; /* over everything after this field up to data[size] */
+	uint32_t size; /* size of data, 0 = empty slot */
+	int64_t expires;
+	char key[SESSFILE_KEY_SIZE];
+	unsigned char data[];
+};
+
+typedef struct sessfile_st sessfile_t;
+
+sessfile_t *sessfile_open(const char *fname);
+sessfile_t *sessfile_open_shm(const char *name);
+void sessfile_close(sessfile_t *sf);
+int sessfile_get(sessfile_t *sf, const char *key, gnutls_datum_t *data);
+int sessfile_put(sessfile_t *sf, const char *key, const gnutls_datum_t *data, time_t expires);
+void sessfile_remove(sessfile_t *sf, const char *key);
+
+#endif /* _VTLS_SESSFILE_H */
@@ -0,0 +1,185 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define MASK (TIMERWHEEL_SLOTS - 1)
+#define SHIFT(level) ((level) * TIMERWHEEL_BITS)
+#define RANGE ((uint64_t) 1 << SHIFT(TIMERWHEEL_LEVELS)) /* ticks covered by the wheel */
+
+void timerwheel_init(timerwheel_t *wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->clk = now;
+}
+
+static void insert(timerwheel_t *wheel, wheel_timer_t *timer)
+{
+	uint64_t expires = timer->expires, delta;
+	wheel_timer_t **slot;
+	int level;
+
+	if (expires < wheel->clk)
+		expires = wheel->clk; /* fire with the next tick */
+
+	if ((delta = expires - wheel->clk) >= RANGE)
+		expires = wheel->clk + RANGE - 1; /* parked, re-filed on cascade */
+
+	for (level = 0; level < TIMERWHEEL_LEVELS - 1; level++) {
+		if (delta < ((uint64_t) 1 << SHIFT(level + 1)))
+			break;
+	}
+
+	slot = &wheel->slots[level][(expires >> SHIFT(level)) & MASK];
+	if ((timer->next = *slot))
+		timer->next->pprev = &timer->next;
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+void timerwheel_add(timerwheel_t *wheel, wheel_timer_t *timer, uint64_t expires, uint64_t now)
+{
+	if (timer->pprev)
+		timerwheel_del(wheel, timer);
+
+	/* an empty wheel skips the ticks it missed */
+	if (!wheel->count && now > wheel->clk)
+		wheel->clk = now;
+
+	timer->expires = expires;
+	insert(wheel, timer);
+	wheel->count++;
+}
+
+void timerwheel_del(timerwheel_t *wheel, wheel_timer_t *timer)
+{
+	if (!timer->pprev)
+		return;
+
+	if ((*timer->pprev = timer->next))
+		timer->next->pprev = timer->pprev;
+	timer->pprev = NULL;
+	timer->next = NULL;
+	wheel->count--;
+}
+
+/* move the timers of a slot one level down, returns the slot index */
+static int cascade(timerwheel_t *wheel, int level)
+{
+	int index = (wheel->clk >> SHIFT(level)) & MASK;
+	wheel_timer_t *timer = wheel->slots[level][index], *next;
+
+	wheel->slots[level][index] = NULL;
+	for (; timer; timer = next) {
+		next = timer->next;
+		insert(wheel, timer);
+	}
+
+	return index;
+}
+
+/*
+ * Advance the wheel to now and return the expired timers, linked by their
+ * next pointers. They are disarmed and may be re-added right away.
+ */
+wheel_timer_t *timerwheel_expire(timerwheel_t *wheel, uint64_t now)
+{
+	wheel_timer_t *expired = NULL, *timer, *next;
+
+	if (!wheel->count) {
+		if (now >= wheel->clk)
+			wheel->clk = now + 1;
+		return NULL;
+	}
+
+	for (; wheel->clk <= now; wheel->clk++) {
+		int index = wheel->clk & MASK, level;
+
+		for (level = 1; !index && level < TIMERWHEEL_LEVELS; level++)
+			index = cascade(wheel, level);
+
+		timer = wheel->slots[0][wheel->clk & MASK];
+		wheel->slots[0][wheel->clk & MASK] = NULL;
+
+		for (; timer; timer = next) {
+			next = timer->next;
+			timer->pprev = NULL;
+			timer->next = expired;
+			expired = timer;
+			wheel->count--;
+		}
+
+		if (!wheel->count) {
+			wheel->clk = now + 1;
+			break;
+		}
+	}
+
+	return expired;
+}
+
+/*
+ * Returns the ms from now until timerwheel_expire() has work to do, -1 if
+ * no timer is armed. That may be a cascade instead of an expiry, so a long
+ * timeout wakes up a few times before it fires.
+ */
+int64_t timerwheel_next(timerwheel_t *wheel, uint64_t now)
+{
+	uint64_t next = UINT64_MAX;
+	int level, it;
+
+	if (!wheel->count)
+		return -1;
+
+	for (it = 0; it < TIMERWHEEL_SLOTS; it++) {
+		if (wheel->slots[0][(wheel->clk + it) & MASK]) {
+			next = wheel->clk + it;
+			break;
+		}
+	}
+
+	for (level = 1; level < TIMERWHEEL_LEVELS; level++) {
+		uint64_t base = wheel->clk >> SHIFT(level), cascade_at;
+
+		/* slot base + it cascades at tick (base + it) << SHIFT(level), unless that has passed */
+		for (it = 0; it <= TIMERWHEEL_SLOTS; it++) {
+			if ((cascade_at = (base + it) << SHIFT(level)) < wheel->clk)
+				continue;
+
+			if (wheel->slots[level][(base + it) & MASK]) {
+				if (cascade_at < next)
+					next = cascade_at;
+				break;
+			}
+		}
+	}
+
+	return next > now ? (int64_t) (next - now) : 0;
+}
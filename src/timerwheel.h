@@ -0,0 +1,67 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#ifndef _VTLS_TIMERWHEEL_H
+#define _VTLS_TIMERWHEEL_H
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel with 1 ms ticks.
+ *
+ * Four levels of 64 slots cover about 4.6 hours; later deadlines are parked
+ * in the last level and re-filed when it cascades. Adding and deleting a
+ * timer is O(1). Timers are embedded into the caller's structures.
+ */
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_LEVELS 4
+
+typedef struct wheel_timer_st wheel_timer_t;
+
+struct wheel_timer_st {
+	wheel_timer_t *next;
+	wheel_timer_t **pprev; /* NULL if not armed */
+	uint64_t expires; /* ms */
+	void *data; /* owner of the timer */
+};
+
+typedef struct {
+	wheel_timer_t *slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+	uint64_t clk; /* next tick to process */
+	int count;
+} timerwheel_t;
+
+void timerwheel_init(timerwheel_t *wheel, uint64_t now);
+void timerwheel_add(timerwheel_t *wheel, wheel_timer_t *timer, uint64_t expires, uint64_t now);
+void timerwheel_del(timerwheel_t *wheel, wheel_timer_t *timer);
+wheel_timer_t *timerwheel_expire(timerwheel_t *wheel, uint64_t now);
+int64_t timerwheel_next(timerwheel_t *wheel, uint64_t now);
+
+static inline int timerwheel_armed(const wheel_timer_t *timer)
+{
+	return timer->pprev != NULL;
+}
+
+#endif /* _VTLS_TIMERWHEEL_H */
@@ -0,0 +1,1049 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_IO_URING
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <vtls.h>
+
+#include "common.h"
+#include "backend.h"
+#include "uring.h"
+
+static unsigned _nbufs; /* receive buffers per ring, 0 = reactors use epoll */
+
+/* called from vtls_init() with VTLS_CFG_IO_URING */
+void uring_configure(int nbufs)
+{
+	unsigned n = 1;
+
+	if (nbufs <= 0) {
+		_nbufs = 0;
+		return;
+	}
+
+	/* the kernel wants a power of two, buffer ids are 16 bit */
+	while (n * 2 <= (unsigned) nbufs && n < 32768)
+		n *= 2;
+
+	_nbufs = n;
+}
+
+#ifdef HAVE_IO_URING
+
+/*
+ * Receiving: a multishot recv per connection picks buffers from a ring-wide
+ * pool that is registered with the kernel as a buffer ring. Received buffers
+ * are chained to their connection and go back to the pool once uring_pull()
+ * has copied them out. A connection whose receive ended because the pool
+ * ran dry is re-armed when buffers come back. So that one peer whose data
+ * isn't pulled can't hold the pool, a connection with more than rx_max
+ * bytes has its receive cancelled and its buffers copied out and returned;
+ * uring_pull() re-arms it once it is down to half of that. A multishot
+ * receive can take many buffers within one wait, so the copy is what
+ * bounds the pool share, the cancel bounds the memory.
+ *
+ * Sending: uring_push() copies into a chain of chunks and returns. Before
+ * each wait, every connection with queued data gets one sendmsg covering
+ * its chunks; so many small pushes of a run go out with one operation.
+ * Beyond TX_MAX queued bytes, uring_push() returns EAGAIN and the owner
+ * gets VTLS_EVENT_WRITABLE when the queue is half empty again. Detaching
+ * doesn't wait for the peer to take what is queued: a send waiting for
+ * socket space is cancelled, and the rest goes out with write() ahead of
+ * the next push of the detached connection.
+ *
+ * Only the reactor thread submits and reaps. The mutex is for handshake
+ * steps on the offload pool that push and pull meanwhile.
+ */
+
+#define SQ_ENTRIES 256
+#define CQ_ENTRIES 4096
+#define RX_BUFSIZE 16384 /* the payload of a full TLS record */
+#define RX_NONE 0xffff
+#define RX_MAX (256 * 1024) /* received bytes per connection before its receive pauses, at most a quarter of the pool */
+#define TX_MAX (256 * 1024) /* queued bytes per connection before pushing returns EAGAIN */
+#define TX_CHUNK 16384
+#define TX_IOV 16
+#define BGID 0
+
+/* operation kinds, in the low bits of the user_data of SQEs and CQEs */
+enum {
+	OP_EPOLL, /* the reactor's epoll fd became readable, no connection */
+	OP_RECV,
+	OP_SEND,
+	OP_CANCEL
+};
+#define OP_MASK 3
+
+struct tx_chunk {
+	struct tx_chunk *next;
+	size_t len;
+	size_t size;
+	char data[];
+};
+
+struct rx_buf {
+	uint32_t len; /* received bytes */
+	uint16_t next; /* next buffer of the same connection */
+};
+
+struct uring_conn_st {
+	uring_t *ring; /* NULL once detached */
+	void *owner; /* reported by uring_next_event() */
+	uring_conn_t *next_flush; /* on ring->flush: something to submit */
+	uring_conn_t *next_event; /* on ring->events */
+	struct tx_chunk *tx, *tx_tail; /* queued for sending */
+	size_t tx_off; /* sent bytes of the first chunk */
+	size_t tx_len; /* queued bytes */
+	size_t tx_inflight; /* bytes of the outstanding sendmsg */
+	struct msghdr msg;
+	struct iovec iov[TX_IOV];
+	char *carry; /* received data taken over from a ring by uring_detach() */
+	size_t carry_len;
+	size_t carry_off;
+	size_t rx_len; /* bytes in received buffers */
+	uint32_t rx_off; /* consumed bytes of the first buffer */
+	uint16_t rx_head, rx_tail; /* buffer ids */
+	int fd;
+	int error; /* errno of a failed receive or send */
+	int events; /* VTLS_EVENT_* for the owner */
+	int inflight; /* operations without their final completion */
+	char recv_armed;
+	char recv_stop; /* being detached, don't receive again */
+	char recv_paused; /* holds rx_max bytes, don't receive until pulled */
+	char eof;
+	char blocked; /* uring_push() returned EAGAIN */
+	char drain; /* uring_sent_all() waits for the queue to empty */
+	char on_flush;
+	char on_event;
+};
+
+struct uring_st {
+	pthread_mutex_t mutex; /* protects the connections and the lists */
+	uring_conn_t *flush; /* connections with something to submit */
+	uring_conn_t *events; /* connections with events for their owner */
+	unsigned *sq_head, *sq_tail, *sq_array;
+	unsigned sq_mask, sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	void *ring_ptr; /* SQ and CQ ring, mapped at once */
+	size_t ring_size;
+	size_t sqes_size;
+	struct io_uring_buf_ring *br; /* receive buffers lent to the kernel */
+	size_t br_size;
+	char *bufs;
+	size_t bufs_size;
+	struct rx_buf *rx; /* per buffer id */
+	unsigned nbufs;
+	unsigned nfree; /* buffers the kernel can pick */
+	size_t rx_max; /* received bytes a connection may hold */
+	uint16_t br_tail;
+	int fd;
+	int epfd;
+	char epoll_armed;
+	char epoll_ready;
+};
+
+static int enter(uring_t *r, int wait, int timeout_ms)
+{
+	struct __kernel_timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L };
+	struct io_uring_getevents_arg arg = { .ts = (uintptr_t) &ts };
+	unsigned submit = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned flags = 0;
+
+	if (wait)
+		flags = IORING_ENTER_GETEVENTS | (timeout_ms >= 0 ? IORING_ENTER_EXT_ARG : 0);
+	else if (!submit)
+		return 0;
+
+	if (syscall(__NR_io_uring_enter, r->fd, submit, wait ? 1 : 0, flags,
+		flags & IORING_ENTER_EXT_ARG ? &arg : NULL, flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0) < 0
+		&& errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		return -1;
+
+	return 0;
+}
+
+static struct io_uring_sqe *get_sqe(uring_t *r)
+{
+	unsigned tail = *r->sq_tail, idx = tail & r->sq_mask;
+	struct io_uring_sqe *sqe;
+
+	/* full: hand the queued ones to the kernel first */
+	while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+		enter(r, 0, 0);
+
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+
+	/* without SQPOLL, the kernel looks at the ring in io_uring_enter() only */
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+static void give_buffer(uring_t *r, unsigned bid)
+{
+	struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (r->nbufs - 1)];
+
+	buf->addr = (uintptr_t) (r->bufs + (size_t) bid * RX_BUFSIZE);
+	buf->len = RX_BUFSIZE;
+	buf->bid = (uint16_t) bid;
+	__atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+	r->nfree++;
+}
+
+static void queue_flush(uring_t *r, uring_conn_t *c)
+{
+	if (!c->on_flush) {
+		c->on_flush = 1;
+		c->next_flush = r->flush;
+		r->flush = c;
+	}
+}
+
+static void post(uring_t *r, uring_conn_t *c, int events)
+{
+	c->events |= events;
+	if (!c->on_event) {
+		c->on_event = 1;
+		c->next_event = r->events;
+		r->events = c;
+	}
+}
+
+static void arm_recv(uring_t *r, uring_conn_t *c)
+{
+	struct io_uring_sqe *sqe = get_sqe(r);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BGID;
+	sqe->user_data = (uintptr_t) c | OP_RECV;
+	c->recv_armed = 1;
+	c->inflight++;
+}
+
+/* one sendmsg for what is queued, the chunks stay until it completes */
+static void send_queued(uring_t *r, uring_conn_t *c)
+{
+	struct io_uring_sqe *sqe;
+	struct tx_chunk *chunk;
+	size_t off = c->tx_off;
+	int n;
+
+	for (n = 0, chunk = c->tx; chunk && n < TX_IOV; chunk = chunk->next, off = 0, n++) {
+		c->iov[n].iov_base = chunk->data + off;
+		c->iov[n].iov_len = chunk->len - off;
+		c->tx_inflight += chunk->len - off;
+	}
+	c->msg.msg_iov = c->iov;
+	c->msg.msg_iovlen = n;
+
+	sqe = get_sqe(r);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = c->fd;
+	sqe->addr = (uintptr_t) &c->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uintptr_t) c | OP_SEND;
+	c->inflight++;
+}
+
+static void cancel(uring_t *r, uring_conn_t *c, int op)
+{
+	struct io_uring_sqe *sqe = get_sqe(r);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t) c | op;
+	sqe->user_data = (uintptr_t) c | OP_CANCEL;
+	c->inflight++;
+}
+
+/* submit what the connections queued since the last run */
+static void flush(uring_t *r)
+{
+	uring_conn_t *c, *next, *starved = NULL;
+
+	for (c = r->flush, r->flush = NULL; c; c = next) {
+		next = c->next_flush;
+		c->on_flush = 0;
+
+		if (!c->recv_armed && !c->recv_stop && !c->recv_paused && !c->eof && !c->error) {
+			if (r->nfree)
+				arm_recv(r, c);
+			else {
+				/* try again when buffers are back */
+				c->on_flush = 1;
+				c->next_flush = starved;
+				starved = c;
+			}
+		}
+
+		if (c->tx_len && !c->tx_inflight && !c->error)
+			send_queued(r, c);
+	}
+
+	r->flush = starved;
+}
+
+/* move received data to the connection's carry, giving the buffers back */
+static int spill(uring_t *r, uring_conn_t *c)
+{
+	size_t len = c->carry_len - c->carry_off;
+	char *carry;
+
+	if (!(carry = malloc(len + c->rx_len)))
+		return -1;
+
+	if (len)
+		memcpy(carry, c->carry + c->carry_off, len);
+
+	while (c->rx_head != RX_NONE) {
+		uint16_t bid = c->rx_head;
+		size_t n = r->rx[bid].len - c->rx_off;
+
+		memcpy(carry + len, r->bufs + (size_t) bid * RX_BUFSIZE + c->rx_off, n);
+		len += n;
+		c->rx_off = 0;
+		c->rx_head = r->rx[bid].next;
+		give_buffer(r, bid);
+	}
+
+	xfree(c->carry);
+	c->carry = carry;
+	c->carry_len = len;
+	c->carry_off = 0;
+	c->rx_tail = RX_NONE;
+	c->rx_len = 0;
+
+	return 0;
+}
+
+static void received(uring_t *r, uring_conn_t *c, int res, unsigned flags)
+{
+	if (!(flags & IORING_CQE_F_MORE)) {
+		c->recv_armed = 0;
+		c->inflight--;
+	}
+
+	if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+		uint16_t bid = (uint16_t) (flags >> IORING_CQE_BUFFER_SHIFT);
+
+		r->nfree--;
+		r->rx[bid].len = (uint32_t) res;
+		r->rx[bid].next = RX_NONE;
+		if (c->rx_tail == RX_NONE)
+			c->rx_head = bid;
+		else
+			r->rx[c->rx_tail].next = bid;
+		c->rx_tail = bid;
+		c->rx_len += res;
+		post(r, c, VTLS_EVENT_READABLE);
+
+		if (c->carry_len - c->carry_off + c->rx_len >= r->rx_max) {
+			if (!c->recv_paused) {
+				c->recv_paused = 1;
+				if (c->recv_armed)
+					cancel(r, c, OP_RECV);
+			}
+			spill(r, c);
+		}
+	} else if (res == 0) {
+		c->eof = 1;
+		post(r, c, VTLS_EVENT_READABLE | VTLS_EVENT_CLOSED);
+	} else if (res != -ENOBUFS && res != -ECANCELED) {
+		c->error = -res;
+		post(r, c, VTLS_EVENT_READABLE | VTLS_EVENT_CLOSED | (c->blocked ? VTLS_EVENT_WRITABLE : 0));
+	}
+
+	if (!c->recv_armed && !c->recv_stop && !c->recv_paused && !c->eof && !c->error)
+		queue_flush(r, c);
+}
+
+static void sent(uring_t *r, uring_conn_t *c, int res)
+{
+	struct tx_chunk *chunk;
+	size_t left;
+
+	c->inflight--;
+	c->tx_inflight = 0;
+
+	/* cancelled by uring_detach(), a send waiting for space has sent nothing */
+	if (res == -ECANCELED && c->recv_stop)
+		return;
+
+	if (res < 0) {
+		if (!c->error)
+			c->error = -res;
+		post(r, c, VTLS_EVENT_READABLE | VTLS_EVENT_CLOSED | (c->blocked ? VTLS_EVENT_WRITABLE : 0));
+		return;
+	}
+
+	/* a short send leaves the rest queued */
+	for (c->tx_len -= res; res > 0; res -= (int) left) {
+		chunk = c->tx;
+		if ((size_t) res < (left = chunk->len - c->tx_off)) {
+			c->tx_off += res;
+			break;
+		}
+		c->tx = chunk->next;
+		c->tx_off = 0;
+		xfree(chunk);
+	}
+	if (!c->tx)
+		c->tx_tail = NULL;
+
+	if (c->tx_len && !c->error)
+		queue_flush(r, c);
+
+	if ((c->blocked && c->tx_len <= TX_MAX / 2) || (c->drain && !c->tx_len)) {
+		c->blocked = c->drain = 0;
+		post(r, c, VTLS_EVENT_WRITABLE);
+	}
+}
+
+static void reap(uring_t *r)
+{
+	unsigned head = *r->cq_head, tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+		uring_conn_t *c = (uring_conn_t *) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+
+		switch (cqe->user_data & OP_MASK) {
+		case OP_EPOLL:
+			r->epoll_armed = 0;
+			r->epoll_ready = 1;
+			break;
+		case OP_RECV:
+			received(r, c, cqe->res, cqe->flags);
+			break;
+		case OP_SEND:
+			sent(r, c, cqe->res);
+			break;
+		case OP_CANCEL:
+			c->inflight--;
+			break;
+		}
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void free_tx(uring_conn_t *c)
+{
+	struct tx_chunk *chunk;
+
+	while ((chunk = c->tx)) {
+		c->tx = chunk->next;
+		xfree(chunk);
+	}
+	c->tx_tail = NULL;
+	c->tx_off = c->tx_len = 0;
+}
+
+/**
+ * uring_init:
+ * @ring: the new ring
+ * @epfd: epoll fd of the reactor, uring_run() reports when it is readable
+ *
+ * Needs Linux 6.0 for multishot receive and a VTLS_CFG_IO_URING buffer
+ * count given to vtls_init().
+ *
+ * Returns: 0, CURLE_NOT_BUILT_IN if not configured or CURLE_FAILED_INIT.
+ */
+int uring_init(uring_t **ring, int epfd)
+{
+	const unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	uring_t *r;
+	unsigned it;
+
+	*ring = NULL;
+
+	if (!_nbufs)
+		return CURLE_NOT_BUILT_IN;
+
+	if (!(r = calloc(1, sizeof(*r))))
+		return CURLE_OUT_OF_MEMORY;
+
+	pthread_mutex_init(&r->mutex, NULL);
+	r->fd = -1;
+	r->epfd = epfd;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = CQ_ENTRIES;
+	if ((r->fd = (int) syscall(__NR_io_uring_setup, SQ_ENTRIES, &p)) < 0 || (p.features & features) != features)
+		goto fail;
+
+	r->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (r->ring_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		r->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if ((r->ring_ptr = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_SQ_RING)) == MAP_FAILED)
+	{
+		r->ring_ptr = NULL;
+		goto fail;
+	}
+	if ((r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		r->fd, IORING_OFF_SQES)) == MAP_FAILED)
+	{
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	r->sq_head = (unsigned *) ((char *) r->ring_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned *) ((char *) r->ring_ptr + p.sq_off.tail);
+	r->sq_array = (unsigned *) ((char *) r->ring_ptr + p.sq_off.array);
+	r->sq_mask = *(unsigned *) ((char *) r->ring_ptr + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->cq_head = (unsigned *) ((char *) r->ring_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *) ((char *) r->ring_ptr + p.cq_off.tail);
+	r->cq_mask = *(unsigned *) ((char *) r->ring_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) ((char *) r->ring_ptr + p.cq_off.cqes);
+
+	r->nbufs = _nbufs;
+	r->br_size = r->nbufs * sizeof(struct io_uring_buf);
+	r->bufs_size = (size_t) r->nbufs * RX_BUFSIZE;
+	if ((r->rx_max = r->bufs_size / 4) > RX_MAX)
+		r->rx_max = RX_MAX;
+	else if (r->rx_max < RX_BUFSIZE)
+		r->rx_max = RX_BUFSIZE;
+
+	if ((r->br = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		r->br = NULL;
+		goto fail;
+	}
+	if ((r->bufs = mmap(NULL, r->bufs_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		r->bufs = NULL;
+		goto fail;
+	}
+	if (!(r->rx = calloc(r->nbufs, sizeof(*r->rx))))
+		goto fail;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) r->br;
+	reg.ring_entries = r->nbufs;
+	reg.bgid = BGID;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+
+	for (it = 0; it < r->nbufs; it++)
+		give_buffer(r, it);
+
+	*ring = r;
+	return 0;
+
+fail:
+	uring_deinit(r);
+	return CURLE_FAILED_INIT;
+}
+
+/* connections should be detached before */
+void uring_deinit(uring_t *r)
+{
+	if (!r)
+		return;
+
+	if (r->fd >= 0)
+		close(r->fd);
+	if (r->ring_ptr)
+		munmap(r->ring_ptr, r->ring_size);
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->br)
+		munmap(r->br, r->br_size);
+	if (r->bufs)
+		munmap(r->bufs, r->bufs_size);
+	xfree(r->rx);
+	pthread_mutex_destroy(&r->mutex);
+	xfree(r);
+}
+
+/**
+ * uring_run:
+ * @ring: ring
+ * @timeout_ms: how long to wait for a completion, -1 = forever
+ *
+ * Submit what is queued and wait once. Doesn't wait if there are events
+ * that uring_next_event() didn't return yet.
+ *
+ * Returns: 1 if the epoll fd is readable, else 0, -1 on error.
+ */
+int uring_run(uring_t *r, int timeout_ms)
+{
+	int ready;
+
+	pthread_mutex_lock(&r->mutex);
+
+	if (!r->epoll_armed) {
+		struct io_uring_sqe *sqe = get_sqe(r);
+
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = r->epfd;
+		sqe->poll32_events = POLLIN;
+		sqe->user_data = OP_EPOLL;
+		r->epoll_armed = 1;
+	}
+
+	flush(r);
+
+	if (r->events || r->epoll_ready)
+		timeout_ms = 0;
+
+	pthread_mutex_unlock(&r->mutex);
+
+	if (enter(r, timeout_ms != 0, timeout_ms))
+		return -1;
+
+	pthread_mutex_lock(&r->mutex);
+	reap(r);
+	ready = r->epoll_ready;
+	r->epoll_ready = 0;
+	pthread_mutex_unlock(&r->mutex);
+
+	return ready;
+}
+
+/* returns the owner of a connection with events, or NULL */
+void *uring_next_event(uring_t *r, int *events)
+{
+	uring_conn_t *c;
+	void *owner = NULL;
+
+	pthread_mutex_lock(&r->mutex);
+	if ((c = r->events)) {
+		r->events = c->next_event;
+		c->on_event = 0;
+		*events = c->events;
+		c->events = 0;
+		owner = c->owner;
+	}
+	pthread_mutex_unlock(&r->mutex);
+
+	return owner;
+}
+
+/**
+ * uring_attach:
+ * @ring: ring
+ * @sess: session
+ * @fd: its socket
+ * @owner: returned with the session's events by uring_next_event()
+ *
+ * Route the socket I/O of @sess through @ring, receiving starts with the
+ * next uring_run(). Data that a detach left over is read first.
+ *
+ * Returns: 0 or a CURLcode.
+ */
+int uring_attach(uring_t *r, vtls_session_t *sess, int fd, void *owner)
+{
+	uring_conn_t *c = sess->uring_data;
+
+	if (c && c->ring)
+		return CURLE_BAD_FUNCTION_ARGUMENT;
+
+	if (!c) {
+		if (!(c = calloc(1, sizeof(*c))))
+			return CURLE_OUT_OF_MEMORY;
+		c->rx_head = c->rx_tail = RX_NONE;
+		sess->uring_data = c;
+	}
+
+	c->fd = fd;
+	c->owner = owner;
+	c->eof = 0;
+	c->error = 0;
+
+	pthread_mutex_lock(&r->mutex);
+	c->ring = r;
+	queue_flush(r, c);
+	pthread_mutex_unlock(&r->mutex);
+
+	return 0;
+}
+
+/**
+ * uring_detach:
+ * @sess: session
+ *
+ * Stop receiving and sending, so the socket can be used directly or by
+ * another ring. This only waits for the kernel to confirm the cancellations,
+ * not for the peer. Received data that wasn't pulled yet stays with the
+ * session and is pulled first; queued data that wasn't sent yet stays too
+ * and goes out ahead of the next push.
+ */
+void uring_detach(vtls_session_t *sess)
+{
+	uring_conn_t *c = sess->uring_data, **cp;
+	uring_t *r;
+
+	if (!c || !(r = c->ring))
+		return;
+
+	pthread_mutex_lock(&r->mutex);
+
+	c->recv_stop = 1;
+	if (c->recv_armed)
+		cancel(r, c, OP_RECV);
+	if (c->tx_inflight)
+		cancel(r, c, OP_SEND);
+
+	while (c->inflight) {
+		pthread_mutex_unlock(&r->mutex);
+		enter(r, 1, -1);
+		pthread_mutex_lock(&r->mutex);
+		reap(r);
+	}
+
+	/* received buffers go back to the pool, their data to the session */
+	if (c->rx_len && spill(r, c)) {
+		while (c->rx_head != RX_NONE) {
+			uint16_t bid = c->rx_head;
+
+			c->rx_head = r->rx[bid].next;
+			give_buffer(r, bid);
+		}
+		c->rx_tail = RX_NONE;
+		c->rx_len = c->rx_off = 0;
+	}
+
+	for (cp = &r->flush; *cp; cp = &(*cp)->next_flush) {
+		if (*cp == c) {
+			*cp = c->next_flush;
+			break;
+		}
+	}
+	for (cp = &r->events; *cp; cp = &(*cp)->next_event) {
+		if (*cp == c) {
+			*cp = c->next_event;
+			break;
+		}
+	}
+
+	c->on_flush = c->on_event = 0;
+	c->events = 0;
+	c->recv_stop = c->recv_paused = c->blocked = c->drain = 0;
+	c->owner = NULL;
+	c->ring = NULL;
+
+	pthread_mutex_unlock(&r->mutex);
+}
+
+/* free the detached connection of @sess */
+void uring_free(vtls_session_t *sess)
+{
+	uring_conn_t *c = sess->uring_data;
+
+	if (!c || c->ring)
+		return;
+
+	free_tx(c);
+	xfree(c->carry);
+	xfree(c);
+	sess->uring_data = NULL;
+}
+
+/* GnuTLS vector push function of a session with a connection, like writev() */
+ssize_t uring_push(uring_conn_t *c, const struct iovec *iov, int iovcnt)
+{
+	uring_t *r = c->ring;
+	struct tx_chunk *chunk;
+	size_t len = 0;
+	int err = 0, it;
+
+	if (!r) {
+		/* what a ring left unsent goes first */
+		while ((chunk = c->tx)) {
+			ssize_t n = write(c->fd, chunk->data + c->tx_off, chunk->len - c->tx_off);
+
+			if (n < 0)
+				return -1;
+			c->tx_len -= n;
+			if ((c->tx_off += n) == chunk->len) {
+				c->tx = chunk->next;
+				c->tx_off = 0;
+				xfree(chunk);
+			}
+		}
+		c->tx_tail = NULL;
+
+		return writev(c->fd, iov, iovcnt);
+	}
+
+	for (it = 0; it < iovcnt; it++)
+		len += iov[it].iov_len;
+
+	pthread_mutex_lock(&r->mutex);
+
+	if (c->error)
+		err = c->error;
+	else if (c->tx_len >= TX_MAX) {
+		c->blocked = 1;
+		err = EAGAIN;
+	} else if (!(chunk = c->tx_tail) || chunk->size - chunk->len < len) {
+		/* a whole flight or record batch goes into one chunk */
+		if ((chunk = malloc(sizeof(*chunk) + (len > TX_CHUNK ? len : TX_CHUNK)))) {
+			chunk->next = NULL;
+			chunk->size = len > TX_CHUNK ? len : TX_CHUNK;
+			chunk->len = 0;
+			if (c->tx_tail)
+				c->tx_tail->next = chunk;
+			else
+				c->tx = chunk;
+			c->tx_tail = chunk;
+		} else
+			err = ENOMEM;
+	}
+
+	if (!err) {
+		for (it = 0; it < iovcnt; it++) {
+			memcpy(chunk->data + chunk->len, iov[it].iov_base, iov[it].iov_len);
+			chunk->len += iov[it].iov_len;
+		}
+		c->tx_len += len;
+		queue_flush(r, c);
+	}
+
+	pthread_mutex_unlock(&r->mutex);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return len;
+}
+
+/* GnuTLS pull function of a session with a connection, like read() */
+ssize_t uring_pull(uring_conn_t *c, void *buf, size_t len)
+{
+	uring_t *r = c->ring;
+	size_t n = 0;
+	ssize_t ret;
+	int err = 0;
+
+	if (r)
+		pthread_mutex_lock(&r->mutex);
+
+	if (c->carry) {
+		if ((n = c->carry_len - c->carry_off) > len)
+			n = len;
+		memcpy(buf, c->carry + c->carry_off, n);
+		if ((c->carry_off += n) == c->carry_len) {
+			xfree(c->carry);
+			c->carry_len = c->carry_off = 0;
+		}
+	}
+
+	if (!r)
+		return n ? (ssize_t) n : read(c->fd, buf, len);
+
+	while (n < len && c->rx_head != RX_NONE) {
+		uint16_t bid = c->rx_head;
+		size_t k = r->rx[bid].len - c->rx_off;
+
+		if (k > len - n)
+			k = len - n;
+		memcpy((char *) buf + n, r->bufs + (size_t) bid * RX_BUFSIZE + c->rx_off, k);
+		n += k;
+		c->rx_len -= k;
+
+		if ((c->rx_off += k) == r->rx[bid].len) {
+			c->rx_off = 0;
+			if ((c->rx_head = r->rx[bid].next) == RX_NONE)
+				c->rx_tail = RX_NONE;
+			give_buffer(r, bid);
+		}
+	}
+
+	if (c->recv_paused && c->carry_len - c->carry_off + c->rx_len <= r->rx_max / 2) {
+		c->recv_paused = 0;
+		if (!c->recv_armed)
+			queue_flush(r, c);
+	}
+
+	if (n)
+		ret = n;
+	else if (c->error) {
+		err = c->error;
+		ret = -1;
+	} else if (c->eof)
+		ret = 0;
+	else {
+		err = EAGAIN;
+		ret = -1;
+	}
+
+	pthread_mutex_unlock(&r->mutex);
+
+	if (err)
+		errno = err;
+
+	return ret;
+}
+
+/* received bytes not pulled yet */
+size_t uring_buffered(uring_conn_t *c)
+{
+	size_t n;
+
+	if (c->ring)
+		pthread_mutex_lock(&c->ring->mutex);
+	n = c->carry_len - c->carry_off + c->rx_len;
+	if (c->ring)
+		pthread_mutex_unlock(&c->ring->mutex);
+
+	return n;
+}
+
+/*
+ * Returns 0 once the peer's socket took everything pushed, CURLE_AGAIN
+ * until then (the owner gets VTLS_EVENT_WRITABLE when the queue empties)
+ * or CURLE_SEND_ERROR.
+ */
+int uring_sent_all(uring_conn_t *c)
+{
+	int rc = 0;
+
+	if (c->ring) {
+		pthread_mutex_lock(&c->ring->mutex);
+		if (c->error)
+			rc = CURLE_SEND_ERROR;
+		else if (c->tx_len) {
+			c->drain = 1;
+			rc = CURLE_AGAIN;
+		}
+		pthread_mutex_unlock(&c->ring->mutex);
+	}
+
+	return rc;
+}
+
+/* uring_push() would take data (or report an error) */
+int uring_writable(uring_conn_t *c)
+{
+	int writable = 1;
+
+	if (c->ring) {
+		pthread_mutex_lock(&c->ring->mutex);
+		writable = c->error || c->tx_len < TX_MAX;
+		pthread_mutex_unlock(&c->ring->mutex);
+	}
+
+	return writable;
+}
+
+#else /* HAVE_IO_URING */
+
+int uring_init(uring_t **ring, int epfd)
+{
+	*ring = NULL;
+	return CURLE_NOT_BUILT_IN;
+}
+
+void uring_deinit(uring_t *ring)
+{
+}
+
+int uring_run(uring_t *ring, int timeout_ms)
+{
+	return -1;
+}
+
+void *uring_next_event(uring_t *ring, int *events)
+{
+	return NULL;
+}
+
+int uring_attach(uring_t *ring, vtls_session_t *sess, int fd, void *owner)
+{
+	return CURLE_NOT_BUILT_IN;
+}
+
+void uring_detach(vtls_session_t *sess)
+{
+}
+
+void uring_free(vtls_session_t *sess)
+{
+}
+
+ssize_t uring_push(uring_conn_t *conn, const struct iovec *iov, int iovcnt)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+ssize_t uring_pull(uring_conn_t *conn, void *buf, size_t len)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+size_t uring_buffered(uring_conn_t *conn)
+{
+	return 0;
+}
+
+int uring_sent_all(uring_conn_t *conn)
+{
+	return 0;
+}
+
+int uring_writable(uring_conn_t *conn)
+{
+	return 1;
+}
+
+#endif /* HAVE_IO_URING */
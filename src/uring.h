@@ -0,0 +1,58 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#ifndef _VTLS_URING_H
+#define _VTLS_URING_H
+
+/*
+ * io_uring transport for vtls_reactor.
+ *
+ * A reactor with a ring doesn't wait for readiness. Each of its sessions
+ * has a multishot receive armed that fills buffers from a pool registered
+ * with the kernel, and what GnuTLS pushes is queued and sent with one
+ * sendmsg per session and run. Submissions and completions of all sessions
+ * share one io_uring_enter() per vtls_reactor_run().
+ */
+typedef struct uring_st uring_t;
+typedef struct uring_conn_st uring_conn_t;
+
+struct iovec;
+
+void uring_configure(int nbufs);
+int uring_init(uring_t **ring, int epfd);
+void uring_deinit(uring_t *ring);
+int uring_run(uring_t *ring, int timeout_ms);
+void *uring_next_event(uring_t *ring, int *events);
+
+int uring_attach(uring_t *ring, vtls_session_t *sess, int fd, void *owner);
+void uring_detach(vtls_session_t *sess);
+void uring_free(vtls_session_t *sess);
+
+ssize_t uring_push(uring_conn_t *conn, const struct iovec *iov, int iovcnt);
+ssize_t uring_pull(uring_conn_t *conn, void *buf, size_t len);
+size_t uring_buffered(uring_conn_t *conn);
+int uring_sent_all(uring_conn_t *conn);
+int uring_writable(uring_conn_t *conn);
+
+#endif /* _VTLS_URING_H */
@@ -0,0 +1,196 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <gnutls/x509.h>
+
+#include "common.h"
+#include "verifycache.h"
+
+#define NSHARDS 16
+#define NSETS 64 /* per shard */
+#define NWAYS 4 /* slots per set */
+
+struct slot {
+	unsigned char key[VERIFYCACHE_KEY_SIZE];
+	time_t expires; /* 0 = empty */
+};
+
+/* aligned, so that threads working on different shards don't share cache lines */
+struct shard {
+	pthread_mutex_t mutex;
+	struct slot slots[NSETS][NWAYS];
+} __attribute__ ((aligned(64)));
+
+struct verifycache_st {
+	struct shard shards[NSHARDS];
+	int ttl;
+};
+
+verifycache_t *verifycache_init(int ttl)
+{
+	verifycache_t *cache;
+	int it;
+
+	if (posix_memalign((void **) &cache, 64, sizeof(*cache)))
+		return NULL;
+
+	memset(cache, 0, sizeof(*cache));
+	for (it = 0; it < NSHARDS; it++)
+		pthread_mutex_init(&cache->shards[it].mutex, NULL);
+	cache->ttl = ttl;
+
+	return cache;
+}
+
+void verifycache_deinit(verifycache_t *cache)
+{
+	int it;
+
+	if (!cache)
+		return;
+
+	for (it = 0; it < NSHARDS; it++)
+		pthread_mutex_destroy(&cache->shards[it].mutex);
+	xfree(cache);
+}
+
+/* compute the cache key for a chain as seen when connecting to hostname */
+int verifycache_key(const gnutls_datum_t *chain, unsigned int chain_size, const char *hostname, unsigned char *key)
+{
+	gnutls_hash_hd_t hd;
+	unsigned int it;
+
+	if (gnutls_hash_init(&hd, GNUTLS_DIG_SHA256) < 0)
+		return -1;
+
+	gnutls_hash(hd, hostname, strlen(hostname) + 1);
+	for (it = 0; it < chain_size; it++) {
+		uint32_t size = chain[it].size;
+
+		gnutls_hash(hd, &size, sizeof(size));
+		gnutls_hash(hd, chain[it].data, chain[it].size);
+	}
+
+	gnutls_hash_deinit(hd, key);
+
+	return 0;
+}
+
+static struct slot *get_set(verifycache_t *cache, const unsigned char *key, struct shard **shard)
+{
+	/* the key is a hash already, any of its bytes will do */
+	*shard = &cache->shards[key[0] % NSHARDS];
+	return (*shard)->slots[(key[1] | (key[2] << 8)) % NSETS];
+}
+
+/**
+ * verifycache_lookup:
+ * @cache: verify cache
+ * @key: key from verifycache_key()
+ *
+ * Returns: 1 if the chain has been verified before and the result is still
+ * valid, else 0.
+ */
+int verifycache_lookup(verifycache_t *cache, const unsigned char *key)
+{
+	struct shard *shard;
+	struct slot *set = get_set(cache, key, &shard);
+	time_t now = time(NULL);
+	int it, found = 0;
+
+	pthread_mutex_lock(&shard->mutex);
+	for (it = 0; it < NWAYS; it++) {
+		if (set[it].expires && !memcmp(set[it].key, key, VERIFYCACHE_KEY_SIZE)) {
+			if (set[it].expires > now)
+				found = 1;
+			else
+				set[it].expires = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&shard->mutex);
+
+	return found;
+}
+
+/**
+ * verifycache_store:
+ * @cache: verify cache
+ * @key: key from verifycache_key()
+ * @chain: the verified chain
+ * @chain_size: number of certificates in @chain
+ *
+ * Remember a successfully verified chain until the first of its certificates
+ * expires, but not longer than the cache's TTL. If the set for @key is full,
+ * the entry that expires first is replaced.
+ */
+void verifycache_store(verifycache_t *cache, const unsigned char *key, const gnutls_datum_t *chain, unsigned int chain_size)
+{
+	struct shard *shard;
+	struct slot *set = get_set(cache, key, &shard), *slot;
+	gnutls_x509_crt_t crt;
+	time_t expires = time(NULL) + cache->ttl;
+	unsigned int it;
+
+	if (gnutls_x509_crt_init(&crt) < 0)
+		return;
+
+	for (it = 0; it < chain_size; it++) {
+		time_t not_after;
+
+		if (gnutls_x509_crt_import(crt, &chain[it], GNUTLS_X509_FMT_DER) < 0
+			|| (not_after = gnutls_x509_crt_get_expiration_time(crt)) == (time_t) -1)
+		{
+			gnutls_x509_crt_deinit(crt);
+			return;
+		}
+
+		if (not_after < expires)
+			expires = not_after;
+	}
+	gnutls_x509_crt_deinit(crt);
+
+	pthread_mutex_lock(&shard->mutex);
+	for (slot = set, it = 0; it < NWAYS; it++) {
+		if (!memcmp(set[it].key, key, VERIFYCACHE_KEY_SIZE)) {
+			slot = &set[it];
+			break;
+		}
+		if (set[it].expires < slot->expires)
+			slot = &set[it];
+	}
+	memcpy(slot->key, key, VERIFYCACHE_KEY_SIZE);
+	slot->expires = expires;
+	pthread_mutex_unlock(&shard->mutex);
+}
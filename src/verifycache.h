@@ -0,0 +1,51 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+#ifndef _VTLS_VERIFYCACHE_H
+#define _VTLS_VERIFYCACHE_H
+
+#include <time.h>
+#include <gnutls/gnutls.h>
+
+/*
+ * Cache of successfully verified peer chains.
+ *
+ * The key is a SHA-256 over the hostname and the DER chain. A cache belongs
+ * to one set of credentials (and thereby one config), so results never leak
+ * between configs or survive a trust store reload. Entries expire at the
+ * earliest notAfter of the chain or after the configured TTL, whatever comes
+ * first. The cache is split into shards with their own lock, each holding a
+ * fixed number of set-associative slots, so memory is bounded.
+ */
+#define VERIFYCACHE_KEY_SIZE 32
+
+typedef struct verifycache_st verifycache_t;
+
+verifycache_t *verifycache_init(int ttl);
+void verifycache_deinit(verifycache_t *cache);
+int verifycache_key(const gnutls_datum_t *chain, unsigned int chain_size, const char *hostname, unsigned char *key);
+int verifycache_lookup(verifycache_t *cache, const unsigned char *key);
+void verifycache_store(verifycache_t *cache, const unsigned char *key, const gnutls_datum_t *chain, unsigned int chain_size);
+
+#endif /* _VTLS_VERIFYCACHE_H */
@@ -60,6 +60,8 @@
 #include "common.h"
 #include "timeval.h"
 #include "backend.h"
+#include "offload.h"
+#include "uring.h"
 
 /*
 #include "slist.h"
@@ -95,6 +97,7 @@ static const struct _vtls_config_st _default_config_static = {
 	NULL, /* CApath: certificate directory (doesn't work on windows) */
 	NULL, /* CAfile: certificate to verify peer against */
 	NULL, /* CRLfile; CRL to check certificate revocation */
+	NULL, /* CAstore: compiled CA store, see vtls-trustc */
 	NULL, /* CERTfile: */
 	NULL, /* KEYfile: */
 	NULL, /* issuercert: optional issuer certificate filename */
@@ -103,17 +106,30 @@ static const struct _vtls_config_st _default_config_static = {
 	NULL, /* cipher_list; list of ciphers to use */
 	NULL, /* username: TLS username (for, e.g., SRP) */
 	NULL, /* password: TLS password (for, e.g., SRP) */
+	NULL, /* session_file: persistent TLS session store */
+	NULL, /* session_shm: POSIX shm name of a TLS session store shared between processes */
 	30*1000, /* connect timeout in ms */
 	30*1000, /* read timeout in ms */
 	30*1000, /* write timeout in ms */
+	0, /* trust_preload: load the trust store in vtls_init(), using that many threads */
+	0, /* verify_cache_ttl: seconds to remember verified peer chains, 0 = off */
+	64, /* session_cache: max. number of TLS sessions cached for resumption, 0 = off */
+	VTLS_TRACE_NONE, /* trace_level: VTLS_TRACE_*, only used from the config given to vtls_init() */
+	0, /* handshake_threads: run reactor handshakes on that many threads, 0 = inline */
+	0, /* io_uring: receive buffers per reactor io_uring, 0 = epoll */
+	0, /* read_ahead: bytes read from the socket at once, 0 = what GnuTLS asks for */
 	CURL_TLSAUTH_NONE, /* TLS authentication type (default NONE) */
 	CURL_SSLVERSION_TLSv1_0,	/* version: what TLS version the client wants to use */
 	1, /* verifypeer: if peer verification is requested */
 	1, /* verifyhost: if hostname matching is requested */
 	1, /* verifystatus: if certificate status check is requested */
-	0  /* cert_type: filetype of CERTfile and KEYfile */
+	0, /* cert_type: filetype of CERTfile and KEYfile */
+	0, /* capath_hashed: CApath is a c_rehash style directory, load CA certs on demand */
+	0, /* trust_reload: reload CA certs and CRLs when their files change */
+	0  /* ktls: move the record layer into the kernel after the handshake, if possible */
 };
 static vtls_config_t *_default_config;
+int _vtls_trace_level;
 
 void  __attribute__ ((format (printf, 2, 3))) error_printf(vtls_config_t *config, const char *fmt, ...)
 {
@@ -220,6 +236,45 @@ int vtls_config_init(vtls_config_t **config, ...)
 		case VTLS_CFG_WRITE_TIMEOUT:
 			(*config)->write_timeout = va_arg(args, int);
 			break;
+		case VTLS_CFG_CA_PATH_HASHED:
+			(*config)->capath_hashed = va_arg(args, int);
+			break;
+		case VTLS_CFG_CA_STORE:
+			FETCH_AND_DUP(CAstore);
+			break;
+		case VTLS_CFG_TRUST_RELOAD:
+			(*config)->trust_reload = va_arg(args, int);
+			break;
+		case VTLS_CFG_KTLS:
+			(*config)->ktls = va_arg(args, int);
+			break;
+		case VTLS_CFG_TRUST_PRELOAD:
+			(*config)->trust_preload = va_arg(args, int);
+			break;
+		case VTLS_CFG_VERIFY_CACHE_TTL:
+			(*config)->verify_cache_ttl = va_arg(args, int);
+			break;
+		case VTLS_CFG_SESSION_CACHE:
+			(*config)->session_cache = va_arg(args, int);
+			break;
+		case VTLS_CFG_TRACE_LEVEL:
+			(*config)->trace_level = va_arg(args, int);
+			break;
+		case VTLS_CFG_HANDSHAKE_THREADS:
+			(*config)->handshake_threads = va_arg(args, int);
+			break;
+		case VTLS_CFG_IO_URING:
+			(*config)->io_uring = va_arg(args, int);
+			break;
+		case VTLS_CFG_READ_AHEAD:
+			(*config)->read_ahead = va_arg(args, int);
+			break;
+		case VTLS_CFG_SESSION_FILE:
+			FETCH_AND_DUP(session_file);
+			break;
+		case VTLS_CFG_SESSION_SHM:
+			FETCH_AND_DUP(session_shm);
+			break;
 		default:
 			/* unknown key */
 			if ((*config)->errormsg_callback)
@@ -242,9 +297,16 @@ int vtls_config_matches(const vtls_config_t *data, const vtls_config_t *needle)
 		(data->verifypeer == needle->verifypeer) &&
 		(data->verifyhost == needle->verifyhost) &&
 		(data->verifystatus == needle->verifystatus) &&
+		(data->capath_hashed == needle->capath_hashed) &&
+		(data->trust_reload == needle->trust_reload) &&
+		(data->verify_cache_ttl == needle->verify_cache_ttl) &&
+		(data->session_cache == needle->session_cache) &&
 		vtls_strcaseequal_ascii(data->CApath, needle->CApath) &&
 		vtls_strcaseequal_ascii(data->CAfile, needle->CAfile) &&
 		vtls_strcaseequal_ascii(data->CRLfile, needle->CRLfile) &&
+		vtls_strcaseequal_ascii(data->CAstore, needle->CAstore) &&
+		vtls_strcaseequal_ascii(data->session_file, needle->session_file) &&
+		vtls_strcaseequal_ascii(data->session_shm, needle->session_shm) &&
 		vtls_strcaseequal_ascii(data->CERTfile, needle->CERTfile) &&
 		vtls_strcaseequal_ascii(data->KEYfile, needle->KEYfile) &&
 		vtls_strcaseequal_ascii(data->issuercert, needle->issuercert) &&
@@ -275,10 +337,17 @@ int vtls_config_clone(const vtls_config_t *src, vtls_config_t **dst)
 	DUP_MEMBER(CAfile);
 	DUP_MEMBER(CApath);
 	DUP_MEMBER(CRLfile);
+	DUP_MEMBER(CAstore);
+	DUP_MEMBER(CERTfile);
+	DUP_MEMBER(KEYfile);
 	DUP_MEMBER(issuercert);
 	DUP_MEMBER(random_file);
 	DUP_MEMBER(egdsocket);
 	DUP_MEMBER(cipher_list);
+	DUP_MEMBER(username);
+	DUP_MEMBER(password);
+	DUP_MEMBER(session_file);
+	DUP_MEMBER(session_shm);
 
 	return 0;
 }
@@ -292,13 +361,17 @@ void vtls_config_deinit(vtls_config_t *config)
 	xfree(config->CAfile);
 	xfree(config->CApath);
 	xfree(config->CRLfile);
+	xfree(config->CAstore);
 	xfree(config->CERTfile);
 	xfree(config->KEYfile);
+	xfree(config->issuercert);
 	xfree(config->cipher_list);
 	xfree(config->egdsocket);
 	xfree(config->random_file);
 	xfree(config->username);
 	xfree(config->password);
+	xfree(config->session_file);
+	xfree(config->session_shm);
 	xfree(config);
 }
 
@@ -334,8 +407,12 @@ int vtls_init(vtls_config_t *config)
 
 	if (ret)
 		_init_vtls = 0; /* oom situation in vtls_config_close, allow vtls_init() again later */
-	else
-		ret = backend_init(config);
+	else {
+		_vtls_trace_level = _default_config->trace_level;
+		uring_configure(_default_config->io_uring);
+		if ((ret = backend_init(_default_config)) == 0)
+			ret = offload_init(_default_config->handshake_threads);
+	}
 
 	if (config && config->lock_callback)
 		config->lock_callback(0);
@@ -348,6 +425,7 @@ void vtls_deinit(void)
 {
 	if (--_init_vtls == 0) {
 		/* only cleanup if we did a previous init */
+		offload_deinit();
 		backend_deinit();
 		vtls_config_deinit(_default_config);
 		_default_config = NULL;
@@ -375,39 +453,162 @@ int vtls_session_init(vtls_session_t **sess, vtls_config_t *config)
 void vtls_session_deinit(vtls_session_t *sess)
 {
 	backend_session_deinit(sess);
+	uring_free(sess);
 	xfree(sess->hostname);
 	xfree(sess);
 }
 
-int vtls_connect(vtls_session_t *sess, int sockfd, const char *hostname)
+static int connect_start(vtls_session_t *sess, int sockfd, const char *hostname)
 {
+	xfree(sess->hostname);
+	if (!(sess->hostname = strdup(hostname)))
+		return CURLE_OUT_OF_MEMORY;
+
 	/* mark this is being ssl-enabled from here on. */
 	sess->use = 1;
 	sess->state = ssl_connection_negotiating;
+	sess->connecting_state = ssl_connect_1;
 	sess->sockfd = sockfd;
-	sess->hostname = strdup(hostname);
-	sess->connect_start = curlx_tvnow();
+
+	/* a reactor keeps the connect deadline in its timer wheel */
+	if (!sess->reactor_data) {
+		sess->connect_start = curlx_tvnow();
+		uring_free(sess); /* data left over from an earlier connection */
+	}
+
+	return 0;
+}
+
+int vtls_connect(vtls_session_t *sess, int sockfd, const char *hostname)
+{
+	int rc;
+
+	if ((rc = connect_start(sess, sockfd, hostname)))
+		return rc;
 
 	return backend_connect(sess);
 }
 
+/**
+ * vtls_connect_nonblocking:
+ * @sess: session
+ * @sockfd: connected socket with O_NONBLOCK set
+ * @hostname: host name for SNI and certificate verification
+ * @done: set to 1 when the handshake is complete
+ *
+ * Advance the handshake as far as possible without waiting. As long as
+ * *done is 0, wait for what vtls_want() says and call again with the same
+ * arguments. The connect timeout runs from the first call.
+ *
+ * Returns: 0 or a CURLcode on error.
+ */
+int vtls_connect_nonblocking(vtls_session_t *sess, int sockfd, const char *hostname, int *done)
+{
+	int rc;
+
+	*done = 0;
+
+	if (sess->state != ssl_connection_negotiating && (rc = connect_start(sess, sockfd, hostname)))
+		return rc;
+
+	return backend_connect_nonblocking(sess, done);
+}
+
+/*
+ * Returns VTLS_WANT_READ or VTLS_WANT_WRITE while a handshake, shutdown or
+ * renegotiation waits for the socket, else 0. After vtls_read() returned
+ * CURLE_AGAIN, it says if the read waits for the socket to become writable,
+ * e.g. to answer a TLS 1.3 KeyUpdate.
+ */
+int vtls_want(vtls_session_t *sess)
+{
+	if (sess->state == ssl_connection_none)
+		return 0;
+
+	switch (sess->connecting_state) {
+	case ssl_connect_2_reading:
+		return VTLS_WANT_READ;
+	case ssl_connect_2_writing:
+		return VTLS_WANT_WRITE;
+	default:
+		return 0;
+	}
+}
+
 ssize_t vtls_write(vtls_session_t *sess, const char *buf, size_t count, int *curlcode)
 {
-	sess->write_start = curlx_tvnow();
 	return backend_write(sess, buf, count, curlcode);
 }
 
 ssize_t vtls_read(vtls_session_t *sess, char *buf, size_t count, int *curlcode)
 {
-	sess->read_start = curlx_tvnow();
 	return backend_read(sess, buf, count, curlcode);
 }
 
+/**
+ * vtls_sendfile:
+ * @sess: session
+ * @fd: file descriptor to send from
+ * @offset: position in the file, the file offset of @fd isn't changed;
+ *   ignored for pipes and sockets, they are read from
+ * @count: number of bytes to send
+ * @curlcode: error code if -1 is returned
+ *
+ * Send file content over the TLS connection with as few copies as the
+ * connection allows, kernel TLS makes that zero-copy for regular files.
+ * What was read from a pipe but not sent is lost, so use a blocking socket
+ * with those.
+ *
+ * Returns the number of bytes sent, less than @count at end of file or when
+ * a non-blocking socket is full, or -1 on error (CURLE_AGAIN if nothing
+ * could be sent yet).
+ */
+ssize_t vtls_sendfile(vtls_session_t *sess, int fd, off_t offset, size_t count, int *curlcode)
+{
+	return backend_sendfile(sess, fd, offset, count, curlcode);
+}
+
+/**
+ * vtls_cork:
+ * @sess: connected session
+ *
+ * Hold back what vtls_write() and vtls_sendfile() encrypt until
+ * vtls_flush(), so a batch of small writes leaves in one system call and,
+ * mostly, one TCP segment. Each write still becomes its own TLS record.
+ *
+ * Returns: 0 or a CURLcode on error.
+ */
+int vtls_cork(vtls_session_t *sess)
+{
+	return backend_cork(sess);
+}
+
+/**
+ * vtls_flush:
+ * @sess: session
+ *
+ * Send the records held back since vtls_cork() and stop holding back.
+ * A blocking socket waits up to the write timeout. With a non-blocking
+ * socket or a reactor, CURLE_AGAIN means the rest is still corked: call
+ * again once the socket is writable. vtls_shutdown_nonblocking() flushes
+ * before its close_notify, vtls_close() only tries once without waiting.
+ *
+ * Returns: 0 or a CURLcode on error.
+ */
+int vtls_flush(vtls_session_t *sess)
+{
+	return backend_flush(sess);
+}
+
 void vtls_close(vtls_session_t *sess)
 {
 	backend_close(sess);
 }
 
+/*
+ * Shut the TLS layer down and keep the connection for cleartext, like
+ * FTP's CCC. Fails with kernel TLS on, the kernel keeps encrypting.
+ */
 int vtls_shutdown(vtls_session_t *sess)
 {
 	if (backend_shutdown(sess))
@@ -419,6 +620,51 @@ int vtls_shutdown(vtls_session_t *sess)
 	return 0;
 }
 
+/**
+ * vtls_shutdown_nonblocking:
+ * @sess: session
+ * @how: VTLS_SHUTDOWN_FAST or VTLS_SHUTDOWN_FULL
+ * @done: set to 1 when finished
+ *
+ * Shut the TLS layer down without waiting, the socket needs O_NONBLOCK.
+ * As long as *done is 0, wait for what vtls_want() says and call again.
+ * Once done, the session is closed like with vtls_close(). To bound the
+ * time a peer may take for its close_notify, just vtls_close() instead
+ * of calling again, e.g. after SSL_SHUTDOWN_TIMEOUT.
+ *
+ * Returns: 0 or CURLE_SSL_SHUTDOWN_FAILED (also done then).
+ */
+int vtls_shutdown_nonblocking(vtls_session_t *sess, int how, int *done)
+{
+	int rc;
+
+	if (sess->state != ssl_connection_closing) {
+		sess->state = ssl_connection_closing;
+		sess->connecting_state = ssl_connect_1;
+	}
+
+	rc = backend_shutdown_nonblocking(sess, how, done);
+
+	if (*done) {
+		sess->use = 0;
+		sess->state = ssl_connection_none;
+	}
+
+	return rc;
+}
+
+/* returns 1 if the handshake resumed a cached session */
+int vtls_session_resumed(vtls_session_t *sess)
+{
+	return backend_session_resumed(sess);
+}
+
+/* number of session cache lookups that found resp. didn't find a session */
+void vtls_session_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+	backend_session_cache_stats(hits, misses);
+}
+
 size_t vtls_version(char *buffer, size_t size)
 {
 	return backend_version(buffer, size);
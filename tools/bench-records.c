@@ -0,0 +1,357 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+/*
+ * bench-records - small records through vtls_write() or vtls_read()
+ *
+ * Measures the per-record cost of the push and pull path, where a TLS
+ * record is cheap to encrypt and everything else shows: one vtls_write()
+ * of -s bytes makes one record. With -r the records are read instead,
+ * e.g. from 'openssl s_server -quiet -accept 4433 ... < bigfile'.
+ *
+ * -l installs error and debug message callbacks that drop the text, as an
+ * application logging to a file does, -t sets VTLS_CFG_TRACE_LEVEL. Push
+ * and pull used to log every record, '-l -t 2' still does that and gives
+ * the numbers from before the trace points, '-l' the ones after.
+ *
+ * -e hands the connected session to a vtls_reactor, -u to one with an
+ * io_uring of that many receive buffers. Writes then end with a
+ * vtls_reactor_shutdown(), which waits until the queued sends are out.
+ * The read() and write() calls are counted from /proc/self/io, the io_uring
+ * path should hardly make any.
+ *
+ * -c corks the session and flushes every that many records, to compare
+ * with one push per record. -a sets VTLS_CFG_READ_AHEAD, reading records
+ * with -s 4096 then shows the read() calls it saves.
+ *
+ * Usage: bench-records [-r] [-l] [-t level] [-e] [-u bufs] [-c batch] [-a bytes] [-n records] [-s size] <host> <port>
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <vtls.h>
+
+static vtls_reactor_t *reactor;
+static unsigned long messages;
+static int do_read, nrecords = 200000, size = 64, batch, records, flushing, stopping, finished;
+static long long total;
+static char *buf;
+
+static void drop_message(void *ctx, const char *fmt, va_list args)
+{
+	char buf[256];
+
+	(void) ctx;
+
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	messages++;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* read() and write() type system calls so far, Linux only */
+static void count_syscalls(unsigned long *reads, unsigned long *writes)
+{
+	FILE *fp = fopen("/proc/self/io", "r");
+	char line[64];
+
+	*reads = *writes = 0;
+	if (!fp)
+		return;
+
+	while (fgets(line, sizeof(line), fp)) {
+		sscanf(line, "syscr: %lu", reads);
+		sscanf(line, "syscw: %lu", writes);
+	}
+	fclose(fp);
+}
+
+static int connect_to(const char *host, const char *port)
+{
+	struct addrinfo hints, *ai;
+	int sockfd;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, port, &hints, &ai)) {
+		fprintf(stderr, "Failed to resolve %s\n", host);
+		return -1;
+	}
+
+	if ((sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) >= 0
+		&& connect(sockfd, ai->ai_addr, ai->ai_addrlen))
+	{
+		close(sockfd);
+		sockfd = -1;
+	}
+	if (sockfd < 0)
+		fprintf(stderr, "Failed to connect to %s:%s\n", host, port);
+
+	freeaddrinfo(ai);
+	return sockfd;
+}
+
+/* write the remaining records, 0 once all are out or a CURLcode */
+static int push(vtls_session_t *sess)
+{
+	ssize_t n;
+	int status;
+
+	for (;;) {
+		/* a flush that got CURLE_AGAIN is repeated first */
+		if (flushing) {
+			if ((status = vtls_flush(sess)))
+				return status;
+			flushing = 0;
+		}
+
+		if (records == nrecords)
+			return 0;
+
+		if (batch && (status = vtls_cork(sess)))
+			return status;
+		if ((n = vtls_write(sess, buf, size, &status)) <= 0)
+			return n < 0 ? status : CURLE_SEND_ERROR;
+		total += n;
+
+		if (++records == nrecords || (batch && records % batch == 0))
+			flushing = batch != 0;
+	}
+}
+
+/* read up to the remaining records, 0 once done or at EOF, else a CURLcode */
+static int pull(vtls_session_t *sess)
+{
+	ssize_t n;
+	int status;
+
+	for (; records < nrecords; records++) {
+		if ((n = vtls_read(sess, buf, size, &status)) < 0)
+			return status;
+		if (n == 0)
+			break;
+		total += n;
+	}
+
+	return 0;
+}
+
+static void on_event(vtls_session_t *sess, int events, void *ctx)
+{
+	int rc;
+
+	(void) ctx;
+
+	if (events & (VTLS_EVENT_ERROR | VTLS_EVENT_TIMEOUT)) {
+		fprintf(stderr, "Session failed (events %d)\n", events);
+		finished = 1;
+		return;
+	}
+
+	if ((events & (VTLS_EVENT_READABLE | VTLS_EVENT_WRITABLE)) && !stopping) {
+		if ((rc = do_read ? pull(sess) : push(sess)) == CURLE_AGAIN)
+			return;
+
+		if (rc)
+			fprintf(stderr, "Failed to %s (%d)\n", do_read ? "read" : "write", rc);
+		vtls_reactor_want_write(reactor, sess, 0);
+		stopping = 1;
+
+		/* the io_uring queue drains before VTLS_EVENT_SHUTDOWN */
+		if (rc || do_read || vtls_reactor_shutdown(reactor, sess, VTLS_SHUTDOWN_FAST))
+			finished = 1;
+	}
+
+	if (events & (VTLS_EVENT_SHUTDOWN | VTLS_EVENT_CLOSED))
+		finished = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: bench-records [-r] [-l] [-t level] [-e] [-u bufs] [-c batch] [-a bytes] [-n records] [-s size] <host> <port>\n");
+	fprintf(stderr, "Measure the cost per TLS record of vtls_write() or vtls_read().\n");
+	fprintf(stderr, "  -r  read records instead of writing them\n");
+	fprintf(stderr, "  -l  install message callbacks that drop the text\n");
+	fprintf(stderr, "  -t  VTLS_CFG_TRACE_LEVEL (default 0)\n");
+	fprintf(stderr, "  -e  run the session on a vtls_reactor\n");
+	fprintf(stderr, "  -u  run it on a reactor with an io_uring of that many buffers (VTLS_CFG_IO_URING)\n");
+	fprintf(stderr, "  -c  cork the writes and flush every that many records\n");
+	fprintf(stderr, "  -a  read ahead that many bytes (VTLS_CFG_READ_AHEAD)\n");
+	fprintf(stderr, "  -n  number of records (default 200000)\n");
+	fprintf(stderr, "  -s  bytes per record (default 64)\n");
+}
+
+int main(int argc, char **argv)
+{
+	vtls_config_t *config;
+	vtls_session_t *sess;
+	int opt, logging = 0, trace = 0, use_reactor = 0, uring = 0, read_ahead = 0, sockfd, rc;
+	unsigned long reads, writes, reads_end, writes_end;
+	double start, cpu;
+
+	while ((opt = getopt(argc, argv, "rlt:eu:c:a:n:s:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			do_read = 1;
+			break;
+		case 'l':
+			logging = 1;
+			break;
+		case 't':
+			trace = atoi(optarg);
+			break;
+		case 'e':
+			use_reactor = 1;
+			break;
+		case 'u':
+			use_reactor = 1;
+			uring = atoi(optarg);
+			break;
+		case 'c':
+			batch = atoi(optarg);
+			break;
+		case 'a':
+			read_ahead = atoi(optarg);
+			break;
+		case 'n':
+			nrecords = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		default:
+			usage();
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (argc - optind != 2 || nrecords < 1 || size < 1 || size > 16384 || batch < 0 || read_ahead < 0) {
+		usage();
+		return 1;
+	}
+
+	if (vtls_config_init(&config,
+		VTLS_CFG_TLS_VERSION, CURL_SSLVERSION_TLSv1,
+		VTLS_CFG_VERIFY_PEER, 0,
+		VTLS_CFG_VERIFY_HOST, 0,
+		VTLS_CFG_VERIFY_STATUS, 0,
+		VTLS_CFG_ERRORMSG_CALLBACK, logging ? drop_message : NULL, NULL,
+		VTLS_CFG_DEBUGMSG_CALLBACK, logging ? drop_message : NULL, NULL,
+		VTLS_CFG_TRACE_LEVEL, trace,
+		VTLS_CFG_IO_URING, uring,
+		VTLS_CFG_READ_AHEAD, read_ahead,
+		NULL) || vtls_init(config))
+	{
+		fprintf(stderr, "Failed to init vtls\n");
+		return 1;
+	}
+
+	if (!(buf = malloc(size))) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	memset(buf, 'x', size);
+
+	if ((sockfd = connect_to(argv[optind], argv[optind + 1])) < 0)
+		return 1;
+
+	if ((rc = vtls_session_init(&sess, NULL)) || (rc = vtls_connect(sess, sockfd, argv[optind]))) {
+		fprintf(stderr, "Failed to connect (%d)\n", rc);
+		return 1;
+	}
+
+	/* a connected session is taken over as it is */
+	if (use_reactor && ((rc = vtls_reactor_init(&reactor))
+		|| (rc = vtls_reactor_add(reactor, sess, sockfd, argv[optind], on_event, NULL))))
+	{
+		fprintf(stderr, "Failed to set up the reactor (%d)\n", rc);
+		return 1;
+	}
+
+	messages = 0;
+	count_syscalls(&reads, &writes);
+	start = now();
+	cpu = cpu_time();
+	if (!use_reactor) {
+		if ((rc = do_read ? pull(sess) : push(sess)))
+			fprintf(stderr, "Failed to %s (%d)\n", do_read ? "read" : "write", rc);
+	} else {
+		if (!do_read)
+			vtls_reactor_want_write(reactor, sess, 1);
+		while (!finished && vtls_reactor_run(reactor, 1000) >= 0)
+			;
+	}
+	start = now() - start;
+	cpu = cpu_time() - cpu;
+	count_syscalls(&reads_end, &writes_end);
+
+	printf("%s %d x %d bytes: %lld bytes in %.3f s, %.0f records/s, %.3f us CPU per record, %lu messages,"
+		" %lu read() and %lu write() calls\n",
+		do_read ? "read" : "write", records, size, total, start, records / start, cpu * 1e6 / (records ? records : 1),
+		messages, reads_end - reads, writes_end - writes);
+
+	if (reactor) {
+		vtls_reactor_remove(reactor, sess);
+		vtls_reactor_deinit(reactor);
+	}
+	vtls_close(sess);
+	vtls_session_deinit(sess);
+	close(sockfd);
+	free(buf);
+
+	vtls_config_deinit(config);
+	vtls_deinit();
+
+	return 0;
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+/*
+ * bench-sendfile - compare vtls_sendfile() with a read()/vtls_write() loop
+ *
+ * Sends a file to a TLS sink and reports wall clock and CPU time, e.g.
+ * against 'openssl s_server -quiet -accept 4433 ... > /dev/null'.
+ * A file name of "-" sends stdin, to measure pipes.
+ *
+ * Usage: bench-sendfile [-k] [-w] [-n runs] <host> <port> <file>
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <vtls.h>
+
+static int use_write;
+
+static void errormsg(void *ctx, const char *fmt, va_list args)
+{
+	(void) ctx;
+
+	vfprintf(stderr, fmt, args);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int connect_to(const char *host, const char *port)
+{
+	struct addrinfo hints, *ai;
+	int sockfd;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, port, &hints, &ai)) {
+		fprintf(stderr, "Failed to resolve %s\n", host);
+		return -1;
+	}
+
+	if ((sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) >= 0
+		&& connect(sockfd, ai->ai_addr, ai->ai_addrlen))
+	{
+		close(sockfd);
+		sockfd = -1;
+	}
+	if (sockfd < 0)
+		fprintf(stderr, "Failed to connect to %s:%s\n", host, port);
+
+	freeaddrinfo(ai);
+	return sockfd;
+}
+
+/* the whole of @fd from offset 0, returns the bytes sent or -1 */
+static long long send_fd(vtls_session_t *sess, int fd)
+{
+	long long total = 0;
+	ssize_t n, done, rc;
+	int status;
+
+	if (!use_write) {
+		/* vtls_sendfile() stops at EOF and at the size of regular files */
+		while ((n = vtls_sendfile(sess, fd, total, 1 << 30, &status)) > 0)
+			total += n;
+		return n < 0 ? -1 : total;
+	}
+
+	for (;;) {
+		char buf[16384];
+
+		if ((n = pread(fd, buf, sizeof(buf), total)) < 0 && (n = read(fd, buf, sizeof(buf))) < 0)
+			return -1;
+		if (n == 0)
+			return total;
+
+		for (done = 0; done < n; done += rc) {
+			if ((rc = vtls_write(sess, buf + done, n - done, &status)) <= 0)
+				return -1;
+		}
+		total += n;
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: bench-sendfile [-k] [-w] [-n runs] <host> <port> <file>\n");
+	fprintf(stderr, "Send <file> (- for stdin) over TLS and report the throughput.\n");
+	fprintf(stderr, "  -k  enable kernel TLS (VTLS_CFG_KTLS)\n");
+	fprintf(stderr, "  -w  use pread()/vtls_write() instead of vtls_sendfile()\n");
+	fprintf(stderr, "  -n  number of connections, one after another (default 1)\n");
+}
+
+int main(int argc, char **argv)
+{
+	vtls_config_t *config;
+	vtls_session_t *sess;
+	int opt, ktls = 0, runs = 1, run, sockfd, fd, rc;
+	double start, cpu;
+	long long sent;
+
+	while ((opt = getopt(argc, argv, "kwn:h")) != -1) {
+		switch (opt) {
+		case 'k':
+			ktls = 1;
+			break;
+		case 'w':
+			use_write = 1;
+			break;
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		default:
+			usage();
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (argc - optind != 3 || runs < 1) {
+		usage();
+		return 1;
+	}
+
+	if (strcmp(argv[optind + 2], "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(argv[optind + 2], O_RDONLY)) < 0) {
+		fprintf(stderr, "Failed to open %s\n", argv[optind + 2]);
+		return 1;
+	}
+
+	if (vtls_config_init(&config,
+		VTLS_CFG_TLS_VERSION, CURL_SSLVERSION_TLSv1,
+		VTLS_CFG_VERIFY_PEER, 0,
+		VTLS_CFG_VERIFY_HOST, 0,
+		VTLS_CFG_VERIFY_STATUS, 0,
+		VTLS_CFG_KTLS, ktls,
+		VTLS_CFG_ERRORMSG_CALLBACK, errormsg, NULL,
+		NULL) || vtls_init(config))
+	{
+		fprintf(stderr, "Failed to init vtls\n");
+		return 1;
+	}
+
+	for (run = 0; run < runs; run++) {
+		if ((sockfd = connect_to(argv[optind], argv[optind + 1])) < 0)
+			return 1;
+
+		if ((rc = vtls_session_init(&sess, NULL)) || (rc = vtls_connect(sess, sockfd, argv[optind]))) {
+			fprintf(stderr, "Failed to connect (%d)\n", rc);
+			return 1;
+		}
+
+		start = now();
+		cpu = cpu_time();
+		if ((sent = send_fd(sess, fd)) < 0) {
+			fprintf(stderr, "Failed to send\n");
+			return 1;
+		}
+		vtls_close(sess);
+
+		start = now() - start;
+		cpu = cpu_time() - cpu;
+		printf("%s%s: %lld bytes in %.3f s (%.1f MB/s), %.3f s CPU\n",
+			use_write ? "vtls_write" : "vtls_sendfile", ktls ? " kTLS" : "",
+			sent, start, sent / start / 1e6, cpu);
+
+		vtls_session_deinit(sess);
+		close(sockfd);
+	}
+
+	vtls_config_deinit(config);
+	vtls_deinit();
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+/*
+ * bench-sesscache - session cache lookups from many threads at once
+ *
+ * Every thread looks up random keys of a shared set, a few of the calls
+ * store a session instead, like a handshake that didn't resume. A set of
+ * one key measures the worst case, all threads on one entry.
+ *
+ * Usage: bench-sesscache [-t threads] [-k keys] [-c entries] [-n lookups] [-p puts per 1000]
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <gnutls/gnutls.h>
+
+#include "sesscache.h"
+
+static sesscache_t *cache;
+static int nkeys = 16, nlookups = 1000000;
+static unsigned int puts_per_mille = 1;
+static unsigned char session[1024]; /* about a TLS 1.3 ticket */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void key_name(char *key, size_t size, int n)
+{
+	snprintf(key, size, "upstream%d.example.com:443", n);
+}
+
+static void *worker(void *arg)
+{
+	gnutls_datum_t data = { session, sizeof(session) };
+	unsigned int seed = (unsigned int) (size_t) arg;
+	char key[64];
+	int it;
+
+	for (it = 0; it < nlookups; it++) {
+		key_name(key, sizeof(key), rand_r(&seed) % nkeys);
+
+		if (puts_per_mille && (unsigned int) rand_r(&seed) % 1000 < puts_per_mille)
+			sesscache_put(cache, key, &data, time(NULL) + 3600);
+		else if (sesscache_get(cache, key, &data) == 0)
+			free(data.data);
+		data.data = session;
+	}
+
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: bench-sesscache [-t threads] [-k keys] [-c entries] [-n lookups] [-p puts per 1000]\n");
+	fprintf(stderr, "Measure session cache lookups per second with concurrent threads.\n");
+}
+
+int main(int argc, char **argv)
+{
+	gnutls_datum_t data = { session, sizeof(session) };
+	pthread_t *threads;
+	unsigned long hits, misses;
+	int opt, nthreads = 4, entries = 64, it;
+	char key[64];
+	double start;
+
+	while ((opt = getopt(argc, argv, "t:k:c:n:p:h")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'k':
+			nkeys = atoi(optarg);
+			break;
+		case 'c':
+			entries = atoi(optarg);
+			break;
+		case 'n':
+			nlookups = atoi(optarg);
+			break;
+		case 'p':
+			puts_per_mille = (unsigned int) strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (nthreads < 1 || nkeys < 1 || entries < 1 || nlookups < 1) {
+		usage();
+		return 1;
+	}
+
+	if (!(cache = sesscache_init(entries)) || !(threads = calloc(nthreads, sizeof(*threads)))) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	for (it = 0; it < nkeys; it++) {
+		key_name(key, sizeof(key), it);
+		sesscache_put(cache, key, &data, time(NULL) + 3600);
+	}
+
+	start = now();
+	for (it = 0; it < nthreads; it++)
+		pthread_create(&threads[it], NULL, worker, (void *) (size_t) (it + 1));
+	for (it = 0; it < nthreads; it++)
+		pthread_join(threads[it], NULL);
+	start = now() - start;
+
+	sesscache_stats(&hits, &misses);
+	printf("%d threads, %d keys, %d entries: %.0f calls/s, %lu hits, %lu misses\n",
+		nthreads, nkeys, entries, (double) nthreads * nlookups / start, hits, misses);
+
+	sesscache_deinit(cache);
+	free(threads);
+
+	return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright(c) 2015 Tim Ruehsen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * This file is part of libvtls.
+ */
+
+/*
+ * vtls-trustc - compile CA certificates into a libvtls CA store
+ *
+ * Reads PEM (or DER) CA certificates from bundle files and directories and
+ * writes them into one indexed file, to be used with VTLS_CFG_CA_STORE.
+ *
+ * Usage: vtls-trustc -o <store> <file|dir>...
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+#include "castore.h"
+
+static gnutls_datum_t *certs;
+static unsigned int ncerts, max_certs;
+
+static int add_cert(gnutls_x509_crt_t crt)
+{
+	if (ncerts >= max_certs) {
+		unsigned int max = max_certs ? max_certs * 2 : 256;
+		gnutls_datum_t *p;
+
+		if (!(p = realloc(certs, max * sizeof(gnutls_datum_t))))
+			return -1;
+
+		certs = p;
+		max_certs = max;
+	}
+
+	if (gnutls_x509_crt_export2(crt, GNUTLS_X509_FMT_DER, &certs[ncerts]) < 0)
+		return -1;
+
+	ncerts++;
+	return 0;
+}
+
+static int add_file(const char *fname)
+{
+	gnutls_datum_t data;
+	gnutls_x509_crt_t *crts;
+	unsigned int n, it;
+	int rc;
+
+	if ((rc = gnutls_load_file(fname, &data)) < 0) {
+		fprintf(stderr, "Failed to read %s (%s)\n", fname, gnutls_strerror(rc));
+		return -1;
+	}
+
+	rc = gnutls_x509_crt_list_import2(&crts, &n, &data, GNUTLS_X509_FMT_PEM, 0);
+	if (rc < 0)
+		rc = gnutls_x509_crt_list_import2(&crts, &n, &data, GNUTLS_X509_FMT_DER, 0);
+	gnutls_free(data.data);
+
+	if (rc < 0) {
+		fprintf(stderr, "No certificates in %s (%s)\n", fname, gnutls_strerror(rc));
+		return -1;
+	}
+
+	for (it = 0; it < n; it++) {
+		if (add_cert(crts[it]))
+			rc = -1;
+		gnutls_x509_crt_deinit(crts[it]);
+	}
+	gnutls_free(crts);
+
+	return rc < 0 ? -1 : 0;
+}
+
+static int add_dir(const char *dirname)
+{
+	DIR *dir;
+	struct dirent *dp;
+	size_t dirlen = strlen(dirname);
+	int rc = 0;
+
+	if (!(dir = opendir(dirname))) {
+		fprintf(stderr, "Failed to open directory %s\n", dirname);
+		return -1;
+	}
+
+	while ((dp = readdir(dir))) {
+		size_t len = strlen(dp->d_name);
+		char fname[dirlen + 1 + len + 1];
+		struct stat st;
+
+		if (*dp->d_name == '.')
+			continue;
+
+		/* c_rehash links are followed too, castore_write() drops the duplicates */
+		snprintf(fname, sizeof(fname), "%s/%s", dirname, dp->d_name);
+		if (stat(fname, &st) == 0 && S_ISREG(st.st_mode) && add_file(fname))
+			rc = -1;
+	}
+
+	closedir(dir);
+	return rc;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: vtls-trustc -o <store> <file|dir>...\n");
+	fprintf(stderr, "Compile CA certificates from PEM/DER files and directories into a CA store.\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *output = NULL;
+	unsigned int it;
+	int opt, rc, errors = 0;
+
+	while ((opt = getopt(argc, argv, "o:h")) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage();
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!output || optind >= argc) {
+		usage();
+		return 1;
+	}
+
+	gnutls_global_init();
+
+	for (; optind < argc; optind++) {
+		struct stat st;
+
+		if (stat(argv[optind], &st)) {
+			fprintf(stderr, "Failed to stat %s\n", argv[optind]);
+			errors++;
+		} else if (S_ISDIR(st.st_mode))
+			errors += add_dir(argv[optind]) != 0;
+		else
+			errors += add_file(argv[optind]) != 0;
+	}
+
+	if ((rc = castore_write(output, certs, ncerts)) < 0)
+		fprintf(stderr, "Failed to write %s\n", output);
+	else
+		printf("%d CA certificates written to %s\n", rc, output);
+
+	for (it = 0; it < ncerts; it++)
+		gnutls_free(certs[it].data);
+	free(certs);
+
+	gnutls_global_deinit();
+
+	return rc < 0 ? 1 : (errors ? 2 : 0);
+}